@@ -4,6 +4,7 @@
 
 #include "diskio.h"
 #include "../memoryCard.h"
+#include "../cardArray.h"
 
 /*-----------------------------------------------------------------------*/
 /* Initialize Disk Drive                                                 */
@@ -11,7 +12,7 @@
 
 DSTATUS disk_initialize (void)
 {
-	if (memCard_initCard())
+	if (cardArray_initCards())
         return 0x00;
 
 	return STA_NOINIT;
@@ -30,7 +31,17 @@ DRESULT disk_readp (
 	UINT count		/* Byte count (bit15:destination) */
 )
 {
-	if (!memCard_readFromDisk(sector, offset, buff, count))
+	if (!buff) {
+		// Forward the data to the stream (see memCard_setForwardSink)
+        if (!cardArray_forwardFromDisk(sector, offset, count))
+        {
+            return RES_ERROR;
+        }
+
+		return RES_OK;
+	}
+
+	if (!cardArray_readFromDisk(sector, offset, buff, count))
     {
         return RES_ERROR;
     }
@@ -56,7 +67,7 @@ DRESULT disk_writep (
 		if (sc) {
 
 			// Initiate write process
-            if (!memCard_prepareWrite(sc))
+            if (!cardArray_prepareWrite(sc))
             {
                 res = RES_NOTRDY;
             }
@@ -64,7 +75,7 @@ DRESULT disk_writep (
 		} else {
 
 			// Finalize write process
-            if (memCard_writeBlock() != CARD_NO_ERROR)
+            if (cardArray_writeBlock() != CARD_NO_ERROR)
             {
                 res = RES_ERROR;
             }
@@ -72,7 +83,7 @@ DRESULT disk_writep (
 	} else {
 
 		// Send data to the disk
-        if (!memCard_queueWrite(buff, sc))
+        if (!cardArray_queueWrite(buff, sc))
         {
             res = RES_ERROR;
         }
@@ -82,3 +93,188 @@ DRESULT disk_writep (
 	return res;
 }
 
+
+
+/*-----------------------------------------------------------------------*/
+/* Program the Queued Writes                                             */
+/*-----------------------------------------------------------------------*/
+/* Sectors finalized with disk_writep(0, 0) can be held in a write queue */
+/* (MEM_CARD_WRITE_QUEUE_DEPTH). This programs them in LBA order.        */
+
+DRESULT disk_flushp (void)
+{
+	if (!cardArray_flushWrites())
+	{
+		return RES_ERROR;
+	}
+
+	return RES_OK;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Get the Write Alignment                                               */
+/*-----------------------------------------------------------------------*/
+/* Returns the allocation unit of the card in sectors (0:Not known).     */
+/* Writes to a run that starts on an allocation unit are the fastest.    */
+
+DWORD disk_alignp (void)
+{
+	return cardArray_getAllocationUnit();
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Erase Sectors                                                         */
+/*-----------------------------------------------------------------------*/
+/* The card erases in the background. Only whole erase units inside the  */
+/* range are erased, so this is a hint and not a way to clear data.      */
+
+DRESULT disk_erasep (
+	DWORD sector,	/* First sector number (LBA) */
+	DWORD count		/* Number of sectors */
+)
+{
+	if (!cardArray_startErase(sector, count))
+	{
+		return RES_ERROR;
+	}
+
+	return RES_OK;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Initiate an In-Place Update of a Sector                               */
+/*-----------------------------------------------------------------------*/
+/* Same as disk_writep(0, sector), but the current sector data is kept,  */
+/* so only the bytes sent with disk_writep() are changed.                */
+
+DRESULT disk_updatep (
+	DWORD sector	/* Sector number (LBA) */
+)
+{
+	if (!cardArray_prepareUpdate(sector))
+    {
+        return RES_NOTRDY;
+    }
+
+	return RES_OK;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Move the Write Position in the Sector                                 */
+/*-----------------------------------------------------------------------*/
+
+DRESULT disk_seekp (
+	UINT offset		/* Byte offset in the sector for the next disk_writep() */
+)
+{
+	if (!cardArray_seekWrite(offset))
+    {
+        return RES_PARERR;
+    }
+
+	return RES_OK;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Borrow a Sector from the Cache                                        */
+/*-----------------------------------------------------------------------*/
+/* Returns a pointer to the sector data in the driver cache (NULL:Error) */
+/* The sector stays in the cache until disk_releasep() is called.        */
+
+const BYTE* disk_borrowp (
+	DWORD sector	/* Sector number (LBA) */
+)
+{
+	return cardArray_borrowSector(sector);
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Release the Borrowed Sector                                           */
+/*-----------------------------------------------------------------------*/
+
+void disk_releasep (void)
+{
+	cardArray_releaseSector();
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Set the Read-Ahead Depth                                              */
+/*-----------------------------------------------------------------------*/
+/* Number of sectors the driver reads ahead of sequential reads (0:Off)  */
+
+void disk_hintp (
+	BYTE depth		/* Number of sectors to read ahead */
+)
+{
+	cardArray_setPrefetchDepth(depth);
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Set the CRC Policy                                                    */
+/*-----------------------------------------------------------------------*/
+/* Transfers started after this call are verified with CRCs (1), or sent */
+/* and received without any CRC work (0). Returns the previous setting,  */
+/* so that it can be restored.                                           */
+
+BYTE disk_crcp (
+	BYTE verify		/* 1:Verified, 0:Best effort */
+)
+{
+	return (cardArray_setCRCPolicy((verify) ? CRC_POLICY_VERIFIED : CRC_POLICY_OFF) == CRC_POLICY_VERIFIED) ? 1 : 0;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Get the Card ID                                                       */
+/*-----------------------------------------------------------------------*/
+/* Copies the 16-byte CID register of the initialized card               */
+
+DRESULT disk_idp (
+	BYTE* buff		/* Pointer to the 16-byte destination */
+)
+{
+	if (!cardArray_getCardID(buff))
+	{
+		return RES_NOTRDY;
+	}
+
+	return RES_OK;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Select the Drive                                                      */
+/*-----------------------------------------------------------------------*/
+/* Drive n is card slot n, or a striped or mirrored card array is        */
+/* drive 0 (see cardArray.h). The other disk functions work on the       */
+/* selected drive.                                                       */
+
+DRESULT disk_select (
+	BYTE drv		/* Drive number */
+)
+{
+	if (!cardArray_selectDrive(drv))
+	{
+		return RES_NOTRDY;
+	}
+
+	return RES_OK;
+}
@@ -31,6 +31,17 @@ typedef enum {
 DSTATUS disk_initialize (void);
 DRESULT disk_readp (BYTE* buff, DWORD sector, UINT offser, UINT count);
 DRESULT disk_writep (BYTE* buff, DWORD sc);
+DRESULT disk_flushp (void);
+DRESULT disk_erasep (DWORD sector, DWORD count);
+DWORD disk_alignp (void);
+DRESULT disk_updatep (DWORD sector);
+DRESULT disk_seekp (UINT offset);
+const BYTE* disk_borrowp (DWORD sector);
+void disk_releasep (void);
+void disk_hintp (BYTE depth);
+BYTE disk_crcp (BYTE verify);
+DRESULT disk_idp (BYTE* buff);
+DRESULT disk_select (BYTE drv);
 
 #define STA_NOINIT		0x01	/* Drive not initialized */
 #define STA_NODISK		0x02	/* No medium in the drive */
@@ -64,7 +64,21 @@
 #define _FS_32ONLY 0
 #endif
 
-#define ABORT(err)	{fs->flag = 0; return err;}
+#if PF_USE_PREALLOC && !PF_USE_APPEND
+#error PF_USE_PREALLOC requires PF_USE_APPEND
+#endif
+
+#if PF_USE_VIEW && !PF_USE_READ
+#error PF_USE_VIEW requires PF_USE_READ
+#endif
+
+#if PF_USE_APPEND
+#define ABORT(err)	{fp->flag = 0; if (fs->wip == fp) fs->wip = 0; if (fs->alloc == fp) fs->alloc = 0; return err;}
+#else
+#define ABORT(err)	{fp->flag = 0; if (fs->wip == fp) fs->wip = 0; return err;}
+#endif
+
+#define END_OF_CHAIN	((CLUST)0x0FFFFFFF)	/* End of cluster chain mark (truncated to 0xFFFF on FAT16) */
 
 
 
@@ -364,6 +378,8 @@
 #define	DIR_FstClusLO		26
 #define	DIR_FileSize		28
 
+#define	DDEM				0xE5	/* Deleted directory entry mark */
+
 
 
 
@@ -375,6 +391,37 @@
 
 
 static FATFS *FatFs;	/* Pointer to the file system object (logical drive) */
+static WORD Fsid;		/* Mount ID counter */
+
+#if PF_VOLUMES > 1
+static FATFS *Vol[PF_VOLUMES];	/* File system object mounted on each drive */
+static BYTE CurrDrv;			/* Current drive */
+#else
+#define CurrDrv	0
+#endif
+
+#if PF_USE_REMOUNT
+/* Geometry of the last volume mounted on each drive, kept across card removal */
+typedef struct {
+	BYTE	valid;		/* Snapshot is valid */
+	BYTE	cid[16];	/* CID of the card */
+	DWORD	bsect;		/* Boot sector (lba) */
+	DWORD	volid;		/* Volume serial number */
+	BYTE	fs_type;
+	BYTE	csize;
+	WORD	n_rootdir;
+	CLUST	n_fatent;
+	DWORD	fatbase;
+	DWORD	dirbase;
+	DWORD	database;
+#if PF_USE_APPEND
+	BYTE	n_fats;
+	DWORD	fatsize;
+#endif
+} SNAP;
+
+static SNAP Snap[PF_VOLUMES];
+#endif
 
 
 /*-----------------------------------------------------------------------*/
@@ -401,6 +448,22 @@ static DWORD ld_dword (const BYTE* ptr)	/* Load a 4-byte little-endian word */
 	return rv;
 }
 
+#if PF_USE_APPEND
+static void st_word (BYTE* ptr, WORD val)	/* Store a 2-byte word in little-endian */
+{
+	*ptr++ = (BYTE)val; val >>= 8;
+	*ptr = (BYTE)val;
+}
+
+static void st_dword (BYTE* ptr, DWORD val)	/* Store a 4-byte word in little-endian */
+{
+	*ptr++ = (BYTE)val; val >>= 8;
+	*ptr++ = (BYTE)val; val >>= 8;
+	*ptr++ = (BYTE)val; val >>= 8;
+	*ptr = (BYTE)val;
+}
+#endif
+
 
 
 /*-----------------------------------------------------------------------*/
@@ -472,6 +535,218 @@ static CLUST get_fat (	/* 1:IO error, Else:Cluster status */
 
 
 
+#if PF_USE_APPEND
+/*-----------------------------------------------------------------------*/
+/* FAT access - Write a chain of FAT entries                             */
+/*-----------------------------------------------------------------------*/
+/* Entries clst..clst+cnt-1 are linked to the following cluster and the  */
+/* last one is set to val. Each FAT sector is written once per FAT copy. */
+
+static FRESULT put_fat (
+	CLUST clst,		/* First cluster# of the chain */
+	CLUST cnt,		/* Number of entries to write */
+	CLUST val		/* Value of the last entry (next cluster# or end of chain mark) */
+)
+{
+	BYTE buf[32], es, f;
+	UINT ofs, n, i, bc;
+	CLUST c, ec;
+	DWORD sect;
+	FATFS *fs = FatFs;
+
+
+	if (clst < 2 || !cnt || clst + cnt > fs->n_fatent) return FR_DISK_ERR;	/* Range check */
+	es = (PF_FS_FAT32 && fs->fs_type == FS_FAT32) ? 4 : 2;	/* Entry size (FAT12 is not supported) */
+	ec = clst + cnt - 1;					/* Last entry of the chain */
+
+	while (clst <= ec) {
+		sect = clst / (512 / es);			/* FAT sector of the entry */
+		ofs = (UINT)(clst % (512 / es)) * es;	/* Byte offset of the entry in the sector */
+		n = (512 - ofs) / es;				/* Number of entries to write in this sector */
+		if (n > (UINT)(ec - clst) + 1) n = (UINT)(ec - clst) + 1;
+
+		for (f = 0; f < fs->n_fats; f++) {	/* Same update for each FAT copy */
+			if (disk_updatep(fs->fatbase + fs->fatsize * f + sect)) return FR_DISK_ERR;
+			if (disk_seekp(ofs)) return FR_DISK_ERR;
+			c = clst; bc = 0;
+			for (i = 0; i < n; i++, c++) {
+				if (es == 4) {
+					st_dword(buf + bc, (c == ec) ? (DWORD)val : (DWORD)c + 1);
+				} else {
+					st_word(buf + bc, (c == ec) ? (WORD)val : (WORD)(c + 1));
+				}
+				bc += es;
+				if (bc == sizeof buf || i == n - 1) {	/* Send a chunk of entries */
+					if (disk_writep(buf, bc)) return FR_DISK_ERR;
+					bc = 0;
+				}
+			}
+			if (disk_writep(0, 0)) return FR_DISK_ERR;	/* Program the FAT sector */
+		}
+		clst += (CLUST)n;
+	}
+
+	return FR_OK;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* FAT access - Find free clusters                                       */
+/*-----------------------------------------------------------------------*/
+
+static CLUST find_free (	/* 0:No free cluster, 1:IO error, >=2:Start of the free run */
+	CLUST want,		/* Preferred number of contiguous free clusters */
+	BYTE any,		/* 1:Fall back to any free cluster, 0:Only a run of want clusters */
+	DWORD align		/* The run has to start on a multiple of this many sectors (0:Any) */
+)
+{
+	CLUST clst, scl, first, run, val, n;
+	FATFS *fs = FatFs;
+
+
+	first = run = scl = 0;
+	clst = fs->last_clust;					/* Start after the last allocated cluster */
+	for (n = 2; n < fs->n_fatent; n++) {
+		clst++;
+		if (clst < 2 || clst >= fs->n_fatent) {	/* Wrap around, a run cannot cross the end of the FAT */
+			clst = 2; run = 0;
+		}
+		val = get_fat(clst);
+		if (val == 1) return 1;
+		if (val == 0) {						/* Free cluster */
+			if (!first) first = clst;
+			if (!run && align > 1 && ((DWORD)(clst - 2) * fs->csize + fs->database) % align) continue;	/* A run only starts on an aligned sector */
+			if (!run) scl = clst;
+			if (++run >= want) return scl;	/* Found a run long enough */
+		} else {
+			run = 0;
+		}
+	}
+
+	return any ? first : 0;	/* No run long enough, use the first free cluster if allowed */
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* FAT access - Write the clusters allocated by a file to the FAT        */
+/*-----------------------------------------------------------------------*/
+/* New clusters are kept in the file object as a pending run that ends   */
+/* at fp->curr_clust. The run is written here in one batch.              */
+
+static FRESULT sync_chain (
+	FIL* fp			/* File object with the pending run */
+)
+{
+	CLUST scl, prev, n;
+	FATFS *fs = FatFs;
+
+
+	scl = fp->pend_clust;
+	if (!scl) return FR_OK;					/* Nothing pending */
+
+	prev = fp->pend_prev;
+	n = fp->curr_clust - scl + 1;			/* Number of clusters in the run */
+	if (prev && prev == scl - 1) {			/* The run continues the chain, link it in the same batch */
+		scl = prev; n++; prev = 0;
+	}
+	if (put_fat(scl, n, END_OF_CHAIN)) return FR_DISK_ERR;	/* Terminate the run first */
+	if (prev && put_fat(prev, 1, fp->pend_clust)) return FR_DISK_ERR;	/* Then link it to the chain */
+
+	fp->pend_clust = 0;
+	if (fs->alloc == fp) fs->alloc = 0;
+
+	return FR_OK;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* FAT access - Allocate a cluster at the end of a file                  */
+/*-----------------------------------------------------------------------*/
+
+static CLUST create_chain (	/* 0:No free cluster, 1:IO error, >=2:New cluster# */
+	FIL* fp			/* File object to extend after fp->curr_clust */
+)
+{
+	CLUST prev, ncl;
+	FATFS *fs = FatFs;
+
+
+	if (fs->alloc && fs->alloc != fp) {		/* Clusters held by another file look free in the FAT */
+		if (sync_chain(fs->alloc)) return 1;
+	}
+
+	prev = fp->fptr ? fp->curr_clust : 0;	/* Last cluster of the file (0:Empty file) */
+	ncl = 0;
+	if (prev && prev + 1 < fs->n_fatent) {	/* Try to continue contiguously */
+		ncl = get_fat(prev + 1);
+		if (ncl == 1) return 1;
+		ncl = ncl ? 0 : prev + 1;
+	}
+
+	if (ncl) {
+		if (!fp->pend_clust) {				/* Start a pending run */
+			fp->pend_clust = ncl; fp->pend_prev = prev;
+		}
+	} else {
+		if (sync_chain(fp)) return 1;		/* The run is broken, write it to the FAT */
+		ncl = find_free(PF_ALLOC_RUN, 1, 0);	/* Start a new run in a free area */
+		if (ncl <= 1) return ncl;
+		fp->pend_clust = ncl; fp->pend_prev = prev;
+		fp->flag &= ~FA_CONTIG;				/* The file is no longer contiguous */
+	}
+
+	if (!prev) {							/* First cluster of the file */
+		fp->org_clust = ncl;
+		fp->flag |= FA__DIRTY;
+	}
+	fs->alloc = fp;
+	fs->last_clust = ncl;
+
+	return ncl;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Directory handling - Write start cluster and size of a file           */
+/*-----------------------------------------------------------------------*/
+
+static FRESULT dir_sync (
+	FIL* fp			/* File object with a modified directory entry */
+)
+{
+	BYTE buf[6];
+	UINT ofs;
+
+
+	ofs = (UINT)fp->dir_idx * 32;
+	if (disk_updatep(fp->dir_sect)) return FR_DISK_ERR;
+#if PF_FS_FAT32
+	if (FatFs->fs_type == FS_FAT32) {
+		st_word(buf, (WORD)(fp->org_clust >> 16));
+		if (disk_seekp(ofs + DIR_FstClusHI) || disk_writep(buf, 2)) return FR_DISK_ERR;
+	}
+#endif
+	st_word(buf, (WORD)fp->org_clust);
+	st_dword(buf + 2, fp->fsize);
+	if (disk_seekp(ofs + DIR_FstClusLO) || disk_writep(buf, 6)) return FR_DISK_ERR;
+	if (disk_writep(0, 0)) return FR_DISK_ERR;
+	fp->flag &= ~FA__DIRTY;
+
+	return FR_OK;
+}
+#endif /* PF_USE_APPEND */
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Get sector# from cluster# / Get cluster field from directory entry    */
 /*-----------------------------------------------------------------------*/
@@ -804,6 +1079,147 @@ static BYTE check_fs (	/* 0:The FAT boot record, 1:Valid boot record but not an
 
 
 
+#if PF_USE_READ
+/*-----------------------------------------------------------------------*/
+/* Move to the sector of the file pointer (fptr is on a sector boundary) */
+/*-----------------------------------------------------------------------*/
+
+static FRESULT read_sect (
+	FIL *fp		/* Pointer to the file object */
+)
+{
+	CLUST clst;
+	DWORD sect;
+	BYTE cs;
+	FATFS *fs = FatFs;
+
+
+	cs = (BYTE)(fp->fptr / 512 & (fs->csize - 1));	/* Sector offset in the cluster */
+	if (!cs) {								/* On the cluster boundary? */
+		if (fp->fptr == 0) {				/* On the top of the file? */
+			clst = fp->org_clust;
+		} else if (PF_USE_PREALLOC && (fp->flag & FA_CONTIG) && fp->fptr < fp->fsize) {	/* Contiguous file, no FAT access */
+			clst = fp->curr_clust + 1;
+		} else {
+			clst = get_fat(fp->curr_clust);
+		}
+		if (clst <= 1) return FR_DISK_ERR;
+		fp->curr_clust = clst;				/* Update current cluster */
+	}
+	sect = clust2sect(fp->curr_clust);		/* Get current sector */
+	if (!sect) return FR_DISK_ERR;
+	fp->dsect = sect + cs;
+
+	return FR_OK;
+}
+#endif
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Select the CRC policy for the data of a file                          */
+/*-----------------------------------------------------------------------*/
+/* The data sectors of a bulk file object are transferred without CRCs.  */
+/* Returns the setting it replaced. The caller passes it back once the   */
+/* transfer has started, so the policy of the FAT and directory is kept. */
+
+static BYTE data_crc (
+	FIL *fp,	/* Pointer to the file object */
+	BYTE verify	/* 0:A data sector transfer starts, else the setting to restore */
+)
+{
+	return (fp->flag & FA_BULK) ? disk_crcp(verify) : 1;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Program the sector write in progress                                  */
+/*-----------------------------------------------------------------------*/
+/* The owner keeps its file pointer. Its next write reloads the sector.  */
+
+static FRESULT flush_wip (void)
+{
+	FATFS *fs = FatFs;
+	FIL *wp = fs->wip;
+
+
+	if (!wp) return FR_OK;				/* No write in progress */
+	fs->wip = 0;
+	if (disk_writep(0, 0)) {			/* Program the sector */
+		wp->flag = 0;					/* The owner lost its data, close it */
+#if PF_USE_APPEND
+		if (fs->alloc == wp) fs->alloc = 0;
+#endif
+		return FR_DISK_ERR;
+	}
+	wp->flag &= ~FA__WIP;
+
+	return FR_OK;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Switch the current drive                                              */
+/*-----------------------------------------------------------------------*/
+/* Each drive keeps its own sector cache, so a sector write in progress  */
+/* stays open. It is only programmed if the driver cannot switch with it */
+/* (low RAM mode).                                                       */
+#if PF_VOLUMES > 1
+
+static FRESULT select_drv (
+	BYTE drv	/* Drive number */
+)
+{
+	if (drv == CurrDrv) return FR_OK;
+	if (disk_select(drv)) {
+		if (!FatFs || flush_wip() || disk_select(drv)) return FR_NOT_READY;
+	}
+	CurrDrv = drv;
+	FatFs = Vol[drv];
+
+	return FR_OK;
+}
+#endif
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Check if the file object is valid on the current volume               */
+/*-----------------------------------------------------------------------*/
+
+static FRESULT validate (
+	FIL *fp		/* Pointer to the file object */
+)
+{
+	FATFS *fs;
+
+
+#if PF_VOLUMES > 1
+	if ((fp->flag & FA_OPENED) && fp->fs != FatFs) {	/* Switch to the volume of the file */
+		if (fp->fs->drv >= PF_VOLUMES || Vol[fp->fs->drv] != fp->fs) return FR_NOT_OPENED;	/* Volume is unmounted */
+		if (select_drv(fp->fs->drv)) return FR_NOT_READY;
+	}
+#endif
+	fs = FatFs;
+	if (!fs) return FR_NOT_ENABLED;		/* Check file system */
+	if (!(fp->flag & FA_OPENED) || fp->id != fs->id) return FR_NOT_OPENED;	/* Check if opened on this mount */
+#if PF_USE_VIEW
+	if (fs->view) return FR_NOT_READY;	/* The cache is borrowed, release the view first */
+#endif
+	if (fs->wip && fs->wip != fp && flush_wip()) return FR_DISK_ERR;	/* Another file object owns the sector write in progress */
+
+	return FR_OK;
+}
+
+
+
+
 /*--------------------------------------------------------------------------
 
    Public Functions
@@ -812,6 +1228,108 @@ static BYTE check_fs (	/* 0:The FAT boot record, 1:Valid boot record but not an
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Fast remount with the geometry of the last mounted volume             */
+/*-----------------------------------------------------------------------*/
+/* The volume is trusted if the card ID and the volume serial number in  */
+/* the boot sector match, so only one sector is read.                    */
+#if PF_USE_REMOUNT
+
+static UINT volid_ofs (BYTE fmt)	/* Offset of the volume serial number in the boot sector */
+{
+	return (_FS_32ONLY || (PF_FS_FAT32 && fmt == FS_FAT32)) ? BS_VolID32 : BS_VolID;
+}
+
+
+static FRESULT load_snap (
+	FATFS *fs,		/* Pointer to the file system object */
+	BYTE *buf		/* Working buffer (16 bytes or more) */
+)
+{
+	SNAP *sp = &Snap[CurrDrv];
+
+
+	if (!sp->valid || disk_idp(buf) || mem_cmp(buf, sp->cid, 16)) return FR_NO_FILESYSTEM;	/* Not the same card */
+	if (disk_readp(buf, sp->bsect, volid_ofs(sp->fs_type), 4)) return FR_DISK_ERR;
+	if (ld_dword(buf) != sp->volid) return FR_NO_FILESYSTEM;	/* Reformatted */
+
+	fs->fs_type = sp->fs_type;
+	fs->csize = sp->csize;
+	fs->n_rootdir = sp->n_rootdir;
+	fs->n_fatent = sp->n_fatent;
+	fs->fatbase = sp->fatbase;
+	fs->dirbase = sp->dirbase;
+	fs->database = sp->database;
+#if PF_USE_APPEND
+	fs->n_fats = sp->n_fats;
+	fs->fatsize = sp->fatsize;
+#endif
+
+	return FR_OK;
+}
+
+
+static void save_snap (
+	FATFS *fs,		/* Pointer to the mounted file system object */
+	BYTE *buf,		/* Working buffer (16 bytes or more) */
+	DWORD bsect		/* Boot sector (lba) */
+)
+{
+	SNAP *sp = &Snap[CurrDrv];
+
+
+	sp->valid = 0;
+	if (disk_idp(sp->cid)) return;		/* Card ID not available */
+	if (disk_readp(buf, bsect, volid_ofs(fs->fs_type), 4)) return;
+
+	sp->bsect = bsect;
+	sp->volid = ld_dword(buf);
+	sp->fs_type = fs->fs_type;
+	sp->csize = fs->csize;
+	sp->n_rootdir = fs->n_rootdir;
+	sp->n_fatent = fs->n_fatent;
+	sp->fatbase = fs->fatbase;
+	sp->dirbase = fs->dirbase;
+	sp->database = fs->database;
+#if PF_USE_APPEND
+	sp->n_fats = fs->n_fats;
+	sp->fatsize = fs->fatsize;
+#endif
+	sp->valid = 1;
+}
+#endif
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Start using a mounted file system object                              */
+/*-----------------------------------------------------------------------*/
+
+static void start_fs (
+	FATFS *fs		/* Pointer to the mounted file system object */
+)
+{
+	fs->id = ++Fsid;					/* Invalidate file objects from a previous mount */
+	fs->wip = 0;
+#if PF_USE_VIEW
+	fs->view = 0;
+#endif
+#if PF_USE_APPEND
+	fs->last_clust = 1;					/* Free cluster search starts at the top of the FAT */
+	fs->alloc = 0;
+#endif
+	fs->file.flag = 0;
+	FatFs = fs;
+#if PF_VOLUMES > 1
+	fs->drv = CurrDrv;
+	Vol[CurrDrv] = fs;
+#endif
+}
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Mount/Unmount a Locical Drive                                         */
 /*-----------------------------------------------------------------------*/
@@ -825,11 +1343,29 @@ FRESULT pf_mount (
 
 
 	FatFs = 0;
+#if PF_VOLUMES > 1
+	Vol[CurrDrv] = 0;
+#endif
+#if PF_USE_VIEW
+	disk_releasep();					/* Drop a view from the previous mount */
+#endif
 
 	if (disk_initialize() & STA_NOINIT) {	/* Check if the drive is ready or not */
 		return FR_NOT_READY;
 	}
 
+#if PF_USE_REMOUNT
+	switch (load_snap(fs, buf)) {		/* Same card and volume as the last mount? */
+	case FR_OK:
+		start_fs(fs);
+		return FR_OK;
+	case FR_DISK_ERR:
+		return FR_DISK_ERR;
+	default:
+		break;
+	}
+#endif
+
 	/* Search FAT partition on the drive */
 	bsect = 0;
 	fmt = check_fs(buf, bsect);			/* Check sector 0 as an SFD format */
@@ -852,6 +1388,10 @@ FRESULT pf_mount (
 
 	fsize = ld_word(buf+BPB_FATSz16-13);				/* Number of sectors per FAT */
 	if (!fsize) fsize = ld_dword(buf+BPB_FATSz32-13);
+#if PF_USE_APPEND
+	fs->fatsize = fsize;
+	fs->n_fats = buf[BPB_NumFATs-13];
+#endif
 
 	fsize *= buf[BPB_NumFATs-13];						/* Number of sectors in FAT area */
 	fs->fatbase = bsect + ld_word(buf+BPB_RsvdSecCnt-13); /* FAT start sector (lba) */
@@ -878,8 +1418,10 @@ FRESULT pf_mount (
 	}
 	fs->database = fs->fatbase + fsize + fs->n_rootdir / 16;	/* Data start sector (lba) */
 
-	fs->flag = 0;
-	FatFs = fs;
+#if PF_USE_REMOUNT
+	save_snap(fs, buf, bsect);			/* The boot sector is still cached */
+#endif
+	start_fs(fs);
 
 	return FR_OK;
 }
@@ -888,36 +1430,84 @@ FRESULT pf_mount (
 
 
 /*-----------------------------------------------------------------------*/
-/* Open or Create a File                                                 */
+/* Change the Current Drive                                              */
 /*-----------------------------------------------------------------------*/
+/* pf_mount() and the functions without a file object work on the       */
+/* current drive. Functions with a file object switch to its drive.      */
+#if PF_VOLUMES > 1
 
-FRESULT pf_open (
-	const char *path	/* Pointer to the file name */
+FRESULT pf_chdrive (
+	BYTE drv	/* Drive number */
 )
 {
-	FRESULT res;
-	DIR dj;
-	BYTE sp[12], dir[32];
+	if (drv >= PF_VOLUMES) return FR_NOT_ENABLED;
+
+	return select_drv(drv);
+}
+#endif
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Open or Create a File                                                 */
+/*-----------------------------------------------------------------------*/
+
+FRESULT pf_fopen (
+	FIL *fp,			/* Pointer to the blank file object */
+	const char *path	/* Pointer to the file name */
+)
+{
+	FRESULT res;
+	DIR dj;
+	BYTE sp[12], dir[32];
 	FATFS *fs = FatFs;
 
 
 	if (!fs) return FR_NOT_ENABLED;		/* Check file system */
+#if PF_USE_VIEW
+	if (fs->view) return FR_NOT_READY;	/* The cache is borrowed, release the view first */
+#endif
+	if (flush_wip()) return FR_DISK_ERR;	/* Program the open sector before the directory is read */
+
+	fp->flag = 0;
+#if PF_USE_APPEND
+	if (fs->alloc == fp) fs->alloc = 0;	/* Clusters not written to the FAT stay free */
+	fp->pend_clust = 0;
+#endif
 
-	fs->flag = 0;
 	dj.fn = sp;
 	res = follow_path(&dj, dir, path);	/* Follow the file path */
 	if (res != FR_OK) return res;		/* Follow failed */
 	if (!dir[0] || (dir[DIR_Attr] & AM_DIR)) return FR_NO_FILE;	/* It is a directory */
 
-	fs->org_clust = get_clust(dir);		/* File start cluster */
-	fs->fsize = ld_dword(dir+DIR_FileSize);	/* File size */
-	fs->fptr = 0;						/* File pointer */
-	fs->flag = FA_OPENED;
+	fp->org_clust = get_clust(dir);		/* File start cluster */
+	fp->fsize = ld_dword(dir+DIR_FileSize);	/* File size */
+	fp->fptr = 0;						/* File pointer */
+	fp->id = fs->id;					/* Owner volume mount ID */
+#if PF_VOLUMES > 1
+	fp->fs = fs;
+#endif
+#if PF_USE_APPEND
+	fp->dir_sect = dj.sect;				/* Location of the directory entry */
+	fp->dir_idx = (BYTE)(dj.index % 16);
+#endif
+	fp->flag = FA_OPENED;
 
 	return FR_OK;
 }
 
 
+FRESULT pf_open (
+	const char *path	/* Pointer to the file name */
+)
+{
+	if (!FatFs) return FR_NOT_ENABLED;	/* Check file system */
+
+	return pf_fopen(&FatFs->file, path);
+}
+
+
 
 
 /*-----------------------------------------------------------------------*/
@@ -925,124 +1515,348 @@ FRESULT pf_open (
 /*-----------------------------------------------------------------------*/
 #if PF_USE_READ
 
-FRESULT pf_read (
+FRESULT pf_fread (
+	FIL* fp,		/* Pointer to the file object */
 	void* buff,		/* Pointer to the read buffer (NULL:Forward data to the stream)*/
 	UINT btr,		/* Number of bytes to read */
 	UINT* br		/* Pointer to number of bytes read */
 )
 {
+	FRESULT res;
 	DRESULT dr;
-	CLUST clst;
-	DWORD sect, remain;
-	UINT rcnt;
-	BYTE cs, *rbuff = buff;
+	DWORD remain;
+	UINT rcnt, nsect;
+	BYTE cs, crc;
+	BYTE *rbuff = buff;
 	FATFS *fs = FatFs;
 
 
 	*br = 0;
-	if (!fs) return FR_NOT_ENABLED;		/* Check file system */
-	if (!(fs->flag & FA_OPENED)) return FR_NOT_OPENED;	/* Check if opened */
+	res = validate(fp);					/* Check file system and file object */
+	if (res != FR_OK) return res;
+	if (flush_wip()) return FR_DISK_ERR;	/* Finalize the write in progress on this object */
+#if PF_USE_APPEND
+	if (sync_chain(fp)) ABORT(FR_DISK_ERR);	/* The chain is followed through the FAT */
+#endif
 
-	remain = fs->fsize - fs->fptr;
+	remain = fp->fsize - fp->fptr;
 	if (btr > remain) btr = (UINT)remain;			/* Truncate btr by remaining bytes */
 
 	while (btr)	{									/* Repeat until all data transferred */
-		if ((fs->fptr % 512) == 0) {				/* On the sector boundary? */
-			cs = (BYTE)(fs->fptr / 512 & (fs->csize - 1));	/* Sector offset in the cluster */
-			if (!cs) {								/* On the cluster boundary? */
-				if (fs->fptr == 0) {				/* On the top of the file? */
-					clst = fs->org_clust;
-				} else {
-					clst = get_fat(fs->curr_clust);
+		if ((fp->fptr % 512) == 0) {				/* On the sector boundary? */
+			if (read_sect(fp)) ABORT(FR_DISK_ERR);
+			if (rbuff && btr >= 512) {				/* Whole sectors go straight to the destination */
+				cs = (BYTE)(fp->fptr / 512 & (fs->csize - 1));	/* Sector offset in the cluster */
+				nsect = btr / 512;
+				if (!(PF_USE_PREALLOC && (fp->flag & FA_CONTIG)) && nsect > (UINT)(fs->csize - cs)) {
+					nsect = fs->csize - cs;			/* Clip at the cluster boundary (contiguous files run on) */
 				}
-				if (clst <= 1) ABORT(FR_DISK_ERR);
-				fs->curr_clust = clst;				/* Update current cluster */
+				if (nsect > 0x7F) nsect = 0x7F;		/* Keep the byte count in 16 bits */
+				rcnt = nsect * 512;
+				crc = data_crc(fp, 0);
+				dr = disk_readp(rbuff, fp->dsect, 0, rcnt);
+				data_crc(fp, crc);
+				if (dr) ABORT(FR_DISK_ERR);
+				fp->curr_clust += (CLUST)((cs + nsect - 1) / fs->csize);	/* Cluster of the last sector read */
+				fp->dsect += nsect - 1;
+				fp->fptr += rcnt;
+				btr -= rcnt; *br += rcnt;
+				rbuff += rcnt;
+				continue;
 			}
-			sect = clust2sect(fs->curr_clust);		/* Get current sector */
-			if (!sect) ABORT(FR_DISK_ERR);
-			fs->dsect = sect + cs;
 		}
-		rcnt = 512 - (UINT)fs->fptr % 512;			/* Get partial sector data from sector buffer */
+		rcnt = 512 - (UINT)fp->fptr % 512;			/* Get partial sector data from sector buffer */
 		if (rcnt > btr) rcnt = btr;
-		dr = disk_readp(rbuff, fs->dsect, (UINT)fs->fptr % 512, rcnt);
+		crc = data_crc(fp, 0);
+		dr = disk_readp(rbuff, fp->dsect, (UINT)fp->fptr % 512, rcnt);
+		data_crc(fp, crc);
 		if (dr) ABORT(FR_DISK_ERR);
-		fs->fptr += rcnt;							/* Advances file read pointer */
+		fp->fptr += rcnt;							/* Advances file read pointer */
 		btr -= rcnt; *br += rcnt;					/* Update read counter */
 		if (rbuff) rbuff += rcnt;					/* Advances the data pointer if destination is memory */
 	}
 
 	return FR_OK;
 }
+
+
+FRESULT pf_read (
+	void* buff,		/* Pointer to the read buffer (NULL:Forward data to the stream)*/
+	UINT btr,		/* Number of bytes to read */
+	UINT* br		/* Pointer to number of bytes read */
+)
+{
+	*br = 0;
+	if (!FatFs) return FR_NOT_ENABLED;	/* Check file system */
+
+	return pf_fread(&FatFs->file, buff, btr, br);
+}
 #endif
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Read File in Place                                                    */
+/*-----------------------------------------------------------------------*/
+/* Returns a pointer to the file data in the sector cache instead of     */
+/* copying it. The data never crosses a sector boundary, so *br can be   */
+/* less than btr. The sector stays borrowed until pf_release_view().     */
+#if PF_USE_VIEW
+
+FRESULT pf_fread_view (
+	FIL* fp,			/* Pointer to the file object */
+	const BYTE** view,	/* Pointer to receive the address of the data */
+	UINT btr,			/* Number of bytes to read */
+	UINT* br			/* Pointer to number of bytes read */
+)
+{
+	FRESULT res;
+	DWORD remain;
+	const BYTE *sp;
+	BYTE crc;
+	FATFS *fs = FatFs;
+
+
+	*view = 0; *br = 0;
+	if (fs && fs->view) {				/* A new view releases the previous one */
+		disk_releasep();
+		fs->view = 0;
+	}
+	res = validate(fp);					/* Check file system and file object */
+	if (res != FR_OK) return res;
+	if (flush_wip()) return FR_DISK_ERR;	/* Finalize the write in progress */
+#if PF_USE_APPEND
+	if (sync_chain(fp)) ABORT(FR_DISK_ERR);	/* The chain is followed through the FAT */
+#endif
+
+	remain = fp->fsize - fp->fptr;
+	if (btr > remain) btr = (UINT)remain;			/* Truncate btr by remaining bytes */
+	if (!btr) return FR_OK;
+
+	if ((fp->fptr % 512) == 0) {				/* On the sector boundary? */
+		if (read_sect(fp)) ABORT(FR_DISK_ERR);
+	}
+	if (btr > 512 - (UINT)fp->fptr % 512) btr = 512 - (UINT)fp->fptr % 512;	/* Stop at the end of the sector */
+
+	crc = data_crc(fp, 0);
+	sp = disk_borrowp(fp->dsect);				/* Pin the sector in the cache */
+	data_crc(fp, crc);
+	if (!sp) ABORT(FR_DISK_ERR);
+	fs->view = 1;
+
+	*view = sp + (UINT)fp->fptr % 512;
+	fp->fptr += btr;
+	*br = btr;
+
+	return FR_OK;
+}
+
+
+FRESULT pf_read_view (
+	const BYTE** view,	/* Pointer to receive the address of the data */
+	UINT btr,			/* Number of bytes to read */
+	UINT* br			/* Pointer to number of bytes read */
+)
+{
+	*view = 0; *br = 0;
+	if (!FatFs) return FR_NOT_ENABLED;	/* Check file system */
+
+	return pf_fread_view(&FatFs->file, view, btr, br);
+}
+
+
+void pf_release_view (void)
+{
+	if (FatFs && FatFs->view) {
+		disk_releasep();
+		FatFs->view = 0;
+	}
+}
+#endif
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Read-Ahead Hint                                                       */
+/*-----------------------------------------------------------------------*/
+/* Tells the disk layer how many sectors to read ahead once the file is  */
+/* read sequentially (0:Off). The data is fetched while the application  */
+/* is idle, so a streaming read does not wait on the card access time.   */
+#if PF_USE_READ && PF_USE_HINT
+
+FRESULT pf_fhint (
+	FIL* fp,		/* Pointer to the file object */
+	BYTE depth		/* Number of sectors to read ahead (0:Disable) */
+)
+{
+	FRESULT res;
+
+
+	res = validate(fp);					/* Check file system and file object */
+	if (res != FR_OK) return res;
+
+	disk_hintp(depth);
+
+	return FR_OK;
+}
+
+
+FRESULT pf_hint (
+	BYTE depth		/* Number of sectors to read ahead (0:Disable) */
+)
+{
+	if (!FatFs) return FR_NOT_ENABLED;	/* Check file system */
+
+	return pf_fhint(&FatFs->file, depth);
+}
+#endif
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Select Verified or Best-Effort File Data                              */
+/*-----------------------------------------------------------------------*/
+/* The data of a bulk file object is sent without a CRC and read without */
+/* checking it, and the card does not check it either. The FAT and the   */
+/* directory entries stay verified.                                      */
+
+FRESULT pf_fbulk (
+	FIL* fp,		/* Pointer to the file object */
+	BYTE bulk		/* 1:Best effort, 0:Verified */
+)
+{
+	FRESULT res;
+
+
+	res = validate(fp);					/* Check file system and file object */
+	if (res != FR_OK) return res;
+
+	if (bulk) {
+		fp->flag |= FA_BULK;
+	} else {
+		fp->flag &= ~FA_BULK;
+	}
+
+	return FR_OK;
+}
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Write File                                                            */
 /*-----------------------------------------------------------------------*/
 #if PF_USE_WRITE
 
-FRESULT pf_write (
+FRESULT pf_fwrite (
+	FIL* fp,			/* Pointer to the file object */
 	const void* buff,	/* Pointer to the data to be written */
 	UINT btw,			/* Number of bytes to write (0:Finalize the current write operation) */
 	UINT* bw			/* Pointer to number of bytes written */
 )
 {
+	FRESULT res;
+	DRESULT dr;
 	CLUST clst;
 	DWORD sect, remain;
 	const BYTE *p = buff;
-	BYTE cs;
+	BYTE cs, crc;
 	UINT wcnt;
 	FATFS *fs = FatFs;
 
 
 	*bw = 0;
-	if (!fs) return FR_NOT_ENABLED;		/* Check file system */
-	if (!(fs->flag & FA_OPENED)) return FR_NOT_OPENED;	/* Check if opened */
+	res = validate(fp);					/* Check file system and file object */
+	if (res != FR_OK) return res;
 
 	if (!btw) {		/* Finalize request */
-		if ((fs->flag & FA__WIP) && disk_writep(0, 0)) ABORT(FR_DISK_ERR);
-		fs->flag &= ~FA__WIP;
+		if ((fp->flag & FA__WIP) && disk_writep(0, 0)) ABORT(FR_DISK_ERR);
+		fp->flag &= ~FA__WIP;
+		fs->wip = 0;
 		return FR_OK;
-	} else {		/* Write data request */
-		if (!(fs->flag & FA__WIP)) {	/* Round-down fptr to the sector boundary */
-			fs->fptr &= 0xFFFFFE00;
-		}
 	}
-	remain = fs->fsize - fs->fptr;
+	remain = fp->fsize - fp->fptr;
+#if PF_USE_APPEND
+	if (fp->flag & FA_APPEND) remain = 0xFFFFFFFF - fp->fptr;	/* A growing file is only limited by the maximum file size */
+#endif
 	if (btw > remain) btw = (UINT)remain;			/* Truncate btw by remaining bytes */
 
+	if (btw && !(fp->flag & FA__WIP) && (UINT)fp->fptr % 512) {	/* Start in the middle of a sector? */
+		crc = data_crc(fp, 0);
+		dr = disk_updatep(fp->dsect);		/* Load the sector to keep the bytes before fptr */
+		data_crc(fp, crc);
+		if (dr) ABORT(FR_DISK_ERR);
+		if (disk_seekp((UINT)fp->fptr % 512)) ABORT(FR_DISK_ERR);
+		fp->flag |= FA__WIP;
+		fs->wip = fp;
+	}
+
 	while (btw)	{									/* Repeat until all data transferred */
-		if ((UINT)fs->fptr % 512 == 0) {			/* On the sector boundary? */
-			cs = (BYTE)(fs->fptr / 512 & (fs->csize - 1));	/* Sector offset in the cluster */
+		if ((UINT)fp->fptr % 512 == 0) {			/* On the sector boundary? */
+			cs = (BYTE)(fp->fptr / 512 & (fs->csize - 1));	/* Sector offset in the cluster */
 			if (!cs) {								/* On the cluster boundary? */
-				if (fs->fptr == 0) {				/* On the top of the file? */
-					clst = fs->org_clust;
+				if (fp->fptr == 0) {				/* On the top of the file? */
+					clst = fp->org_clust;
+				} else if (PF_USE_PREALLOC && (fp->flag & FA_CONTIG) && fp->fptr < fp->fsize) {	/* Contiguous file, no FAT access */
+					clst = fp->curr_clust + 1;
 				} else {
-					clst = get_fat(fs->curr_clust);
+					clst = get_fat(fp->curr_clust);
 				}
+#if PF_USE_APPEND
+				if ((fp->flag & FA_APPEND) && (clst == 0 || clst >= fs->n_fatent)) {	/* End of the chain, allocate a cluster */
+					clst = create_chain(fp);
+					if (!clst) break;				/* Disk full */
+				}
+#endif
 				if (clst <= 1) ABORT(FR_DISK_ERR);
-				fs->curr_clust = clst;				/* Update current cluster */
+				fp->curr_clust = clst;				/* Update current cluster */
 			}
-			sect = clust2sect(fs->curr_clust);		/* Get current sector */
+			sect = clust2sect(fp->curr_clust);		/* Get current sector */
 			if (!sect) ABORT(FR_DISK_ERR);
-			fs->dsect = sect + cs;
-			if (disk_writep(0, fs->dsect)) ABORT(FR_DISK_ERR);	/* Initiate a sector write operation */
-			fs->flag |= FA__WIP;
+			fp->dsect = sect + cs;
+			crc = data_crc(fp, 0);				/* The policy is kept by the driver until the sector is programmed */
+			if (btw < 512 && fp->fptr + btw < fp->fsize) {	/* Partial sector with file data after the written bytes? */
+				dr = disk_updatep(fp->dsect);	/* Load the sector to keep the data */
+			} else {
+				dr = disk_writep(0, fp->dsect);	/* Initiate a sector write operation */
+			}
+			data_crc(fp, crc);
+			if (dr) ABORT(FR_DISK_ERR);
+			fp->flag |= FA__WIP;
+			fs->wip = fp;
 		}
-		wcnt = 512 - (UINT)fs->fptr % 512;			/* Number of bytes to write to the sector */
+		wcnt = 512 - (UINT)fp->fptr % 512;			/* Number of bytes to write to the sector */
 		if (wcnt > btw) wcnt = btw;
 		if (disk_writep(p, wcnt)) ABORT(FR_DISK_ERR);	/* Send data to the sector */
-		fs->fptr += wcnt; p += wcnt;				/* Update pointers and counters */
+		fp->fptr += wcnt; p += wcnt;				/* Update pointers and counters */
 		btw -= wcnt; *bw += wcnt;
-		if ((UINT)fs->fptr % 512 == 0) {
+#if PF_USE_APPEND
+		if (fp->fptr > fp->fsize) {					/* File grew, the directory entry needs an update */
+			fp->fsize = fp->fptr;
+			fp->flag |= FA__DIRTY;
+		}
+#endif
+		if ((UINT)fp->fptr % 512 == 0) {
 			if (disk_writep(0, 0)) ABORT(FR_DISK_ERR);	/* Finalize the currtent secter write operation */
-			fs->flag &= ~FA__WIP;
+			fp->flag &= ~FA__WIP;
+			fs->wip = 0;
 		}
 	}
 
 	return FR_OK;
 }
+
+
+FRESULT pf_write (
+	const void* buff,	/* Pointer to the data to be written */
+	UINT btw,			/* Number of bytes to write (0:Finalize the current write operation) */
+	UINT* bw			/* Pointer to number of bytes written */
+)
+{
+	*bw = 0;
+	if (!FatFs) return FR_NOT_ENABLED;	/* Check file system */
+
+	return pf_fwrite(&FatFs->file, buff, btw, bw);
+}
 #endif
 
 
@@ -1052,51 +1866,274 @@ FRESULT pf_write (
 /*-----------------------------------------------------------------------*/
 #if PF_USE_LSEEK
 
-FRESULT pf_lseek (
+FRESULT pf_flseek (
+	FIL* fp,		/* Pointer to the file object */
 	DWORD ofs		/* File pointer from top of file */
 )
 {
+	FRESULT res;
 	CLUST clst;
 	DWORD bcs, sect, ifptr;
 	FATFS *fs = FatFs;
 
 
-	if (!fs) return FR_NOT_ENABLED;		/* Check file system */
-	if (!(fs->flag & FA_OPENED)) return FR_NOT_OPENED;	/* Check if opened */
+	res = validate(fp);					/* Check file system and file object */
+	if (res != FR_OK) return res;
+	if (flush_wip()) return FR_DISK_ERR;	/* Finalize the write in progress on this object */
+#if PF_USE_APPEND
+	if (sync_chain(fp)) ABORT(FR_DISK_ERR);	/* The chain is followed through the FAT */
+#endif
 
-	if (ofs > fs->fsize) ofs = fs->fsize;	/* Clip offset with the file size */
-	ifptr = fs->fptr;
-	fs->fptr = 0;
+	if (ofs > fp->fsize) ofs = fp->fsize;	/* Clip offset with the file size */
+	ifptr = fp->fptr;
+	fp->fptr = 0;
+#if PF_USE_PREALLOC
+	if ((fp->flag & FA_CONTIG) && ofs > 0) {	/* Contiguous file, the cluster is computed without FAT access */
+		bcs = (DWORD)fs->csize * 512;
+		clst = fp->org_clust + (CLUST)((ofs - 1) / bcs);
+		sect = clust2sect(clst);
+		if (!sect) ABORT(FR_DISK_ERR);
+		fp->curr_clust = clst;
+		fp->fptr = ofs;
+		fp->dsect = sect + (ofs / 512 & (fs->csize - 1));
+		return FR_OK;
+	}
+#endif
 	if (ofs > 0) {
 		bcs = (DWORD)fs->csize * 512;		/* Cluster size (byte) */
 		if (ifptr > 0 &&
 			(ofs - 1) / bcs >= (ifptr - 1) / bcs) {	/* When seek to same or following cluster, */
-			fs->fptr = (ifptr - 1) & ~(bcs - 1);	/* start from the current cluster */
-			ofs -= fs->fptr;
-			clst = fs->curr_clust;
+			fp->fptr = (ifptr - 1) & ~(bcs - 1);	/* start from the current cluster */
+			ofs -= fp->fptr;
+			clst = fp->curr_clust;
 		} else {							/* When seek to back cluster, */
-			clst = fs->org_clust;			/* start from the first cluster */
-			fs->curr_clust = clst;
+			clst = fp->org_clust;			/* start from the first cluster */
+			fp->curr_clust = clst;
 		}
 		while (ofs > bcs) {				/* Cluster following loop */
 			clst = get_fat(clst);		/* Follow cluster chain */
 			if (clst <= 1 || clst >= fs->n_fatent) ABORT(FR_DISK_ERR);
-			fs->curr_clust = clst;
-			fs->fptr += bcs;
+			fp->curr_clust = clst;
+			fp->fptr += bcs;
 			ofs -= bcs;
 		}
-		fs->fptr += ofs;
+		fp->fptr += ofs;
 		sect = clust2sect(clst);		/* Current sector */
 		if (!sect) ABORT(FR_DISK_ERR);
-		fs->dsect = sect + (fs->fptr / 512 & (fs->csize - 1));
+		fp->dsect = sect + (fp->fptr / 512 & (fs->csize - 1));
 	}
 
 	return FR_OK;
 }
+
+
+FRESULT pf_lseek (
+	DWORD ofs		/* File pointer from top of file */
+)
+{
+	if (!FatFs) return FR_NOT_ENABLED;	/* Check file system */
+
+	return pf_flseek(&FatFs->file, ofs);
+}
 #endif
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Append to a File                                                      */
+/*-----------------------------------------------------------------------*/
+#if PF_USE_APPEND
+
+FRESULT pf_fappend (
+	FIL* fp		/* Pointer to the file object */
+)
+{
+	FRESULT res;
+	FATFS *fs = FatFs;
+
+
+	res = validate(fp);					/* Check file system and file object */
+	if (res != FR_OK) return res;
+	if (PF_FS_FAT12 && fs->fs_type == FS_FAT12) return FR_NO_FILESYSTEM;	/* FAT12 chains cannot be written */
+
+	res = pf_flseek(fp, fp->fsize);		/* Move to the end of file */
+	if (res == FR_OK) fp->flag |= FA_APPEND;	/* Writes past the end allocate clusters */
+
+	return res;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Synchronize a Growing File                                            */
+/*-----------------------------------------------------------------------*/
+
+FRESULT pf_fsync (
+	FIL* fp		/* Pointer to the file object */
+)
+{
+	FRESULT res;
+	FATFS *fs = FatFs;
+
+
+	res = validate(fp);					/* Check file system and file object */
+	if (res != FR_OK) return res;
+
+	if (flush_wip()) return FR_DISK_ERR;	/* Program the current sector */
+
+	if (sync_chain(fp)) ABORT(FR_DISK_ERR);	/* Write the new clusters to the FAT */
+
+	if ((fp->flag & FA__DIRTY) && dir_sync(fp)) ABORT(FR_DISK_ERR);	/* Update start cluster and size in the directory entry */
+
+	if (disk_flushp()) return FR_DISK_ERR;	/* Program the queued sectors (they stay queued on failure) */
+
+	return FR_OK;
+}
+
+#endif /* PF_USE_APPEND */
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Open or Create a File                                                 */
+/*-----------------------------------------------------------------------*/
+#if PF_USE_PREALLOC
+
+FRESULT pf_fcreate (
+	FIL *fp,			/* Pointer to the blank file object */
+	const char *path	/* Pointer to the file name */
+)
+{
+	FRESULT res;
+	DIR dj;
+	BYTE sp[12], dir[32], i;
+
+
+	res = pf_fopen(fp, path);			/* Open the file if it exists */
+	if (res != FR_NO_FILE) return res;
+
+	dj.fn = sp;
+	res = follow_path(&dj, dir, path);	/* Locate the directory to create the file in */
+	if (res != FR_NO_FILE || !sp[11]) return FR_NO_FILE;	/* It is a directory or the path does not exist */
+
+	res = dir_rewind(&dj);				/* Find a free entry */
+	while (res == FR_OK) {
+		if (disk_readp(dir, dj.sect, (dj.index % 16) * 32, 1)) return FR_DISK_ERR;
+		if (dir[DIR_Name] == 0 || dir[DIR_Name] == DDEM) break;
+		res = dir_next(&dj);
+	}
+	if (res == FR_NO_FILE) return FR_DENIED;	/* Directory is full (directories are not extended) */
+	if (res != FR_OK) return res;
+
+	mem_set(dir, 0, 32);				/* Create an empty file entry */
+	for (i = 0; i < 11; i++) dir[DIR_Name + i] = sp[i];
+	dir[DIR_Attr] = AM_ARC;
+	if (disk_updatep(dj.sect) || disk_seekp((dj.index % 16) * 32) || disk_writep(dir, 32)) return FR_DISK_ERR;
+	if (disk_writep(0, 0)) return FR_DISK_ERR;
+
+	return pf_fopen(fp, path);
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Reserve Contiguous Clusters for a File                                */
+/*-----------------------------------------------------------------------*/
+
+FRESULT pf_fprealloc (
+	FIL* fp,		/* Pointer to the file object */
+	DWORD size		/* File size to reserve (bytes) */
+)
+{
+	FRESULT res;
+	CLUST clst, ncl, n, val;
+	DWORD bcs;
+	FATFS *fs = FatFs;
+
+
+	res = validate(fp);					/* Check file system and file object */
+	if (res != FR_OK) return res;
+	if (flush_wip()) return FR_DISK_ERR;	/* Finalize the write in progress on this object */
+	if (PF_FS_FAT12 && fs->fs_type == FS_FAT12) return FR_NO_FILESYSTEM;	/* FAT12 chains cannot be written */
+	if (sync_chain(fp)) ABORT(FR_DISK_ERR);
+
+	if (size < fp->fsize) size = fp->fsize;	/* The whole file has to be contiguous */
+	if (!size) return FR_OK;
+	bcs = (DWORD)fs->csize * 512;
+	ncl = (CLUST)(size / bcs + ((size % bcs) ? 1 : 0));	/* Number of clusters to reserve */
+
+	if (fp->org_clust) {				/* Existing file, check that the chain is a contiguous run of ncl clusters */
+		clst = fp->org_clust;
+		for (n = 1; n < ncl; n++, clst++) {
+			val = get_fat(clst);
+			if (val == 1) ABORT(FR_DISK_ERR);
+			if (val != clst + 1) return FR_DENIED;	/* Fragmented or too short */
+		}
+	} else {							/* Empty file, allocate a new run */
+		clst = find_free(ncl, 0, disk_alignp());	/* Prefer a run that starts on an allocation unit of the card */
+		if (!clst) clst = find_free(ncl, 0, 0);	/* Else any run long enough */
+		if (clst == 1) ABORT(FR_DISK_ERR);
+		if (!clst) return FR_DENIED;	/* No free run long enough */
+		if (put_fat(clst, ncl, END_OF_CHAIN)) ABORT(FR_DISK_ERR);	/* Write the chain in sector batches */
+		fp->org_clust = clst;
+		fs->last_clust = clst + ncl - 1;
+		fp->flag |= FA__DIRTY;
+	}
+
+	if (size > fp->fsize) {				/* Record the reserved size */
+		fp->fsize = size;
+		fp->flag |= FA__DIRTY;
+	}
+	if ((fp->flag & FA__DIRTY) && dir_sync(fp)) ABORT(FR_DISK_ERR);
+	fp->flag |= FA_CONTIG;				/* Cluster chain is no longer followed through the FAT */
+
+	return FR_OK;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Pre-Erase Part of a Contiguous File                                   */
+/*-----------------------------------------------------------------------*/
+/* Erases the whole sectors in ofs..ofs+len-1 so later writes to them    */
+/* are faster. The data in them is lost. The card erases in the          */
+/* background, the next disk access waits for it.                        */
+
+FRESULT pf_ferase (
+	FIL* fp,		/* Pointer to the file object */
+	DWORD ofs,		/* Offset of the area in the file (bytes) */
+	DWORD len		/* Size of the area (bytes) */
+)
+{
+	FRESULT res;
+	DWORD sect, nsect, base;
+
+
+	res = validate(fp);					/* Check file system and file object */
+	if (res != FR_OK) return res;
+	if (!(fp->flag & FA_CONTIG)) return FR_DENIED;	/* Sectors are only known without FAT access in a contiguous file */
+	if (flush_wip()) return FR_DISK_ERR;	/* The sector write in progress may be in the area */
+
+	if (ofs >= fp->fsize) return FR_OK;
+	if (len > fp->fsize - ofs) len = fp->fsize - ofs;	/* Clip at the end of the file */
+	sect = (ofs + 511) / 512;			/* Whole sectors only */
+	if ((ofs + len) / 512 <= sect) return FR_OK;
+	nsect = (ofs + len) / 512 - sect;
+
+	base = clust2sect(fp->org_clust);	/* First sector of the file */
+	if (!base) return FR_DISK_ERR;
+	if (disk_erasep(base + sect, nsect)) return FR_DISK_ERR;	/* The file stays open, the area is just not erased */
+
+	return FR_OK;
+}
+
+#endif /* PF_USE_PREALLOC */
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Create a Directroy Object                                             */
 /*-----------------------------------------------------------------------*/
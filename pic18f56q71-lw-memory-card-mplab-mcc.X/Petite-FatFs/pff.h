@@ -56,23 +56,55 @@ typedef unsigned long	DWORD;	/* 32-bit unsigned integer */
 #endif
 
 
-/* File system object structure */
+/* File object structure */
 
 typedef struct {
-	BYTE	fs_type;	/* FAT sub type */
+#if PF_VOLUMES > 1
+	struct FATFS_* fs;	/* Volume the file was opened on */
+#endif
+	WORD	id;			/* Mount ID of the volume the file was opened on */
 	BYTE	flag;		/* File status flags */
-	BYTE	csize;		/* Number of sectors per cluster */
 	BYTE	pad1;
-	WORD	n_rootdir;	/* Number of root directory entries (0 on FAT32) */
-	CLUST	n_fatent;	/* Number of FAT entries (= number of clusters + 2) */
-	DWORD	fatbase;	/* FAT start sector */
-	DWORD	dirbase;	/* Root directory start sector (Cluster# on FAT32) */
-	DWORD	database;	/* Data start sector */
 	DWORD	fptr;		/* File R/W pointer */
 	DWORD	fsize;		/* File size */
 	CLUST	org_clust;	/* File start cluster */
 	CLUST	curr_clust;	/* File current cluster */
 	DWORD	dsect;		/* File current data sector */
+#if PF_USE_APPEND
+	DWORD	dir_sect;	/* Sector containing the directory entry */
+	BYTE	dir_idx;	/* Index of the directory entry in the sector */
+	CLUST	pend_clust;	/* First allocated cluster not yet written to the FAT (0:None) */
+	CLUST	pend_prev;	/* Cluster to be linked to pend_clust (0:pend_clust is the start cluster) */
+#endif
+} FIL;
+
+
+
+/* File system object structure */
+
+typedef struct FATFS_ {
+	BYTE	fs_type;	/* FAT sub type */
+#if PF_VOLUMES > 1
+	BYTE	drv;		/* Physical drive number */
+#endif
+	BYTE	csize;		/* Number of sectors per cluster */
+	WORD	id;			/* Mount ID (file objects from an older mount are rejected) */
+	WORD	n_rootdir;	/* Number of root directory entries (0 on FAT32) */
+	CLUST	n_fatent;	/* Number of FAT entries (= number of clusters + 2) */
+	DWORD	fatbase;	/* FAT start sector */
+	DWORD	dirbase;	/* Root directory start sector (Cluster# on FAT32) */
+	DWORD	database;	/* Data start sector */
+#if PF_USE_APPEND
+	BYTE	n_fats;		/* Number of FAT copies */
+	DWORD	fatsize;	/* Number of sectors per FAT copy */
+	CLUST	last_clust;	/* Last allocated cluster (free cluster search hint) */
+	FIL*	alloc;		/* File object holding clusters not yet written to the FAT (0:None) */
+#endif
+	FIL*	wip;		/* File object holding the sector write in progress (0:None) */
+#if PF_USE_VIEW
+	BYTE	view;		/* A sector is borrowed by pf_read_view (1) */
+#endif
+	FIL		file;		/* File object used by pf_open/pf_read/pf_write/pf_lseek */
 } FATFS;
 
 
@@ -110,7 +142,8 @@ typedef enum {
 	FR_NO_FILE,			/* 3 */
 	FR_NOT_OPENED,		/* 4 */
 	FR_NOT_ENABLED,		/* 5 */
-	FR_NO_FILESYSTEM	/* 6 */
+	FR_NO_FILESYSTEM,	/* 6 */
+	FR_DENIED			/* 7 */
 } FRESULT;
 
 
@@ -119,6 +152,9 @@ typedef enum {
 /* Petit FatFs module application interface                     */
 
 FRESULT pf_mount (FATFS* fs);								/* Mount/Unmount a logical drive */
+#if PF_VOLUMES > 1
+FRESULT pf_chdrive (BYTE drv);								/* Change the current drive */
+#endif
 FRESULT pf_open (const char* path);							/* Open a file */
 FRESULT pf_read (void* buff, UINT btr, UINT* br);			/* Read data from the open file */
 FRESULT pf_write (const void* buff, UINT btw, UINT* bw);	/* Write data to the open file */
@@ -126,15 +162,35 @@ FRESULT pf_lseek (DWORD ofs);								/* Move file pointer of the open file */
 FRESULT pf_opendir (DIR* dj, const char* path);				/* Open a directory */
 FRESULT pf_readdir (DIR* dj, FILINFO* fno);					/* Read a directory item from the open directory */
 
+FRESULT pf_fopen (FIL* fp, const char* path);					/* Open a file into a file object */
+FRESULT pf_fread (FIL* fp, void* buff, UINT btr, UINT* br);		/* Read data from a file object */
+FRESULT pf_fwrite (FIL* fp, const void* buff, UINT btw, UINT* bw);	/* Write data to a file object */
+FRESULT pf_flseek (FIL* fp, DWORD ofs);							/* Move file pointer of a file object */
+FRESULT pf_read_view (const BYTE** view, UINT btr, UINT* br);		/* Read data of the open file in place from the sector cache */
+FRESULT pf_fread_view (FIL* fp, const BYTE** view, UINT btr, UINT* br);	/* Read data of a file object in place from the sector cache */
+void pf_release_view (void);										/* Release the sector returned by pf_read_view */
+FRESULT pf_hint (BYTE depth);									/* Set the read-ahead depth for the open file */
+FRESULT pf_fhint (FIL* fp, BYTE depth);							/* Set the read-ahead depth for a file object */
+FRESULT pf_fappend (FIL* fp);									/* Move to the end of file and allow the file to grow */
+FRESULT pf_fsync (FIL* fp);										/* Flush the FAT chain and directory entry of a growing file */
+FRESULT pf_fcreate (FIL* fp, const char* path);					/* Open a file, create an empty file if it does not exist */
+FRESULT pf_fprealloc (FIL* fp, DWORD size);						/* Reserve a contiguous cluster run for a file */
+FRESULT pf_ferase (FIL* fp, DWORD ofs, DWORD len);				/* Pre-erase the sectors of a part of a contiguous file */
+FRESULT pf_fbulk (FIL* fp, BYTE bulk);							/* Transfer the data of a file object without CRCs (best effort) */
+
 
 
 /*--------------------------------------------------------------*/
 /* Flags and offset address                                     */
 
 
-/* File status flag (FATFS.flag) */
+/* File status flag (FIL.flag) */
 #define	FA_OPENED	0x01
 #define	FA_WPRT		0x02
+#define	FA_APPEND	0x04
+#define	FA_CONTIG	0x08
+#define	FA_BULK		0x10
+#define	FA__DIRTY	0x20
 #define	FA__WIP		0x40
 
 
@@ -10,9 +10,19 @@
 /---------------------------------------------------------------------------*/
 
 #define	PF_USE_READ		1	/* pf_read() function */
+#define	PF_USE_VIEW		1	/* pf_read_view() and pf_release_view() functions (requires PF_USE_READ) */
+#define	PF_USE_HINT		1	/* pf_hint() and pf_fhint() read-ahead hint functions (requires PF_USE_READ) */
 #define	PF_USE_DIR		0	/* pf_opendir() and pf_readdir() function */
 #define	PF_USE_LSEEK	1	/* pf_lseek() function */
 #define	PF_USE_WRITE	1	/* pf_write() function */
+#define	PF_USE_APPEND	1	/* pf_fappend() and pf_fsync() functions, file growth (requires PF_USE_WRITE and PF_USE_LSEEK) */
+#define	PF_USE_PREALLOC	1	/* pf_fcreate() and pf_fprealloc() functions (requires PF_USE_APPEND) */
+
+#define	PF_USE_REMOUNT	1	/* Fast remount of the last volume (card ID and geometry kept in RAM across detach) */
+
+#define PF_VOLUMES		1	/* Number of volumes (drives). pf_chdrive() selects the drive when 2 or more */
+
+#define PF_ALLOC_RUN	8	/* Preferred number of contiguous free clusters when a growing file starts a new run */
 
 #define PF_FS_FAT12		0	/* FAT12 */
 #define PF_FS_FAT16		1	/* FAT16 */
@@ -0,0 +1,1344 @@
+#include "cardArray.h"
+#include "memoryCard.h"
+#include "spi2_host.h"
+#include "mcc_generated_files/system/system.h"
+
+#include <xc.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+//Bytes per queueWrite call during the benchmark
+#define BENCH_CHUNK_SIZE 32
+
+//Sectors per read during the read benchmark (one stripe from each card)
+#define BENCH_READ_SECTORS (CARD_ARRAY_CARDS * CARD_ARRAY_STRIPE_SECTORS)
+
+//Slot that holds the sector being written
+static uint8_t writeSlot = 0;
+
+//Slot that holds the borrowed sector
+static uint8_t borrowSlot = 0;
+
+//TMR2 periods (4 ms) counted during a benchmark run
+static volatile uint16_t benchTicks = 0;
+
+#if (CARD_ARRAY_MODE == CARD_ARRAY_MIRROR)
+//Layout of the mirror state in data EEPROM
+#define MIRROR_STATE_MAGIC 0x4D
+#define MIRROR_STATE_MAGIC_OFFSET 0
+#define MIRROR_STATE_MASK_OFFSET 1
+#define MIRROR_STATE_CID_OFFSET 2
+
+//Cards that hold a current copy of the volume (bit n = slot n)
+//No card is current until the saved state is loaded by cardArray_initCards
+static uint8_t syncMask = 0;
+
+//Card being copied back into the mirror (CARD_ARRAY_CARDS if none), the next sector to copy and the end of the copy
+static uint8_t resyncSlot = CARD_ARRAY_CARDS;
+static uint32_t resyncSector = 0;
+static uint32_t resyncEnd = 0;
+
+//Cards that take part in the write in progress
+static uint8_t writeMask = 0;
+
+//Card used by the last read. It is kept while its access time is close to the best
+static uint8_t readSlot = 0;
+
+static CardArrayMirrorStats mirrorStats;
+#endif
+
+const MemCardSPIOps cardArray_spi2Ops = {
+    .setSpeed = &SPI2_setSpeed,
+    .abort = &SPI2_abort,
+    .clearAbort = &SPI2_clearAbort,
+    .exchangeByte = &SPI2_exchangeByte,
+    .sendByte = &SPI2_sendByte,
+    .exchangeBytes = &SPI2_exchangeBytes,
+    .sendBytes = &SPI2_sendBytes,
+    .fillZeros = &SPI2_fillZeros,
+    .receiveBytesTransmitFF = &SPI2_receiveBytesTransmitFF,
+    .receiveBytesToHandler = &SPI2_receiveBytesToHandler,
+    .sendResetSequence = &SPI2_sendResetSequence,
+
+    //No transfer queue, read-ahead data is received in the foreground
+    .queueTransaction = NULL,
+    .isQueueIdle = NULL,
+    .setCSHandler = NULL
+};
+
+//Drives CS of the card on SPI2
+static void cardArray_selectCard2(bool select)
+{
+    if (select)
+    {
+        CARD2_CS_SetLow();
+    }
+    else
+    {
+        CARD2_CS_SetHigh();
+    }
+}
+
+//Sets up the slot on SPI2 (if MEM_CARD_SLOTS > 1). Call after memCard_initDriver
+void cardArray_init(void)
+{
+#if (MEM_CARD_SLOTS > 1)
+    SPI2_initPins();
+    SPI2_initHost();
+
+    //The slot has no card detect
+    memCard_initSlot(CARD_ARRAY_SPI2_SLOT, &cardArray_spi2Ops, &cardArray_selectCard2, NULL);
+#endif
+
+    writeSlot = 0;
+    borrowSlot = 0;
+}
+
+//Initializes the cards in slots 0 to nCards - 1
+static bool cardArray_initSlots(uint8_t nCards)
+{
+    bool isReady = true;
+    uint8_t slot = memCard_getSlot();
+
+    for (uint8_t i = 0; i < nCards; i++)
+    {
+        if ((!memCard_selectSlot(i)) || (!memCard_initCard()))
+        {
+            isReady = false;
+        }
+    }
+
+    memCard_selectSlot(slot);
+    return isReady;
+}
+
+#if (CARD_ARRAY_MODE == CARD_ARRAY_MIRROR)
+//Reads a byte of the mirror state in data EEPROM
+static uint8_t cardArray_readEEPROM(uint8_t offset)
+{
+    uint24_t address = CARD_ARRAY_MIRROR_EEPROM + offset;
+
+    NVMADRU = (uint8_t) (address >> 16);
+    NVMADRH = (uint8_t) (address >> 8);
+    NVMADRL = (uint8_t) address;
+
+    //Read byte
+    NVMCON1bits.CMD = 0b000;
+    NVMCON0bits.GO = 1;
+    while (NVMCON0bits.GO);
+
+    return NVMDATL;
+}
+
+//Writes a byte of the mirror state in data EEPROM. A byte that already holds the value is not written
+static void cardArray_writeEEPROM(uint8_t offset, uint8_t data)
+{
+    //The read also sets the address
+    if (cardArray_readEEPROM(offset) == data)
+    {
+        return;
+    }
+
+    NVMDATL = data;
+
+    //Write byte. The unlock sequence must not be interrupted
+    NVMCON1bits.CMD = 0b011;
+
+    bool isGIE = INTCON0bits.GIE;
+    INTCON0bits.GIE = 0;
+    NVMLOCK = 0x55;
+    NVMLOCK = 0xAA;
+    NVMCON0bits.GO = 1;
+    INTCON0bits.GIE = isGIE;
+
+    while (NVMCON0bits.GO);
+
+    //Back to read, so a stray GO cannot write
+    NVMCON1bits.CMD = 0b000;
+}
+
+//Saves the mirror mask. Every change ends with this byte, so a reset keeps either the old or the new state
+static void cardArray_saveMirrorMask(void)
+{
+    cardArray_writeEEPROM(MIRROR_STATE_MASK_OFFSET, syncMask);
+}
+
+//Saves the CID of each current copy, then the mask
+static void cardArray_saveMirrorState(void)
+{
+    uint8_t cid[16];
+    uint8_t slot = memCard_getSlot();
+
+    for (uint8_t i = 0; i < CARD_ARRAY_CARDS; i++)
+    {
+        if (((syncMask & (1 << i)) != 0) && (memCard_selectSlot(i)) && (memCard_getCardID(&cid[0])))
+        {
+            for (uint8_t j = 0; j < 16; j++)
+            {
+                cardArray_writeEEPROM(MIRROR_STATE_CID_OFFSET + (i * 16) + j, cid[j]);
+            }
+        }
+    }
+
+    memCard_selectSlot(slot);
+
+    cardArray_saveMirrorMask();
+    cardArray_writeEEPROM(MIRROR_STATE_MAGIC_OFFSET, MIRROR_STATE_MAGIC);
+}
+
+//Loads the mirror state after the cards are initialized
+//A card is a current copy if it was one when the state was saved and it is the same card (CID)
+//Without a saved state, the contents of the cards are unknown, so only the first ready card is taken as a current copy
+static void cardArray_loadMirrorState(void)
+{
+    bool isSaved = (cardArray_readEEPROM(MIRROR_STATE_MAGIC_OFFSET) == MIRROR_STATE_MAGIC);
+    uint8_t savedMask = cardArray_readEEPROM(MIRROR_STATE_MASK_OFFSET);
+    uint8_t cid[16];
+    uint8_t slot = memCard_getSlot();
+
+    syncMask = 0;
+
+    for (uint8_t i = 0; i < CARD_ARRAY_CARDS; i++)
+    {
+        bool isCurrent = ((memCard_getSlotStatus(i) == STATUS_CARD_READY) && (memCard_selectSlot(i)) && (memCard_getCardID(&cid[0])));
+
+        if ((isCurrent) && (isSaved))
+        {
+            isCurrent = ((savedMask & (1 << i)) != 0);
+            for (uint8_t j = 0; (isCurrent) && (j < 16); j++)
+            {
+                isCurrent = (cardArray_readEEPROM(MIRROR_STATE_CID_OFFSET + (i * 16) + j) == cid[j]);
+            }
+        }
+        else if (isCurrent)
+        {
+            //The other cards must be resynced, or picked with cardArray_forceMirror
+            isCurrent = (syncMask == 0);
+        }
+
+        if (isCurrent)
+        {
+            syncMask |= (1 << i);
+        }
+        else
+        {
+            printf("[WARN] Card %u is not a current copy of the mirror\r\n", i);
+        }
+    }
+
+    memCard_selectSlot(slot);
+
+    //A card that is missing now misses the next writes
+    cardArray_saveMirrorState();
+}
+
+//Ends a resync that failed. The card stays out of the mirror
+static void cardArray_stopResync(void)
+{
+    printf("[ERROR] Copy to card %u failed at sector %lu\r\n", resyncSlot, resyncSector);
+    resyncSlot = CARD_ARRAY_CARDS;
+}
+#endif
+
+//Initializes the cards of the array (or the selected card)
+bool cardArray_initCards(void)
+{
+#if (CARD_ARRAY_MODE == CARD_ARRAY_SINGLE)
+    return memCard_initCard();
+#elif (CARD_ARRAY_MODE == CARD_ARRAY_MIRROR)
+    //The cards are reset, which ends a resync in progress
+    if (resyncSlot != CARD_ARRAY_CARDS)
+    {
+        cardArray_stopResync();
+    }
+
+    //One current copy is enough to run
+    cardArray_initSlots(CARD_ARRAY_CARDS);
+    cardArray_loadMirrorState();
+    return (cardArray_getStatus() == STATUS_CARD_READY);
+#else
+    return cardArray_initSlots(CARD_ARRAY_CARDS);
+#endif
+}
+
+#if (CARD_ARRAY_MODE == CARD_ARRAY_MIRROR)
+//Returns true if a card holds a current copy and is ready
+//A card that was removed may come back with other data, so it stays out of the mirror
+static bool cardArray_isMirrorReady(uint8_t slot)
+{
+    MemoryCardDriverStatus status = memCard_getSlotStatus(slot);
+
+    if (status == STATUS_CARD_NONE)
+    {
+        if ((syncMask & (1 << slot)) != 0)
+        {
+            syncMask &= ~(1 << slot);
+            cardArray_saveMirrorMask();
+        }
+
+        if (slot == resyncSlot)
+        {
+            cardArray_stopResync();
+        }
+    }
+
+    return (((syncMask & (1 << slot)) != 0) && (status == STATUS_CARD_READY));
+}
+
+//Returns true if a sector of a card being resynced is already copied, so writes to it must go to the card too
+static bool cardArray_isResyncedSector(uint8_t slot, uint32_t sector)
+{
+    return ((slot == resyncSlot) && (sector < resyncSector) && (memCard_getSlotStatus(slot) == STATUS_CARD_READY));
+}
+
+//Takes a card out of the mirror after a failed write
+static void cardArray_dropMirror(uint8_t slot)
+{
+    writeMask &= ~(1 << slot);
+
+    if (slot == resyncSlot)
+    {
+        //The card was not a current copy yet
+        cardArray_stopResync();
+        return;
+    }
+
+    syncMask &= ~(1 << slot);
+    cardArray_saveMirrorMask();
+    mirrorStats.writeFailures++;
+
+    printf("[ERROR] Card %u dropped from the mirror\r\n", slot);
+}
+
+//Returns the card to read from, skipping the cards in tried, or CARD_ARRAY_CARDS if none is left
+//An idle card wins over a card that is programming, then the lower access time wins
+static uint8_t cardArray_pickMirror(uint8_t tried)
+{
+    uint8_t best = CARD_ARRAY_CARDS;
+    uint16_t bestLatency = 0;
+
+    for (uint8_t i = 0; i < CARD_ARRAY_CARDS; i++)
+    {
+        if (((tried & (1 << i)) == 0) && (cardArray_isMirrorReady(i)))
+        {
+            //The last card gets a margin of 1/4, so the read-ahead of a sequential read is kept
+            uint16_t latency = memCard_getSlotLatency(i);
+            if (i == readSlot)
+            {
+                latency -= (latency >> 2);
+            }
+
+            if ((best == CARD_ARRAY_CARDS) ||
+                ((!memCard_isSlotBusy(i)) && (memCard_isSlotBusy(best))) ||
+                ((memCard_isSlotBusy(i) == memCard_isSlotBusy(best)) && (latency < bestLatency)))
+            {
+                best = i;
+                bestLatency = latency;
+            }
+        }
+    }
+
+    return best;
+}
+
+//Marks a card as tried after a failed read and returns the next card to read from
+static uint8_t cardArray_failover(uint8_t* tried, uint8_t slot, bool isCRCError)
+{
+    *tried |= (1 << slot);
+    uint8_t next = cardArray_pickMirror(*tried);
+
+    if (next < CARD_ARRAY_CARDS)
+    {
+        mirrorStats.failovers++;
+        if (isCRCError)
+        {
+            mirrorStats.crcFailovers++;
+        }
+    }
+
+    return next;
+}
+
+//Returns the read CRC error count of the selected card
+static uint16_t cardArray_getCRCErrors(void)
+{
+    MemCardReadStats stats;
+    memCard_getReadStats(&stats);
+    return stats.crcErrors;
+}
+
+//Reads from the best card. A failed read is served by the next card
+static bool cardArray_readMirror(uint32_t sect, uint16_t offset, uint8_t* data, uint16_t nBytes)
+{
+    uint8_t tried = 0;
+    uint8_t slot = cardArray_pickMirror(tried);
+
+    while (slot < CARD_ARRAY_CARDS)
+    {
+        bool isCRCError = false;
+        if (memCard_selectSlot(slot))
+        {
+            uint16_t crcErrors = cardArray_getCRCErrors();
+            if (memCard_readFromDisk(sect, offset, data, nBytes))
+            {
+                readSlot = slot;
+                mirrorStats.reads[slot]++;
+                return true;
+            }
+            isCRCError = (cardArray_getCRCErrors() != crcErrors);
+        }
+
+        slot = cardArray_failover(&tried, slot, isCRCError);
+    }
+
+    return false;
+}
+#endif
+
+//Returns the status of the array. The array is ready when all of its cards are ready
+//A mirror is ready when one current copy is ready
+MemoryCardDriverStatus cardArray_getStatus(void)
+{
+#if (CARD_ARRAY_MODE == CARD_ARRAY_SINGLE)
+    return memCard_getCardStatus();
+#elif (CARD_ARRAY_MODE == CARD_ARRAY_MIRROR)
+    MemoryCardDriverStatus status = STATUS_CARD_NONE;
+
+    for (uint8_t i = 0; i < CARD_ARRAY_CARDS; i++)
+    {
+        MemoryCardDriverStatus cardStatus = memCard_getSlotStatus(i);
+
+        //Cards that are not initialized are initialized first
+        if (cardStatus == STATUS_CARD_NOT_INIT)
+        {
+            status = STATUS_CARD_NOT_INIT;
+        }
+        else if (status != STATUS_CARD_NOT_INIT)
+        {
+            if (cardArray_isMirrorReady(i))
+            {
+                status = STATUS_CARD_READY;
+            }
+            else if ((cardStatus != STATUS_CARD_NONE) && (status == STATUS_CARD_NONE))
+            {
+                status = STATUS_CARD_ERROR;
+            }
+        }
+    }
+
+    return status;
+#else
+    MemoryCardDriverStatus status = STATUS_CARD_READY;
+
+    for (uint8_t i = 0; i < CARD_ARRAY_CARDS; i++)
+    {
+        MemoryCardDriverStatus cardStatus = memCard_getSlotStatus(i);
+
+        //A missing card wins over an error, and an error wins over a card that is not initialized
+        if ((cardStatus == STATUS_CARD_NONE) ||
+            ((cardStatus == STATUS_CARD_ERROR) && (status != STATUS_CARD_NONE)) ||
+            ((cardStatus == STATUS_CARD_NOT_INIT) && (status == STATUS_CARD_READY)))
+        {
+            status = cardStatus;
+        }
+    }
+
+    return status;
+#endif
+}
+
+//Selects a drive. Each slot is a drive, unless the cards are striped or mirrored (drive 0 only)
+bool cardArray_selectDrive(uint8_t drv)
+{
+#if (CARD_ARRAY_MODE == CARD_ARRAY_SINGLE)
+    return memCard_selectSlot(drv);
+#else
+    return (drv == 0);
+#endif
+}
+
+//Returns the card (slot) that holds a sector of the striped volume, and the sector on that card
+uint8_t cardArray_mapSector(uint32_t sector, uint32_t* cardSector)
+{
+    uint32_t stripe = sector / CARD_ARRAY_STRIPE_SECTORS;
+
+    *cardSector = ((stripe / CARD_ARRAY_CARDS) * CARD_ARRAY_STRIPE_SECTORS) + (sector % CARD_ARRAY_STRIPE_SECTORS);
+    return (uint8_t) (stripe % CARD_ARRAY_CARDS);
+}
+
+//Selects the card that holds a sector and converts the sector to the card's sector
+//Mirrors select the card to read from
+static bool cardArray_selectSector(uint32_t sector, uint32_t* cardSector)
+{
+#if (CARD_ARRAY_MODE == CARD_ARRAY_SINGLE)
+    *cardSector = sector;
+    return true;
+#elif (CARD_ARRAY_MODE == CARD_ARRAY_MIRROR)
+    *cardSector = sector;
+    readSlot = cardArray_pickMirror(0);
+    return memCard_selectSlot(readSlot);
+#else
+    return memCard_selectSlot(cardArray_mapSector(sector, cardSector));
+#endif
+}
+
+//Receives the stripe started on a card, if any
+static bool cardArray_finishStripe(uint8_t slot, uint8_t** data)
+{
+    uint8_t* buffer = *data;
+    if (buffer == NULL)
+    {
+        return true;
+    }
+
+    *data = NULL;
+    return ((memCard_selectSlot(slot)) && (memCard_finishRead(buffer)));
+}
+
+//Reads a run of whole sectors of the striped volume
+//Each card is sent its read command before the stripe of the previous card is received,
+//so a card looks up its data while the other card's data comes in. The transfers themselves do not overlap
+static bool cardArray_readStripes(uint32_t sect, uint8_t* data, uint16_t nSectors)
+{
+    uint8_t* startedData = NULL;
+    uint8_t startedSlot = 0;
+    bool isOK = true;
+
+    while ((isOK) && (nSectors != 0))
+    {
+        uint32_t cardSector;
+        uint8_t slot = cardArray_mapSector(sect, &cardSector);
+
+        uint16_t stripeSectors = CARD_ARRAY_STRIPE_SECTORS - (sect % CARD_ARRAY_STRIPE_SECTORS);
+        if (stripeSectors > nSectors)
+        {
+            stripeSectors = nSectors;
+        }
+
+        if ((memCard_selectSlot(slot)) && (memCard_startRead(cardSector, stripeSectors)))
+        {
+            //Receive the previous stripe while this card looks up its data
+            isOK = cardArray_finishStripe(startedSlot, &startedData);
+            startedSlot = slot;
+            startedData = data;
+        }
+        else
+        {
+            //The SPI is shared or the card has a write open. Read this stripe in the foreground
+            isOK = ((cardArray_finishStripe(startedSlot, &startedData)) &&
+                    (memCard_selectSlot(slot)) &&
+                    (memCard_readFromDisk(cardSector, 0, data, stripeSectors << FAT_BLOCK_SHIFT)));
+        }
+
+        sect += stripeSectors;
+        data += (stripeSectors << FAT_BLOCK_SHIFT);
+        nSectors -= stripeSectors;
+    }
+
+    //A started read is always received, so its card releases CS
+    return ((cardArray_finishStripe(startedSlot, &startedData)) && (isOK));
+}
+
+//Loads data from the array into the specified buffer at a block address and byte offset
+bool cardArray_readFromDisk(uint32_t sect, uint16_t offset, uint8_t* data, uint16_t nBytes)
+{
+#if (CARD_ARRAY_MODE == CARD_ARRAY_MIRROR)
+    return cardArray_readMirror(sect, offset, data, nBytes);
+#else
+    uint32_t cardSector;
+
+#if (CARD_ARRAY_MODE == CARD_ARRAY_STRIPE)
+    if ((offset == 0) && (nBytes > FAT_BLOCK_SIZE) && ((nBytes & (FAT_BLOCK_SIZE - 1)) == 0))
+    {
+        //A run of whole sectors is split where it moves to the next card
+        return cardArray_readStripes(sect, data, nBytes >> FAT_BLOCK_SHIFT);
+    }
+#endif
+
+    if (!cardArray_selectSector(sect, &cardSector))
+    {
+        return false;
+    }
+
+    return memCard_readFromDisk(cardSector, offset, data, nBytes);
+#endif
+}
+
+//Sends nBytes of a sector at a byte offset to the forward sink
+//Forwarded bytes cannot be taken back, so a mirror does not fail over here
+bool cardArray_forwardFromDisk(uint32_t sect, uint16_t offset, uint16_t nBytes)
+{
+    uint32_t cardSector;
+
+    if (!cardArray_selectSector(sect, &cardSector))
+    {
+        return false;
+    }
+
+    return memCard_forwardFromDisk(cardSector, offset, nBytes);
+}
+
+#if (CARD_ARRAY_MODE == CARD_ARRAY_MIRROR)
+//Starts a write (or in-place update) of a sector on every current copy
+//A card being resynced gets the write if the sector was already copied
+static bool cardArray_prepareMirror(uint32_t sector, bool isUpdate)
+{
+    writeMask = 0;
+
+    for (uint8_t i = 0; i < CARD_ARRAY_CARDS; i++)
+    {
+        if ((cardArray_isMirrorReady(i)) || (cardArray_isResyncedSector(i, sector)))
+        {
+            writeMask |= (1 << i);
+
+            if ((!memCard_selectSlot(i)) ||
+                (!((isUpdate) ? memCard_prepareUpdate(sector) : memCard_prepareWrite(sector))))
+            {
+                cardArray_dropMirror(i);
+            }
+        }
+    }
+
+    return (writeMask != 0);
+}
+#endif
+
+//Prepare to write to a specified sector
+bool cardArray_prepareWrite(uint32_t sector)
+{
+#if (CARD_ARRAY_MODE == CARD_ARRAY_MIRROR)
+    return cardArray_prepareMirror(sector, false);
+#else
+    uint32_t cardSector;
+
+    if (!cardArray_selectSector(sector, &cardSector))
+    {
+        return false;
+    }
+
+    writeSlot = memCard_getSlot();
+    return memCard_prepareWrite(cardSector);
+#endif
+}
+
+//Prepare to modify a specified sector in place
+bool cardArray_prepareUpdate(uint32_t sector)
+{
+#if (CARD_ARRAY_MODE == CARD_ARRAY_MIRROR)
+    return cardArray_prepareMirror(sector, true);
+#else
+    uint32_t cardSector;
+
+    if (!cardArray_selectSector(sector, &cardSector))
+    {
+        return false;
+    }
+
+    writeSlot = memCard_getSlot();
+    return memCard_prepareUpdate(cardSector);
+#endif
+}
+
+//Moves the write position inside the sector being written
+bool cardArray_seekWrite(uint16_t offset)
+{
+#if (CARD_ARRAY_MODE == CARD_ARRAY_MIRROR)
+    for (uint8_t i = 0; i < CARD_ARRAY_CARDS; i++)
+    {
+        if (((writeMask & (1 << i)) != 0) && ((!memCard_selectSlot(i)) || (!memCard_seekWrite(offset))))
+        {
+            cardArray_dropMirror(i);
+        }
+    }
+
+    return (writeMask != 0);
+#else
+    if (!memCard_selectSlot(writeSlot))
+    {
+        return false;
+    }
+
+    return memCard_seekWrite(offset);
+#endif
+}
+
+//Queues dLen bytes of data to write
+bool cardArray_queueWrite(uint8_t* data, uint16_t dLen)
+{
+#if (CARD_ARRAY_MODE == CARD_ARRAY_MIRROR)
+    //Each copy is queued in the cache of its card
+    for (uint8_t i = 0; i < CARD_ARRAY_CARDS; i++)
+    {
+        if (((writeMask & (1 << i)) != 0) && ((!memCard_selectSlot(i)) || (!memCard_queueWrite(data, dLen))))
+        {
+            cardArray_dropMirror(i);
+        }
+    }
+
+    return (writeMask != 0);
+#else
+    if (!memCard_selectSlot(writeSlot))
+    {
+        return false;
+    }
+
+    return memCard_queueWrite(data, dLen);
+#endif
+}
+
+//Writes the sector being written. Returns once the data is sent, while the card programs it
+CommandError cardArray_writeBlock(void)
+{
+#if (CARD_ARRAY_MODE == CARD_ARRAY_MIRROR)
+    //The first card programs its copy while the next copy is sent
+    CommandError err = CARD_NOT_INIT;
+
+    for (uint8_t i = 0; i < CARD_ARRAY_CARDS; i++)
+    {
+        if ((writeMask & (1 << i)) != 0)
+        {
+            CommandError cardErr = (memCard_selectSlot(i)) ? memCard_writeBlock() : CARD_NOT_INIT;
+            if (cardErr == CARD_NO_ERROR)
+            {
+                err = CARD_NO_ERROR;
+            }
+            else
+            {
+                cardArray_dropMirror(i);
+                if (err != CARD_NO_ERROR)
+                {
+                    err = cardErr;
+                }
+            }
+        }
+    }
+
+    writeMask = 0;
+    return err;
+#else
+    if (!memCard_selectSlot(writeSlot))
+    {
+        return CARD_NOT_INIT;
+    }
+
+    return memCard_writeBlock();
+#endif
+}
+
+//Programs the queued writes of each card (see memCard_flushWrites)
+bool cardArray_flushWrites(void)
+{
+#if (CARD_ARRAY_MODE == CARD_ARRAY_SINGLE)
+    return (memCard_flushWrites() == CARD_NO_ERROR);
+#else
+    bool isOK = true;
+    uint8_t slot = memCard_getSlot();
+
+    for (uint8_t i = 0; i < CARD_ARRAY_CARDS; i++)
+    {
+#if (CARD_ARRAY_MODE == CARD_ARRAY_MIRROR)
+        if (((cardArray_isMirrorReady(i)) || (i == resyncSlot)) && ((!memCard_selectSlot(i)) || (memCard_flushWrites() != CARD_NO_ERROR)))
+        {
+            cardArray_dropMirror(i);
+        }
+#else
+        if ((!memCard_selectSlot(i)) || (memCard_flushWrites() != CARD_NO_ERROR))
+        {
+            isOK = false;
+        }
+#endif
+    }
+
+    memCard_selectSlot(slot);
+
+#if (CARD_ARRAY_MODE == CARD_ARRAY_MIRROR)
+    isOK = (syncMask != 0);
+#endif
+    return isOK;
+#endif
+}
+
+//Returns the allocation unit of the array in sectors (0 if not known)
+uint32_t cardArray_getAllocationUnit(void)
+{
+#if (CARD_ARRAY_MODE == CARD_ARRAY_SINGLE)
+    return memCard_getSlotAllocationUnit(memCard_getSlot());
+#else
+    //The largest AU of the cards
+    uint32_t auBlocks = 0;
+
+    for (uint8_t i = 0; i < CARD_ARRAY_CARDS; i++)
+    {
+        uint32_t cardAU = memCard_getSlotAllocationUnit(i);
+        if (cardAU > auBlocks)
+        {
+            auBlocks = cardAU;
+        }
+    }
+
+#if (CARD_ARRAY_MODE == CARD_ARRAY_STRIPE)
+    //A run of AU x CARD_ARRAY_CARDS sectors puts one whole AU on each card
+    auBlocks *= CARD_ARRAY_CARDS;
+#endif
+    return auBlocks;
+#endif
+}
+
+//Starts erasing a range of sectors on each card (see memCard_startErase)
+bool cardArray_startErase(uint32_t sector, uint32_t count)
+{
+#if (CARD_ARRAY_MODE == CARD_ARRAY_SINGLE)
+    return (memCard_startErase(sector, count) == CARD_NO_ERROR);
+#else
+    bool isOK = true;
+    uint8_t slot = memCard_getSlot();
+
+    for (uint8_t i = 0; i < CARD_ARRAY_CARDS; i++)
+    {
+#if (CARD_ARRAY_MODE == CARD_ARRAY_MIRROR)
+        //A copy that was not erased no longer matches the others. Sectors a resync has not reached yet are copied later
+        if (((cardArray_isMirrorReady(i)) || (i == resyncSlot)) && ((!memCard_selectSlot(i)) || (memCard_startErase(sector, count) != CARD_NO_ERROR)))
+        {
+            cardArray_dropMirror(i);
+        }
+#else
+        //The sectors of a card inside the range are consecutive on that card
+        uint32_t first = sector;
+        uint32_t last = sector + count;
+        uint32_t firstSector, lastSector;
+
+        while ((first < last) && (cardArray_mapSector(first, &firstSector) != i))
+        {
+            first++;
+        }
+
+        while ((last > first) && (cardArray_mapSector(last - 1, &lastSector) != i))
+        {
+            last--;
+        }
+
+        if ((first < last) && ((!memCard_selectSlot(i)) || (memCard_startErase(firstSector, lastSector - firstSector + 1) != CARD_NO_ERROR)))
+        {
+            isOK = false;
+        }
+#endif
+    }
+
+    memCard_selectSlot(slot);
+
+#if (CARD_ARRAY_MODE == CARD_ARRAY_MIRROR)
+    isOK = (syncMask != 0);
+#endif
+    return isOK;
+#endif
+}
+
+//Loads a sector into the cache of its card and returns a pointer to it, or NULL on failure
+const uint8_t* cardArray_borrowSector(uint32_t sector)
+{
+#if (CARD_ARRAY_MODE == CARD_ARRAY_MIRROR)
+    uint8_t tried = 0;
+    uint8_t slot = cardArray_pickMirror(tried);
+
+    while (slot < CARD_ARRAY_CARDS)
+    {
+        bool isCRCError = false;
+        if (memCard_selectSlot(slot))
+        {
+            uint16_t crcErrors = cardArray_getCRCErrors();
+
+            const uint8_t* buffer = memCard_borrowSector(sector);
+            if (buffer != NULL)
+            {
+                readSlot = slot;
+                borrowSlot = slot;
+                mirrorStats.reads[slot]++;
+                return buffer;
+            }
+            isCRCError = (cardArray_getCRCErrors() != crcErrors);
+        }
+
+        slot = cardArray_failover(&tried, slot, isCRCError);
+    }
+
+    return NULL;
+#else
+    uint32_t cardSector;
+
+    if (!cardArray_selectSector(sector, &cardSector))
+    {
+        return NULL;
+    }
+
+    borrowSlot = memCard_getSlot();
+    return memCard_borrowSector(cardSector);
+#endif
+}
+
+//Releases the sector returned by cardArray_borrowSector
+void cardArray_releaseSector(void)
+{
+    if (memCard_selectSlot(borrowSlot))
+    {
+        memCard_releaseSector();
+    }
+}
+
+//Sets the read-ahead depth of each card
+void cardArray_setPrefetchDepth(uint8_t depth)
+{
+#if (CARD_ARRAY_MODE == CARD_ARRAY_SINGLE)
+    memCard_setPrefetchDepth(depth);
+#else
+    uint8_t slot = memCard_getSlot();
+
+    for (uint8_t i = 0; i < CARD_ARRAY_CARDS; i++)
+    {
+        if (memCard_selectSlot(i))
+        {
+            memCard_setPrefetchDepth(depth);
+        }
+    }
+
+    memCard_selectSlot(slot);
+#endif
+}
+
+//Sets the CRC policy of new transfers on each card. Returns the policy it replaces
+MemCardCRCPolicy cardArray_setCRCPolicy(MemCardCRCPolicy policy)
+{
+#if (CARD_ARRAY_MODE == CARD_ARRAY_SINGLE)
+    MemCardCRCPolicy previous = memCard_getCRCPolicy();
+    memCard_setCRCPolicy(policy);
+    return previous;
+#else
+    MemCardCRCPolicy previous = CRC_DEFAULT_POLICY;
+    uint8_t slot = memCard_getSlot();
+
+    for (uint8_t i = 0; i < CARD_ARRAY_CARDS; i++)
+    {
+        if (memCard_selectSlot(i))
+        {
+            //The cards of the array share a policy. The first card reports it
+            if (i == 0)
+            {
+                previous = memCard_getCRCPolicy();
+            }
+            memCard_setCRCPolicy(policy);
+        }
+    }
+
+    memCard_selectSlot(slot);
+    return previous;
+#endif
+}
+
+//Copies a 16-byte ID of the array. Striped cards return the XOR of their CIDs
+//A mirror returns the CID of its first current copy
+bool cardArray_getCardID(uint8_t* cid)
+{
+#if (CARD_ARRAY_MODE == CARD_ARRAY_SINGLE)
+    return memCard_getCardID(cid);
+#elif (CARD_ARRAY_MODE == CARD_ARRAY_MIRROR)
+    uint8_t slot = memCard_getSlot();
+    bool isValid = false;
+
+    for (uint8_t i = 0; (!isValid) && (i < CARD_ARRAY_CARDS); i++)
+    {
+        isValid = ((cardArray_isMirrorReady(i)) && (memCard_selectSlot(i)) && (memCard_getCardID(cid)));
+    }
+
+    memCard_selectSlot(slot);
+    return isValid;
+#else
+    uint8_t cardID[16];
+    bool isValid = true;
+    uint8_t slot = memCard_getSlot();
+
+    for (uint8_t i = 0; i < 16; i++)
+    {
+        cid[i] = 0x00;
+    }
+
+    for (uint8_t i = 0; (isValid) && (i < CARD_ARRAY_CARDS); i++)
+    {
+        isValid = ((memCard_selectSlot(i)) && (memCard_getCardID(&cardID[0])));
+
+        for (uint8_t j = 0; (isValid) && (j < 16); j++)
+        {
+            cid[j] ^= cardID[j];
+        }
+    }
+
+    memCard_selectSlot(slot);
+    return isValid;
+#endif
+}
+
+//Copies the mirror counters
+void cardArray_getMirrorStats(CardArrayMirrorStats* stats)
+{
+#if (CARD_ARRAY_MODE == CARD_ARRAY_MIRROR)
+    *stats = mirrorStats;
+#else
+    memset(stats, 0, sizeof(CardArrayMirrorStats));
+#endif
+}
+
+//Clears the mirror counters
+void cardArray_clearMirrorStats(void)
+{
+#if (CARD_ARRAY_MODE == CARD_ARRAY_MIRROR)
+    memset(&mirrorStats, 0, sizeof(CardArrayMirrorStats));
+#endif
+}
+
+//Returns the cards that hold a current copy of the mirror (bit n = slot n)
+uint8_t cardArray_getMirrorMask(void)
+{
+#if (CARD_ARRAY_MODE == CARD_ARRAY_MIRROR)
+    return syncMask;
+#else
+    return 0;
+#endif
+}
+
+#if (CARD_ARRAY_MODE == CARD_ARRAY_MIRROR)
+//Loads a little-endian 32-bit value
+static uint32_t cardArray_loadDWord(const uint8_t* data)
+{
+    return ((uint32_t) data[3] << 24) | ((uint32_t) data[2] << 16) | ((uint32_t) data[1] << 8) | data[0];
+}
+
+//Returns the number of sectors used by the volume, or 0 if sector 0 cannot be read
+//This is the end of the last partition, or the size of a FAT volume without a partition table
+static uint32_t cardArray_getVolumeEnd(void)
+{
+    const uint8_t* sector = cardArray_borrowSector(0);
+    uint32_t end = 0;
+
+    if (sector == NULL)
+    {
+        return 0;
+    }
+
+    if ((sector[510] == 0x55) && (sector[511] == 0xAA))
+    {
+        if ((memcmp(&sector[54], "FAT", 3) == 0) || (memcmp(&sector[82], "FAT", 3) == 0))
+        {
+            //FAT boot sector. 16-bit total sectors, or the 32-bit count if 0
+            end = ((uint16_t) sector[20] << 8) | sector[19];
+            if (end == 0)
+            {
+                end = cardArray_loadDWord(&sector[32]);
+            }
+        }
+        else
+        {
+            //Partition table
+            for (uint16_t entry = 446; entry < 510; entry += 16)
+            {
+                uint32_t partEnd = cardArray_loadDWord(&sector[entry + 8]) + cardArray_loadDWord(&sector[entry + 12]);
+                if ((sector[entry + 4] != 0) && (partEnd > end))
+                {
+                    end = partEnd;
+                }
+            }
+        }
+    }
+
+    cardArray_releaseSector();
+    return end;
+}
+
+//Copies a sector from a current copy to the card being resynced
+static bool cardArray_copySector(uint32_t sector)
+{
+    const uint8_t* data = cardArray_borrowSector(sector);
+
+    bool isCopied = ((data != NULL) && (memCard_selectSlot(resyncSlot)) && (memCard_prepareWrite(sector)) &&
+            (memCard_queueWrite((uint8_t*) data, FAT_BLOCK_SIZE)) && (memCard_writeBlock() == CARD_NO_ERROR));
+
+    if (data != NULL)
+    {
+        cardArray_releaseSector();
+    }
+
+    return isCopied;
+}
+#endif
+
+//Starts copying the mirror onto a ready card that is not a current copy
+bool cardArray_startResync(uint8_t slot)
+{
+#if (CARD_ARRAY_MODE == CARD_ARRAY_MIRROR)
+    if ((slot >= CARD_ARRAY_CARDS) || (resyncSlot != CARD_ARRAY_CARDS) || (writeMask != 0) ||
+        ((syncMask & (1 << slot)) != 0) || (memCard_getSlotStatus(slot) != STATUS_CARD_READY))
+    {
+        return false;
+    }
+
+    resyncEnd = cardArray_getVolumeEnd();
+    if (resyncEnd == 0)
+    {
+        printf("[ERROR] No volume to copy to card %u\r\n", slot);
+        return false;
+    }
+
+    resyncSector = 0;
+    resyncSlot = slot;
+
+    printf("Copying %lu sectors to card %u\r\n", resyncEnd, slot);
+    return true;
+#else
+    return false;
+#endif
+}
+
+//Copies the next CARD_ARRAY_RESYNC_SECTORS sectors of a resync. Returns true while a resync is running
+bool cardArray_resyncTasks(void)
+{
+#if (CARD_ARRAY_MODE == CARD_ARRAY_MIRROR)
+    if (resyncSlot == CARD_ARRAY_CARDS)
+    {
+        return false;
+    }
+
+    if (memCard_getSlotStatus(resyncSlot) != STATUS_CARD_READY)
+    {
+        cardArray_stopResync();
+        return false;
+    }
+
+    if (writeMask != 0)
+    {
+        //A sector write is open, the caches are in use
+        return true;
+    }
+
+    uint8_t slot = memCard_getSlot();
+
+    for (uint8_t i = 0; (i < CARD_ARRAY_RESYNC_SECTORS) && (resyncSector < resyncEnd); i++)
+    {
+        if (!cardArray_copySector(resyncSector))
+        {
+            cardArray_stopResync();
+            memCard_selectSlot(slot);
+            return false;
+        }
+
+        resyncSector++;
+    }
+
+    if (resyncSector >= resyncEnd)
+    {
+        //The last copies must be on the card before it counts as a current copy
+        if ((!memCard_selectSlot(resyncSlot)) || (memCard_flushWrites() != CARD_NO_ERROR) || (memCard_waitReady() != CARD_NO_ERROR))
+        {
+            cardArray_stopResync();
+        }
+        else
+        {
+            syncMask |= (1 << resyncSlot);
+            cardArray_saveMirrorState();
+
+            printf("Card %u rejoined the mirror\r\n", resyncSlot);
+            resyncSlot = CARD_ARRAY_CARDS;
+        }
+    }
+
+    memCard_selectSlot(slot);
+    return (resyncSlot != CARD_ARRAY_CARDS);
+#else
+    return false;
+#endif
+}
+
+//Makes a ready card the only current copy of the mirror
+bool cardArray_forceMirror(uint8_t slot)
+{
+#if (CARD_ARRAY_MODE == CARD_ARRAY_MIRROR)
+    if ((slot >= CARD_ARRAY_CARDS) || (resyncSlot != CARD_ARRAY_CARDS) || (memCard_getSlotStatus(slot) != STATUS_CARD_READY))
+    {
+        return false;
+    }
+
+    syncMask = (1 << slot);
+    cardArray_saveMirrorState();
+    return true;
+#else
+    return false;
+#endif
+}
+
+//Counts TMR2 periods while a benchmark runs
+void __interrupt(irq(TMR2),base(8)) cardArray_TMR2_ISR(void)
+{
+    PIR3bits.TMR2IF = 0;
+    benchTicks++;
+}
+
+//Starts counting TMR2 periods
+static void cardArray_startTicks(void)
+{
+    PIE3bits.TMR2IE = 0;
+    benchTicks = 0;
+    PIR3bits.TMR2IF = 0;
+    PIE3bits.TMR2IE = 1;
+}
+
+//Stops counting and returns the number of TMR2 periods
+static uint16_t cardArray_stopTicks(void)
+{
+    PIE3bits.TMR2IE = 0;
+    return (benchTicks == 0) ? 1 : benchTicks;
+}
+
+//Selects the card of a benchmark sector for a layout (CARD_ARRAY_SINGLE, _STRIPE or _MIRROR)
+//Without striping, every sector is on card 0. Mirrors write one copy per card
+static bool cardArray_selectBench(uint32_t sector, uint8_t layout, uint8_t copy, uint32_t* cardSector)
+{
+    if (layout == CARD_ARRAY_STRIPE)
+    {
+        return memCard_selectSlot(cardArray_mapSector(sector, cardSector));
+    }
+
+    *cardSector = sector;
+    return memCard_selectSlot((layout == CARD_ARRAY_MIRROR) ? copy : 0);
+}
+
+//Programs the queued writes and waits for every card of the run to finish programming
+static bool cardArray_waitAll(uint8_t layout)
+{
+    bool isOK = true;
+
+    for (uint8_t i = 0; i < ((layout == CARD_ARRAY_SINGLE) ? 1 : CARD_ARRAY_CARDS); i++)
+    {
+        if ((!memCard_selectSlot(i)) || (memCard_flushWrites() != CARD_NO_ERROR) || (memCard_waitReady() != CARD_NO_ERROR))
+        {
+            isOK = false;
+        }
+    }
+
+    return isOK;
+}
+
+//Writes nSectors raw sectors. Returns the number of TMR2 periods, or 0 on failure
+static uint16_t cardArray_benchWrite(uint32_t startSector, uint16_t nSectors, uint8_t layout)
+{
+    uint8_t pattern[BENCH_CHUNK_SIZE];
+    uint32_t cardSector;
+    bool isOK = true;
+
+    for (uint8_t i = 0; i < BENCH_CHUNK_SIZE; i++)
+    {
+        pattern[i] = i;
+    }
+
+    cardArray_startTicks();
+
+    for (uint16_t i = 0; (isOK) && (i < nSectors); i++)
+    {
+        for (uint8_t copy = 0; (isOK) && (copy < ((layout == CARD_ARRAY_MIRROR) ? CARD_ARRAY_CARDS : 1)); copy++)
+        {
+            //Each card programs its sector while the next card receives data
+            isOK = ((cardArray_selectBench(startSector + i, layout, copy, &cardSector)) &&
+                    (memCard_prepareWrite(cardSector)));
+
+            for (uint16_t j = 0; (isOK) && (j < FAT_BLOCK_SIZE); j += BENCH_CHUNK_SIZE)
+            {
+                isOK = memCard_queueWrite(&pattern[0], BENCH_CHUNK_SIZE);
+            }
+
+            isOK = ((isOK) && (memCard_writeBlock() == CARD_NO_ERROR));
+        }
+    }
+
+    isOK = ((cardArray_waitAll(layout)) && (isOK));
+    uint16_t ticks = cardArray_stopTicks();
+
+    return (isOK) ? ticks : 0;
+}
+
+//Reads nSectors raw sectors, BENCH_READ_SECTORS at a time, and checks the start of each one
+//Returns the number of TMR2 periods, or 0 on failure
+static uint16_t cardArray_benchRead(uint32_t startSector, uint16_t nSectors, uint8_t layout)
+{
+    uint8_t data[BENCH_READ_SECTORS * FAT_BLOCK_SIZE];
+    bool isOK = true;
+
+    cardArray_startTicks();
+
+    for (uint16_t i = 0; (isOK) && (i < nSectors); i += BENCH_READ_SECTORS)
+    {
+        uint16_t count = nSectors - i;
+        if (count > BENCH_READ_SECTORS)
+        {
+            count = BENCH_READ_SECTORS;
+        }
+
+        //Both layouts read the same runs of whole sectors straight into the buffer
+        if (layout == CARD_ARRAY_STRIPE)
+        {
+            isOK = cardArray_readStripes(startSector + i, &data[0], count);
+        }
+        else
+        {
+            isOK = ((memCard_selectSlot(0)) && (memCard_readFromDisk(startSector + i, 0, &data[0], count << FAT_BLOCK_SHIFT)));
+        }
+
+        for (uint16_t sector = 0; (isOK) && (sector < count); sector++)
+        {
+            for (uint8_t j = 0; (isOK) && (j < BENCH_CHUNK_SIZE); j++)
+            {
+                isOK = (data[(sector << FAT_BLOCK_SHIFT) + j] == j);
+            }
+        }
+    }
+
+    uint16_t ticks = cardArray_stopTicks();
+
+    return (isOK) ? ticks : 0;
+}
+
+//Prints the throughput of a benchmark run
+static void cardArray_printRate(const char* name, uint16_t nSectors, uint16_t ticks)
+{
+    if (ticks == 0)
+    {
+        printf("[ERROR] %s failed\r\n", name);
+        return;
+    }
+
+    //KB/s = (nSectors / 2) / (ticks * 4 ms)
+    printf("%s: %lu KB/s (%lu ms)\r\n", name, ((uint32_t) nSectors * 125) / ticks, (uint32_t) ticks * 4);
+}
+
+//Writes and reads back nSectors raw sectors on card 0 alone and striped across the array
+//The mirrored write writes every sector to each card
+void cardArray_benchmark(uint32_t startSector, uint16_t nSectors)
+{
+#if (MEM_CARD_SLOTS < CARD_ARRAY_CARDS)
+    printf("[ERROR] Benchmark needs %u card slots\r\n", CARD_ARRAY_CARDS);
+#else
+    uint8_t slot = memCard_getSlot();
+
+    if (!cardArray_initSlots(CARD_ARRAY_CARDS))
+    {
+        printf("[ERROR] Card array is not ready\r\n");
+        return;
+    }
+
+    printf("Benchmark of %u sectors from sector %lu\r\n", nSectors, startSector);
+
+    cardArray_printRate("Single write", nSectors, cardArray_benchWrite(startSector, nSectors, CARD_ARRAY_SINGLE));
+    cardArray_printRate("Single read", nSectors, cardArray_benchRead(startSector, nSectors, CARD_ARRAY_SINGLE));
+    cardArray_printRate("Striped write", nSectors, cardArray_benchWrite(startSector, nSectors, CARD_ARRAY_STRIPE));
+    cardArray_printRate("Striped read", nSectors, cardArray_benchRead(startSector, nSectors, CARD_ARRAY_STRIPE));
+    cardArray_printRate("Mirrored write", nSectors, cardArray_benchWrite(startSector, nSectors, CARD_ARRAY_MIRROR));
+
+    memCard_selectSlot(slot);
+#endif
+}
@@ -0,0 +1,158 @@
+#ifndef CARDARRAY_H
+#define	CARDARRAY_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "memoryCard.h"
+
+//Block layer modes
+//Each slot is its own drive (see disk_select)
+#define CARD_ARRAY_SINGLE 0
+
+//Consecutive stripes of sectors go to the cards in turn. All cards form drive 0
+#define CARD_ARRAY_STRIPE 1
+
+//Every card holds a copy of the volume. Reads use one card, writes go to all of them
+#define CARD_ARRAY_MIRROR 2
+
+//Selects how the card slots are used by Petit FatFs
+#define CARD_ARRAY_MODE CARD_ARRAY_SINGLE
+
+//Number of cards in the array. Slots 0 to CARD_ARRAY_CARDS - 1 are used
+#define CARD_ARRAY_CARDS 2
+
+//Sectors written to one card before moving to the next card
+#define CARD_ARRAY_STRIPE_SECTORS 1
+
+//Slot of the card on SPI2
+#define CARD_ARRAY_SPI2_SLOT 1
+
+//Data EEPROM address of the saved mirror state (2 + 16 x CARD_ARRAY_CARDS bytes)
+#define CARD_ARRAY_MIRROR_EEPROM 0x380000
+
+//Sectors copied by each call of cardArray_resyncTasks
+#define CARD_ARRAY_RESYNC_SECTORS 8
+
+//CS of the card on SPI2 (RD3)
+#define CARD2_CS_SetLow() do { LATD3 = 0; } while (0)
+#define CARD2_CS_SetHigh() do { LATD3 = 1; } while (0)
+
+#if (CARD_ARRAY_MODE != CARD_ARRAY_SINGLE) && (CARD_ARRAY_CARDS > MEM_CARD_SLOTS)
+#error "CARD_ARRAY_CARDS is larger than MEM_CARD_SLOTS"
+#endif
+
+#if (CARD_ARRAY_MODE == CARD_ARRAY_MIRROR) && defined(MEM_CARD_CACHELESS)
+#error "Mirroring needs the sector cache of each card"
+#endif
+
+    //Mirror counters (see cardArray_getMirrorStats)
+    typedef struct {
+        uint16_t reads[CARD_ARRAY_CARDS];   //Reads served by each card
+        uint16_t failovers;                 //Reads served by another card after a failed read
+        uint16_t crcFailovers;              //Failovers caused by a CRC error
+        uint16_t writeFailures;             //Writes that failed on one card (the card leaves the mirror)
+    } CardArrayMirrorStats;
+
+    //SPI functions of SPI2
+    extern const MemCardSPIOps cardArray_spi2Ops;
+
+    //Sets up the slot on SPI2 (if MEM_CARD_SLOTS > 1). Call after memCard_initDriver
+    void cardArray_init(void);
+
+    //Initializes the cards of the array (or the selected card)
+    bool cardArray_initCards(void);
+
+    //Returns the status of the array. The array is ready when all of its cards are ready
+    //A mirror is ready when one current copy is ready
+    MemoryCardDriverStatus cardArray_getStatus(void);
+
+    //Selects a drive. Each slot is a drive, unless the cards are striped or mirrored (drive 0 only)
+    bool cardArray_selectDrive(uint8_t drv);
+
+    //Returns the card (slot) that holds a sector of the striped volume, and the sector on that card
+    uint8_t cardArray_mapSector(uint32_t sector, uint32_t* cardSector);
+
+    //Loads data from the array into the specified buffer at a block address and byte offset
+    bool cardArray_readFromDisk(uint32_t sect, uint16_t offset, uint8_t* data, uint16_t nBytes);
+
+    //Sends nBytes of a sector at a byte offset to the forward sink
+    bool cardArray_forwardFromDisk(uint32_t sect, uint16_t offset, uint16_t nBytes);
+
+    //Prepare to write to a specified sector
+    bool cardArray_prepareWrite(uint32_t sector);
+
+    //Prepare to modify a specified sector in place
+    bool cardArray_prepareUpdate(uint32_t sector);
+
+    //Moves the write position inside the sector being written
+    bool cardArray_seekWrite(uint16_t offset);
+
+    //Queues dLen bytes of data to write
+    bool cardArray_queueWrite(uint8_t* data, uint16_t dLen);
+
+    //Writes the sector being written. Returns once the data is sent, while the card programs it
+    CommandError cardArray_writeBlock(void);
+
+    //Programs the queued writes of each card (see memCard_flushWrites)
+    bool cardArray_flushWrites(void);
+
+    //Returns the allocation unit of the array in sectors (0 if not known)
+    //Striped cards return the AU of one card times CARD_ARRAY_CARDS
+    uint32_t cardArray_getAllocationUnit(void);
+
+    //Starts erasing a range of sectors on each card (see memCard_startErase)
+    //Each card can erase up to ERASE_MAX_BLOCKS sectors of the range
+    bool cardArray_startErase(uint32_t sector, uint32_t count);
+
+    //Loads a sector into the cache of its card and returns a pointer to it, or NULL on failure
+    const uint8_t* cardArray_borrowSector(uint32_t sector);
+
+    //Releases the sector returned by cardArray_borrowSector
+    void cardArray_releaseSector(void);
+
+    //Sets the read-ahead depth of each card
+    void cardArray_setPrefetchDepth(uint8_t depth);
+
+    //Sets the CRC policy of new transfers on each card (see memCard_setCRCPolicy)
+    //Returns the policy it replaces (the policy of the first card of an array)
+    MemCardCRCPolicy cardArray_setCRCPolicy(MemCardCRCPolicy policy);
+
+    //Copies a 16-byte ID of the array. Striped cards return the XOR of their CIDs
+    //A mirror returns the CID of its first current copy
+    bool cardArray_getCardID(uint8_t* cid);
+
+    //Copies the mirror counters
+    void cardArray_getMirrorStats(CardArrayMirrorStats* stats);
+
+    //Clears the mirror counters
+    void cardArray_clearMirrorStats(void);
+
+    //Returns the cards that hold a current copy of the mirror (bit n = slot n)
+    uint8_t cardArray_getMirrorMask(void);
+
+    //Starts copying the mirror onto a ready card that is not a current copy. THE DATA ON THE CARD IS OVERWRITTEN
+    //The sectors up to the end of the last partition (or of a volume without a partition table) are copied
+    bool cardArray_startResync(uint8_t slot);
+
+    //Call from the main loop. Copies the next CARD_ARRAY_RESYNC_SECTORS sectors of a resync
+    //The card rejoins the mirror after the last sector. Returns true while a resync is running
+    bool cardArray_resyncTasks(void);
+
+    //Makes a ready card the only current copy of the mirror, for when no copy is current or the first use picked the wrong card
+    //Check the card first. The other cards must be resynced
+    bool cardArray_forceMirror(uint8_t slot);
+
+    //Writes and reads back nSectors raw sectors on card 0 alone and striped across the array, then writes them mirrored
+    //Prints the throughput of each run. DESTROYS THE DATA in the sectors used
+    void cardArray_benchmark(uint32_t startSector, uint16_t nSectors);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* CARDARRAY_H */
@@ -33,7 +33,9 @@
 #include "mcc_generated_files/system/system.h"
 #include "spi1_host.h"
 #include "memoryCard.h"
+#include "cardArray.h"
 #include "unitTests.h"
+#include "ringLog.h"
 #include "Petite-FatFs/diskio.h"
 #include "Petite-FatFs/pff.h"
 #include "mcc_generated_files/timer/delay.h"
@@ -47,6 +49,23 @@
 
 //#define UNIT_TEST_ENABLE
 
+//Runs the card array benchmark once the cards are ready
+//THE SECTORS USED ARE OVERWRITTEN, pick a range outside of the file system
+//#define BENCHMARK_ENABLE
+#define BENCHMARK_START_SECTOR 0x00100000
+#define BENCHMARK_SECTORS 256
+
+//Writes a record to a pre-sized "ring.log" on each mount, then erases its next records while idle
+//THE OLDEST RECORDS OF THE FILE ARE OVERWRITTEN
+//#define RING_LOG_ENABLE
+
+//Copies the mirror onto each ready card that is not a current copy (CARD_ARRAY_MIRROR only)
+//THE DATA ON THAT CARD IS OVERWRITTEN
+//#define MIRROR_RESYNC_ENABLE
+
+//Period of TMR2 in ms
+#define TICK_PERIOD 4
+
 void onCardChange(void)
 {
     if (IS_CARD_ATTACHED())
@@ -69,11 +88,20 @@ uint16_t getStringLength(const char* str)
     return count;
 }
 
+//Prints up to len characters of file data, stops at '\0'
+void printView(const BYTE* data, unsigned int len)
+{
+    for (unsigned int index = 0; (index < len) && (data[index] != '\0'); index++)
+    {
+        putchar(data[index]);
+    }
+}
+
 void modifyFile(const char* filename)
 {
     FRESULT result;
     unsigned int rxLen = 0;
-    char rxBuffer[127];
+    const BYTE* view;
     
     const char* newMessage = "Hello from PIC18F56Q71";
     unsigned int bwLen = 0;
@@ -87,10 +115,13 @@ void modifyFile(const char* filename)
         //File opened OK
         
         //Read the original Message
-        if (pf_read(&rxBuffer[0], 126, &rxLen) == FR_OK)
+        //The text is printed straight out of the driver's sector cache
+        if (pf_read_view(&view, 126, &rxLen) == FR_OK)
         {
-            rxBuffer[rxLen] = '\0';
-            printf("Printing file \"%s\"\r\n> %s\r\n", filename, rxBuffer);
+            printf("Printing file \"%s\"\r\n> ", filename);
+            printView(view, rxLen);
+            printf("\r\n");
+            pf_release_view();
         }
         else
         {
@@ -99,6 +130,14 @@ void modifyFile(const char* filename)
         }
         
         //Overwrite the original message
+        //Writes start at the file pointer, so return to the start of the file
+        result = pf_lseek(0);
+        if (result != FR_OK)
+        {
+            printf("[ERROR] Failed to seek file\r\n");
+            return;
+        }
+        
         //First queue the new text
         result = pf_write(&newMessage[0], getStringLength(newMessage), &bwLen);
         if (result == FR_OK)
@@ -134,10 +173,12 @@ void modifyFile(const char* filename)
         }
         
         //Read the new message
-        if (pf_read(&rxBuffer[0], 126, &rxLen) == FR_OK)
+        if (pf_read_view(&view, 126, &rxLen) == FR_OK)
         {
-            rxBuffer[rxLen] = '\0';
-            printf("Printing modified file \"%s\"\r\n> %s\r\n", filename, rxBuffer);
+            printf("Printing modified file \"%s\"\r\n> ", filename);
+            printView(view, rxLen);
+            printf("\r\n");
+            pf_release_view();
         }
         else
         {
@@ -152,6 +193,82 @@ void modifyFile(const char* filename)
 }
 
 
+//Prints the decoded CID and SD status of the selected card
+void printCardInfo(void)
+{
+    MemCardInfo info;
+    
+    if (!memCard_getCardInfo(&info))
+    {
+        return;
+    }
+    
+    printf("Card: %s %u.%u (OEM %s, MID 0x%x), S/N %lu, made %u/%u\r\n", info.productName, info.productRevision >> 4,
+            info.productRevision & 0x0F, info.oemID, info.manufacturerID, info.serialNumber, info.manufactureMonth, info.manufactureYear);
+    printf("Speed class %u, allocation unit %lu sectors, erase unit %u sectors\r\n", info.speedClass, info.auBlocks, info.eraseBlocks);
+}
+
+#ifdef RING_LOG_ENABLE
+//Opens the ring log and writes a record with the mount count
+bool logMount(RingLog* log, const char* filename)
+{
+    static RingLogRecord record;
+    const char* message = "Mounted";
+    uint8_t index;
+    
+    if (!ringLog_open(log, filename))
+    {
+        printf("[ERROR] Could not open ring log %s\r\n", filename);
+        return false;
+    }
+    
+    for (index = 0; message[index] != '\0'; index++)
+    {
+        record.data[index] = message[index];
+    }
+    record.data[index] = '\0';
+    
+    if (!ringLog_write(log, &record))
+    {
+        printf("[ERROR] Failed to write ring log\r\n");
+        return false;
+    }
+    
+    printf("Ring log record %lu written\r\n", ringLog_getSequence(&record));
+    return true;
+}
+#endif
+
+#if (CARD_ARRAY_MODE == CARD_ARRAY_MIRROR)
+//Runs a resync in progress
+//With MIRROR_RESYNC_ENABLE, copies the mirror onto each ready card that is not a current copy, once per insertion
+void mirrorTasks(void)
+{
+    if (cardArray_resyncTasks())
+    {
+        return;
+    }
+    
+#ifdef MIRROR_RESYNC_ENABLE
+    static uint8_t triedMask = 0;
+    
+    for (uint8_t i = 0; i < CARD_ARRAY_CARDS; i++)
+    {
+        if (memCard_getSlotStatus(i) != STATUS_CARD_READY)
+        {
+            triedMask &= ~(1 << i);
+        }
+        else if (((cardArray_getMirrorMask() & (1 << i)) == 0) && ((triedMask & (1 << i)) == 0))
+        {
+            triedMask |= (1 << i);
+            cardArray_startResync(i);
+            return;
+        }
+    }
+#endif
+}
+#endif
+
 int main(void)
 {
     SYSTEM_Initialize();
@@ -170,6 +287,12 @@ int main(void)
     //Initialize Memory Card
     memCard_initDriver();
     
+    //Second card slot on SPI2 (if MEM_CARD_SLOTS > 1)
+    cardArray_init();
+    
+    //pf_read with a NULL buffer streams file data to the terminal
+    memCard_setForwardSink(&UART2_Write);
+    
     // Enable the Global High Interrupts 
     INTERRUPT_GlobalInterruptHighEnable(); 
 
@@ -190,19 +313,42 @@ int main(void)
     
     const char* testFile = "test.txt";
     
+#ifdef RING_LOG_ENABLE
+    //Pre-sized ring log. Its next records are erased while idle
+    const char* ringLogFile = "ring.log";
+    RingLog ringLog;
+    bool isLogOpen = false;
+#endif
+    
     while(1)
     {
-        if (memCard_getCardStatus() == STATUS_CARD_NOT_INIT)
+        //Clean up after a card removal
+        memCard_tasks();
+        
+        //Program queued writes that reached WRITE_QUEUE_DEADLINE. Each TMR2 period counts as TICK_PERIOD ms
+        if (PIR3bits.TMR2IF)
+        {
+            PIR3bits.TMR2IF = 0;
+            memCard_writeQueueTasks(TICK_PERIOD);
+        }
+        
+        if (cardArray_getStatus() == STATUS_CARD_NOT_INIT)
         {
             //Card is plugged in
             disk_initialize();
         }
-        else if (memCard_getCardStatus() == STATUS_CARD_READY)
+        else if (cardArray_getStatus() == STATUS_CARD_READY)
         {
             if (!hasPrinted)
             {
                 hasPrinted = true;
                 
+                printCardInfo();
+                
+#ifdef BENCHMARK_ENABLE
+                cardArray_benchmark(BENCHMARK_START_SECTOR, BENCHMARK_SECTORS);
+#endif
+                
                 mntResult = pf_mount(&fs);
                 
                 //Mount the drive
@@ -214,13 +360,37 @@ int main(void)
                 {
                     //Test pattern
                     modifyFile(testFile);
+                    
+#ifdef RING_LOG_ENABLE
+                    //The eraser only runs once this demo has written to the log
+                    isLogOpen = logMount(&ringLog, ringLogFile);
+#endif
                 }
             }
             
+            //Read ahead while idle
+            memCard_prefetchTasks();
+            
+#ifdef RING_LOG_ENABLE
+            //Erase the next records of the ring log while idle
+            if ((isLogOpen) && (!ringLog_eraseTasks(&ringLog)))
+            {
+                printf("[ERROR] Ring log erase failed\r\n");
+                isLogOpen = false;
+            }
+#endif
+            
+#if (CARD_ARRAY_MODE == CARD_ARRAY_MIRROR)
+            //Copy the mirror onto stale cards
+            mirrorTasks();
+#endif
         }
-        else if (memCard_getCardStatus() == STATUS_CARD_NONE)
+        else if (cardArray_getStatus() == STATUS_CARD_NONE)
         {
             hasPrinted = false;
+#ifdef RING_LOG_ENABLE
+            isLogOpen = false;
+#endif
         }
     }    
 }
\ No newline at end of file
@@ -8,14 +8,182 @@
 
 #define DEBUG_STRING "[DEBUG] Sending CMD%d\r\n"
 
-static volatile MemoryCardDriverStatus cardStatus = STATUS_CARD_NONE;
-static CardCapacityType memCapacity = CCS_INVALID;
+#if (MEM_CARD_WRITE_QUEUE_DEPTH > 0) && !defined(MEM_CARD_CACHELESS) && !defined(MEM_CARD_DISABLE_CACHE)
+#define MEM_CARD_WRITE_QUEUE_ENABLE
+#endif
+
+#ifdef MEM_CARD_WRITE_QUEUE_ENABLE
+//A finished sector waiting to be programmed
+typedef struct {
+    uint8_t* buffer;
+    uint32_t blockAddr;
+    bool isVerified;    //CRC policy of the write (see memCard_setCRCPolicy)
+} QueuedWrite;
+#endif
+
+#ifdef MEM_CARD_PREFETCH_ENABLE
+typedef enum {
+    PREFETCH_EMPTY = 0, PREFETCH_QUEUED, PREFETCH_TOKEN_WAIT, PREFETCH_RECEIVING, PREFETCH_READY
+} PrefetchState;
+
+typedef struct {
+    volatile uint8_t* buffer;
+    uint32_t blockAddr;
+    uint16_t index;         //Token polls while waiting
+    PrefetchState state;
+    bool isVerified;        //CRC policy of the read that queued it
+    uint8_t crc[2];
+    SPI1_Transaction transfer[2];   //Data, then CRC (queued back to back)
+} PrefetchSlot;
+#endif
+
+//State of one card slot
+typedef struct {
+    const MemCardSPIOps* spi;
+    void (*setCS)(bool select);
+    bool (*isAttached)(void);
+    
+    volatile MemoryCardDriverStatus cardStatus;
+    CardCapacityType memCapacity;
+    
+#ifdef MEM_CARD_PREFETCH_ENABLE
+    //Sector buffers. cache points to the active one, the others belong to the prefetch slots
+    //A prefetch hit swaps the pointers instead of copying the sector
+    volatile uint8_t sectorPool[MEM_CARD_PREFETCH_SLOTS + 1][FAT_BLOCK_SIZE];
+    volatile uint8_t* cache;
+#elif !defined(MEM_CARD_CACHELESS)
+    volatile uint8_t cache[512];
+#endif
+    uint32_t cacheBlockAddr;
+    
+    uint16_t writeSize;
+    bool cachePinned;
+    
+    //Set by memCard_detachSlot (interrupt), cleared by memCard_tasks
+    volatile bool removalPending;
+    
+    //Set if the removal aborted the SPI of this card
+    volatile bool isSPIAborted;
+    
+#ifdef MEM_CARD_PREFETCH_ENABLE
+    //Read-ahead
+    PrefetchSlot prefetchSlots[MEM_CARD_PREFETCH_SLOTS];
+    uint8_t prefetchDepth;
+    uint32_t lastBlockAddr;
+#endif
+    
+#ifdef MEM_CARD_WRITE_QUEUE_ENABLE
+    //Finished sectors, programmed in LBA order by memCard_flushWrites
+    uint8_t writePool[MEM_CARD_WRITE_QUEUE_DEPTH][FAT_BLOCK_SIZE];
+    QueuedWrite writeQueue[MEM_CARD_WRITE_QUEUE_DEPTH];
+    uint8_t writeQueueCount;
+    
+    //Time (ms) the oldest queued sector has waited (see memCard_writeQueueTasks)
+    uint16_t writeQueueAge;
+#endif
+    
+    bool speedSwitchOK;
+    
+    //Data transfer rate, set by memCard_calibrateSpeed and lowered when CRC errors pile up
+    uint8_t fastBaud;
+    uint8_t crcReads, crcErrors;
+    
+    //CRC policy of new transfers, whether the card checks CRCs (CMD59), and the policy of the sector being written
+    MemCardCRCPolicy crcPolicy;
+    bool isCardCRCOn;
+    bool isWriteVerified;
+    
+    //Read retry policy
+    MemCardReadStats readStats;
+    
+    //Average start token polls of a read (x8), see memCard_getSlotLatency
+    uint16_t readLatency;
+    
+    //Set after a write while the card is programming (see memCard_waitReady)
+    bool busyPending;
+    
+    //Read started by memCard_startRead, received by memCard_finishRead (0 blocks = none)
+    uint32_t pendingSect;
+    uint16_t pendingBlocks;
+    CommandError pendingErr;
+    
+    //Busy time-out (ms) from the CSD, and what is left of it while another slot is selected
+    uint16_t writeTimeout;
+    uint16_t busyPeriod;
+    
+    //Sectors in the smallest unit the card can erase (0 = erase not available)
+    uint16_t eraseBlocks;
+    
+    //From the SD status (0 = not known), see memCard_getCardInfo
+    uint32_t auBlocks;
+    uint16_t eraseSize;
+    uint8_t eraseTimeout, eraseOffset;
+    uint8_t speedClass;
+    
+    //Time the card took to become ready (ms)
+    uint16_t initTime;
+    
+    //CID of the card. The bytes are kept after removal to recognize the card when it returns
+    uint8_t cardID[16];
+    bool cardIDValid;
+} MemCard;
+
+static MemCard cards[MEM_CARD_SLOTS];
+
+//Selected card. All other functions work on this card
+static MemCard* card = &cards[0];
+
+//Forwarding (streaming) reads
+static MemCardByteSink forwardSink = NULL;
+static uint8_t* forwardDst;
+static uint16_t forwardIndex, forwardStart, forwardEnd;
+static bool isForwardVerified;
+
+#ifdef MEM_CARD_PREFETCH_ENABLE
+static void memCard_completePrefetch(void);
+static bool memCard_takePrefetch(uint32_t blockAddr);
+static void memCard_schedulePrefetch(uint32_t blockAddr);
+static void memCard_dropPrefetch(uint32_t blockAddr);
+static void memCard_resetPrefetch(void);
+#endif
+
+static CommandError memCard_sendReadCommand(uint8_t commandIndex, uint32_t blockAddr);
+static CommandError memCard_readBlocksDirect(uint32_t sect, uint8_t* data, uint16_t nBlocks);
+static bool memCard_canRetryRead(CommandError err, uint8_t* retries, bool* isReinit);
+static CommandError memCard_retryRead(uint32_t sect, uint8_t* data, uint16_t nBlocks);
+static CommandError memCard_recoverRead(CommandError err, uint32_t sect, uint8_t* data, uint16_t nBlocks);
+#ifdef MEM_CARD_CACHELESS
+static CommandError memCard_retryStream(uint32_t sect, uint16_t offset, uint8_t* data, uint16_t nBytes);
+#endif
+static CommandError memCard_transferBlocks(uint32_t sect, uint8_t* data, uint16_t nBlocks);
+static CommandError memCard_requestBlocks(uint32_t sect, uint16_t nBlocks);
+static CommandError memCard_receiveBlocks(uint8_t* data, uint16_t nBlocks);
+static CommandError memCard_receiveDataPacket(uint8_t* data, uint16_t length);
+#ifdef CRC_VALIDATE_READ
+static void memCard_trackLinkQuality(bool isGood);
+#endif
+static CommandError memCard_waitForDataToken(void);
+static CommandError memCard_sendWriteCommand(uint8_t commandIndex, uint32_t blockAddr, bool isVerified);
+static CommandError memCard_programSector(uint32_t blockAddr, uint8_t* data, bool isVerified);
+#ifdef MEM_CARD_WRITE_QUEUE_ENABLE
+static QueuedWrite* memCard_findQueuedWrite(uint32_t blockAddr);
+static bool memCard_isQueuedRange(uint32_t blockAddr, uint16_t nBlocks);
+static void memCard_copySector(volatile uint8_t* dst, volatile uint8_t* src);
+#endif
+static CommandError memCard_streamSector(uint32_t sect, uint16_t offset, uint16_t nBytes);
+static bool memCard_loadSDStatus(void);
 
-static volatile uint8_t cache[512];
-static uint32_t cacheBlockAddr;
+//Set while a failed read re-initializes the card
+static bool isReinitializing = false;
 
-static uint16_t writeSize;
-static bool speedSwitchOK = false;
+//Commands are not printed while init polls the card
+static bool logCommands = true;
+
+//Error for a transfer that got no answer. If the card was pulled, this is CARD_REMOVED
+static CommandError memCard_timeoutError(void)
+{
+    return (card->removalPending) ? CARD_REMOVED : CARD_SPI_TIMEOUT;
+}
 
 void memCard_printData(uint8_t* data, uint8_t size)
 {
@@ -27,21 +195,299 @@ void memCard_printData(uint8_t* data, uint8_t size)
     printf("\r\n");
 }
 
+//Ends a failed write. The cache no longer matches the card
+static void memCard_abortWrite(void)
+{
+#ifdef MEM_CARD_CACHELESS
+    //Drop the data transfer that was streaming to the card
+    card->setCS(false);
+    card->spi->setSpeed(SPI_CMD_BAUD);
+#endif
+    card->writeSize = WRITE_SIZE_INVALID;
+    card->cacheBlockAddr = 0xFFFFFFFF;
+}
+
+#ifdef MEM_CARD_CACHELESS
+//Resets the CRC module for a data block sent to the card
+static void memCard_startCRC16(void)
+{
+    CRCCON0bits.EN = 0;
+    CRCCON0bits.SETUP = 0b00;
+    
+    CRCOUT = 0x00;
+    
+    CRCCON0bits.EN = 1;
+    
+    CRC_StartCrc();
+}
+
+//Adds a data byte to the CRC
+static void memCard_addCRC16(uint8_t data)
+{
+    while (CRC_IsCrcBusy());
+    CRC_WriteData(data);
+}
+#endif
+
+//SPI functions of SPI1
+const MemCardSPIOps memCard_spi1Ops = {
+    .setSpeed = &SPI1_setSpeed,
+    .abort = &SPI1_abort,
+    .clearAbort = &SPI1_clearAbort,
+    .exchangeByte = &SPI1_exchangeByte,
+    .sendByte = &SPI1_sendByte,
+    .exchangeBytes = &SPI1_exchangeBytes,
+    .sendBytes = &SPI1_sendBytes,
+    .fillZeros = &SPI1_fillZeros,
+    .receiveBytesTransmitFF = &SPI1_receiveBytesTransmitFF,
+    .receiveBytesToHandler = &SPI1_receiveBytesToHandler,
+    .sendResetSequence = &SPI1_sendResetSequence,
+#ifdef MEM_CARD_PREFETCH_ENABLE
+    .queueTransaction = &SPI1_queueTransaction,
+    .isQueueIdle = &SPI1_isQueueIdle,
+    .setCSHandler = &SPI1_setCSHandler
+#else
+    .queueTransaction = NULL,
+    .isQueueIdle = NULL,
+    .setCSHandler = NULL
+#endif
+};
+
+//Drives CS of slot 0
+static void memCard_selectCard0(bool select)
+{
+    if (select)
+    {
+        CARD_CS_SetLow();
+    }
+    else
+    {
+        CARD_CS_SetHigh();
+    }
+}
+
+//Card detect of slot 0
+static bool memCard_isCard0Attached(void)
+{
+    return IS_CARD_ATTACHED();
+}
+
 //Init the Memory Card Driver
 void memCard_initDriver(void)
 {
+    card = &cards[0];
+    memCard_initSlot(0, &memCard_spi1Ops, &memCard_selectCard0, &memCard_isCard0Attached);
+}
+
+//Sets up a card slot. Slot 0 is set up by memCard_initDriver
+bool memCard_initSlot(uint8_t slot, const MemCardSPIOps* spi, void (*setCS)(bool select), bool (*isAttached)(void))
+{
+    if ((slot >= MEM_CARD_SLOTS) || (spi == NULL) || (setCS == NULL))
+    {
+        return false;
+    }
+    
+    MemCard* selected = card;
+    card = &cards[slot];
+    
+    card->spi = spi;
+    card->setCS = setCS;
+    card->isAttached = isAttached;
+    
+    card->setCS(false);
+    
     //Clear the Block Address
-    cacheBlockAddr = 0xFFFFFFFF;
-    writeSize = WRITE_SIZE_INVALID;
+    card->cacheBlockAddr = 0xFFFFFFFF;
+    card->writeSize = WRITE_SIZE_INVALID;
+    card->cachePinned = false;
+    card->removalPending = false;
+    card->isSPIAborted = false;
+    card->busyPending = false;
+    card->pendingBlocks = 0;
+    
+    card->memCapacity = CCS_INVALID;
+    card->speedSwitchOK = false;
+    card->fastBaud = SPI_FAST_BAUD;
+    card->crcReads = 0;
+    card->crcErrors = 0;
+    card->crcPolicy = CRC_DEFAULT_POLICY;
+    card->isCardCRCOn = false;
+    card->isWriteVerified = false;
+    card->readLatency = 0;
+    card->writeTimeout = DEFAULT_WRITE_TIMEOUT;
+    card->eraseBlocks = 0;
+    card->auBlocks = 0;
+    card->eraseSize = 0;
+    card->eraseTimeout = 0;
+    card->eraseOffset = 0;
+    card->speedClass = 0;
+    card->cardIDValid = false;
+    
+#ifdef MEM_CARD_PREFETCH_ENABLE
+    //Give each slot its own buffer
+    card->cache = &card->sectorPool[0][0];
+    for (uint8_t i = 0; i < MEM_CARD_PREFETCH_SLOTS; i++)
+    {
+        card->prefetchSlots[i].buffer = &card->sectorPool[i + 1][0];
+    }
+    card->prefetchDepth = 0;
+    memCard_resetPrefetch();
+#endif
+    
+#ifdef MEM_CARD_WRITE_QUEUE_ENABLE
+    for (uint8_t i = 0; i < MEM_CARD_WRITE_QUEUE_DEPTH; i++)
+    {
+        card->writeQueue[i].buffer = &card->writePool[i][0];
+    }
+    card->writeQueueCount = 0;
+    card->writeQueueAge = 0;
+#endif
     
-    if (IS_CARD_ATTACHED())
+    if ((isAttached == NULL) || (isAttached()))
     {
-        cardStatus = STATUS_CARD_NOT_INIT;
+        card->cardStatus = STATUS_CARD_NOT_INIT;
     }
     else
     {
-        cardStatus = STATUS_CARD_NONE;
+        card->cardStatus = STATUS_CARD_NONE;
+    }
+    
+    card = selected;
+    return true;
+}
+
+//Selects the card used by all other memCard_ functions
+bool memCard_selectSlot(uint8_t slot)
+{
+    if ((slot >= MEM_CARD_SLOTS) || (cards[slot].spi == NULL))
+    {
+        return false;
+    }
+    
+    MemCard* next = &cards[slot];
+    if (next == card)
+    {
+        return true;
+    }
+    
+#ifdef MEM_CARD_CACHELESS
+    //The open write is streaming to the card
+    if (card->writeSize != WRITE_SIZE_INVALID)
+    {
+        return false;
+    }
+#endif
+    
+#ifdef MEM_CARD_PREFETCH_ENABLE
+    //The cards may share the SPI. Finish the read-ahead in flight
+    memCard_completePrefetch();
+#endif
+    
+    //The time-out timer is shared. Keep what is left of the busy time-out
+    if (card->busyPending)
+    {
+        uint16_t elapsed = (uint16_t) TU16A_Read();
+        card->busyPeriod = ((TU16A_IsTimerRunning()) && (elapsed < card->busyPeriod)) ? (card->busyPeriod - elapsed) : 1;
+        TU16A_Stop();
+    }
+    
+    card = next;
+    
+    if (card->busyPending)
+    {
+        TU16A_PeriodValueSet(card->busyPeriod);
+        TU16A_Start();
+        while (!TU16A_IsTimerRunning());
+    }
+    
+    return true;
+}
+
+//Returns the selected slot
+uint8_t memCard_getSlot(void)
+{
+    return (uint8_t) (card - &cards[0]);
+}
+
+//Reads the CID. Returns true if the card is the one that was used before
+static bool memCard_isSameCard(void)
+{
+    uint8_t cid[16];
+    bool isSame = card->cardIDValid;
+    
+    if (memCard_readCID(&cid[0]) != CARD_NO_ERROR)
+    {
+        card->cardIDValid = false;
+        return false;
+    }
+    
+    for (uint8_t i = 0; i < 16; i++)
+    {
+        if (cid[i] != card->cardID[i])
+        {
+            isSame = false;
+        }
+        card->cardID[i] = cid[i];
+    }
+    
+    card->cardIDValid = true;
+    return isSame;
+}
+
+//Polls ACMD41 (or CMD1) until the card leaves idle, or the init time budget runs out
+//The delay between polls starts at 0 and doubles up to INIT_POLL_DELAY_MAX
+static bool memCard_pollReady(bool useCMD1)
+{
+    CommandStatus status;
+    uint16_t pollDelay = 0;
+    uint16_t polls = 0;
+    bool isReady = false;
+    
+    //Only the summary is printed
+    logCommands = false;
+    
+    while ((!isReady) && (TU16A_IsTimerRunning()) && (!card->removalPending))
+    {
+        if (pollDelay != 0)
+        {
+            DELAY_milliseconds(pollDelay);
+        }
+        
+        if (useCMD1)
+        {
+            status.data = memCard_sendCMD_R1(1, CARD_NO_DATA);
+        }
+        else
+        {
+            status.data = memCard_sendACMD_R1(41, INIT_ACMD41_ARG);
+        }
+        
+        polls++;
+        isReady = (!status.is_idle);
+        
+        //Back off
+        if (pollDelay == 0)
+        {
+            pollDelay = 1;
+        }
+        else if (pollDelay < INIT_POLL_DELAY_MAX)
+        {
+            pollDelay <<= 1;
+        }
+    }
+    
+    logCommands = true;
+    
+#ifdef MEM_CARD_DEBUG_ENABLE
+    printf("[DEBUG] %s polled %u times\r\n", (useCMD1) ? "CMD1" : "ACMD41", polls);
+#endif
+    
+    if (!isReady)
+    {
+        printf("[ERROR] %s failed to init card\r\n", (useCMD1) ? "CMD1" : "ACMD41");
     }
+    
+    return isReady;
 }
 
 //Configure the Memory Card
@@ -49,30 +495,40 @@ void memCard_initDriver(void)
 bool memCard_initCard(void)
 {
     //If already initialized, skip this step
-    if (cardStatus == STATUS_CARD_READY)
+    if (card->cardStatus == STATUS_CARD_READY)
     {
         return true;
     }
     
+    //Finish cleaning up after a removal
+    memCard_tasks();
+    
+    //Let a write in progress finish before the init time budget starts
+    memCard_waitReady();
+    
     printf("Beginning memory card configuration...\r\n");
         
     //Invalidate the Cache
-    cacheBlockAddr = 0xFFFFFFFF;
+    card->cacheBlockAddr = 0xFFFFFFFF;
 
     //Invalidate write counter
-    writeSize = WRITE_SIZE_INVALID;
+    card->writeSize = WRITE_SIZE_INVALID;
+    
+    //CMD0 turns CRC checking off. It is turned on again by the first verified write
+    card->isCardCRCOn = false;
     
     //Move to 400 kHz baud to start
-    SPI1_setSpeed(SPI_CMD_BAUD);
+    card->spi->setSpeed(SPI_CMD_BAUD);
         
-    bool good = true;
+    //One time budget covers every attempt. The timer also measures the ready time
+    TU16A_PeriodValueSet(INIT_TIMEOUT);
+    TU16A_Start();
+    while (!TU16A_IsTimerRunning());
     
-    for (uint8_t fullRetryCount = 0; fullRetryCount < FULL_RETRIES; fullRetryCount++)
+    for (uint8_t fullRetryCount = 0; (fullRetryCount < FULL_RETRIES) && (TU16A_IsTimerRunning()) && (!card->removalPending); fullRetryCount++)
     {
-        printf("Attempt %d of %d\r\n", (fullRetryCount + 1), FULL_RETRIES);
-        
         //Reset the Card
-        SPI1_sendResetSequence();
+        card->spi->sendResetSequence();
 
         //CMD0 - Reset
         CommandStatus status;
@@ -83,6 +539,7 @@ bool memCard_initCard(void)
         CommandError err = memCard_configureCard();
         if (err != CARD_NO_ERROR)
         {
+#ifdef MEM_CARD_DEBUG_ENABLE
             printf("[ERROR] CMD8 failed to configure card ( ");
             switch (err)
             {
@@ -121,67 +578,27 @@ bool memCard_initCard(void)
                     printf("CARD_PATTERN_ERROR");
                     break;
                 }
+                case CARD_REMOVED:
+                {
+                    printf("CARD_REMOVED");
+                    break;
+                }
                 default:
                     printf("???");
             }
             printf(" )\r\n");
+#endif
             continue;
         }    
         
-        uint8_t count = 1;
-        uint32_t initParam = 0x40000000;
-
-        //Reset flag to true
-        good = true;
-        
         //Try to run ACMD41
-        status.data = memCard_sendACMD_R1(41, initParam);
+        status.data = memCard_sendACMD_R1(41, INIT_ACMD41_ARG);
 
         //Check to see if ACMD41 is accepted
-        if (status.illegal_cmd_error)
-        {
-            //Illegal Command, switch to CMD1
-            while ((status.is_idle) && (good))
-            {
-                //CMD1
-                status.data = memCard_sendCMD_R1(1, CARD_NO_DATA);
-
-                if (count >= INIT_RETRIES)
-                {
-                    printf("[ERROR] CMD1 failed to init card\r\n");
-                    good = false;
-                }
-                else
-                {
-                    DELAY_milliseconds(1);
-                    count++;
-                }
-            }
-        }
-        else
-        {
-            //Valid Command
-            while ((status.is_idle) && (good))
-            {
-                //ACMD41
-                //0x77 - First Packet
-                //0x69 - Second Packet
-                status.data = memCard_sendACMD_R1(41, initParam);
-
-                if (count >= INIT_RETRIES)
-                {
-                    printf("[ERROR] ACMD41 failed to init card\r\n");
-                    good = false;
-                }
-                else
-                {
-                    DELAY_milliseconds(1);
-                    count++;
-                }
-            }
-        }
+        //If not, this is an MMC card, switch to CMD1
+        bool good = (!status.is_idle) || (memCard_pollReady(status.illegal_cmd_error));
         
-        if (!good)
+        if ((!good) || (card->removalPending))
         {
             //Something went wrong!
             continue;
@@ -189,10 +606,10 @@ bool memCard_initCard(void)
         
         //Check for High Capacity Support
         //CMD58
-        memCapacity = memCard_getCapacityType();
+        card->memCapacity = memCard_getCapacityType();
         
 #ifdef MEM_CARD_DEBUG_ENABLE
-        switch (memCapacity)
+        switch (card->memCapacity)
         {
             case CCS_LOW_CAPACITY:
                 printf("[DEBUG] Memory Card is small - use byte-mode addressing\r\n");
@@ -214,8 +631,18 @@ bool memCard_initCard(void)
         }
 #endif        
         //Card is now usable for memory operations
-        cardStatus = STATUS_CARD_READY;
-        printf("Memory Card - READY\r\n");
+        card->initTime = (uint16_t) TU16A_Read();
+        TU16A_Stop();
+        
+        card->cardStatus = STATUS_CARD_READY;
+        printf("Memory Card - READY in %u ms\r\n", card->initTime);
+        
+        //Identify the card. If it was the last card used, the rest of the setup is known
+        if (memCard_isSameCard())
+        {
+            printf("Memory Card - Same card as before\r\n");
+            return true;
+        }
         
         //Set SPI Frequency
         if (!memCard_setupTimings())
@@ -223,92 +650,320 @@ bool memCard_initCard(void)
             printf("[WARN] Unable to detect max SPI clock speeds\r\n");
         }
         
+        //Allocation unit and erase timing
+        if (!memCard_loadSDStatus())
+        {
+            printf("[WARN] Unable to read the SD status\r\n");
+        }
+        
+        //Find the fastest rate this card and wiring can run at
+        memCard_calibrateSpeed(SPI_CALIBRATE_SECTOR);
+        
         //Load Block 0 into the cache
         memCard_readBlock(0x00);
         
         return true;
     }
     
+    TU16A_Stop();
+    
     printf("[!] Unable to initialize memory card\r\n");
-    cardStatus = STATUS_CARD_ERROR;
+    card->cardStatus = (card->removalPending) ? STATUS_CARD_NONE : STATUS_CARD_ERROR;
     return false;
 }
 
+//Returns the time the last card took to become ready (ms)
+uint16_t memCard_getInitTime(void)
+{
+    return card->initTime;
+}
+
 //Returns the status of the memory card
 MemoryCardDriverStatus memCard_getCardStatus(void)
 {
-    return cardStatus;
+    return card->cardStatus;
+}
+
+//Returns the status of the card in any slot, without selecting it
+MemoryCardDriverStatus memCard_getSlotStatus(uint8_t slot)
+{
+    if ((slot >= MEM_CARD_SLOTS) || (cards[slot].spi == NULL))
+    {
+        return STATUS_CARD_NONE;
+    }
+    
+    return cards[slot].cardStatus;
+}
+
+//Returns true if the card in a slot may still be programming a write. Does not poll the card
+bool memCard_isSlotBusy(uint8_t slot)
+{
+    return ((slot < MEM_CARD_SLOTS) && (cards[slot].busyPending));
+}
+
+//Returns the average access time of reads from the card in a slot, in start token polls (x8)
+uint16_t memCard_getSlotLatency(uint8_t slot)
+{
+    return (slot < MEM_CARD_SLOTS) ? cards[slot].readLatency : 0xFFFF;
 }
 
 //Returns true if the card is ready
 bool memCard_isCardReady(void)
 {
-    return (cardStatus == STATUS_CARD_READY);
+    return (card->cardStatus == STATUS_CARD_READY);
 }
 
-//Requests max clock speed info from card, and sets SPI frequency
-bool memCard_setupTimings(void)
+//Derives the busy time-out from the CSD
+static uint16_t memCard_getWriteTimeout(uint8_t* csd)
 {
-    uint8_t resp[16];
+    //TAAC time values (x10)
+    static const uint8_t taacValues[16] = {0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80};
     
-    //Read the CSD register
-    if (memCard_readCSD(&resp[0]) != CARD_NO_ERROR)
+    if ((csd[0] >> 6) != 0)
     {
-        return false;
+        //CSD 2.0 (SDHC / SDXC) has a fixed time-out
+        return DEFAULT_WRITE_TIMEOUT;
     }
     
-    return true;
-}
-
-//Calculates the checksum for a block of data
-uint16_t memCard_calculateCRC16(uint8_t* data, uint16_t dLen)
-{
-    uint16_t result = 0x00;
+    //CSD 1.0: 100 x TAAC x R2W_FACTOR
+    //TAAC = (value / 10) x 10^unit ns, so the time-out in ms is value x R2W_FACTOR x 10^(unit - 5)
+    uint8_t unit = csd[1] & 0x07;
+    uint8_t r2wFactor = (csd[12] >> 2) & 0x07;
+    uint32_t timeout = (uint32_t) taacValues[(csd[1] >> 3) & 0x0F] << r2wFactor;
     
-    //Setup CRC
-    CRCCON0bits.EN = 0;
-    CRCCON0bits.SETUP = 0b00;
+    for (uint8_t i = 5; i < unit; i++)
+    {
+        timeout *= 10;
+    }
     
-    CRCOUT = 0x00;
+    for (uint8_t i = unit; i < 5; i++)
+    {
+        timeout /= 10;
+    }
     
-    CRCCON0bits.EN = 1;
+    if (timeout > DEFAULT_WRITE_TIMEOUT)
+    {
+        return DEFAULT_WRITE_TIMEOUT;
+    }
     
-    CRC_StartCrc();
-
-    //Calculate
-    for (uint16_t i = 0; i < dLen; i++)
+    if (timeout < WRITE_TIMEOUT_MIN)
     {
-        CRC_WriteData(data[i]);
+        return WRITE_TIMEOUT_MIN;
     }
-
-    result = CRC_GetCalculatedResult(false, 0x00) & 0xFFFF;
-    return result;
+    
+    return (uint16_t) timeout;
+}
+
+//Returns the number of sectors in the smallest unit the card can erase, from the CSD
+static uint16_t memCard_getEraseBlocks(uint8_t* csd)
+{
+    //ERASE_BLK_EN - single blocks can be erased (always set in CSD 2.0)
+    if (csd[10] & 0x40)
+    {
+        return 1;
+    }
+    
+    //CSD 1.0: SECTOR_SIZE + 1 write blocks of 2^WRITE_BL_LEN bytes
+    uint8_t sectorSize = ((csd[10] & 0x3F) << 1) | (csd[11] >> 7);
+    uint8_t writeBlockLength = ((csd[12] & 0x03) << 2) | (csd[13] >> 6);
+    
+    if (writeBlockLength < FAT_BLOCK_SHIFT)
+    {
+        return 0;
+    }
+    
+    return (uint16_t) (sectorSize + 1) << (writeBlockLength - FAT_BLOCK_SHIFT);
+}
+
+//Requests max clock speed info from card, and sets SPI frequency
+bool memCard_setupTimings(void)
+{
+    uint8_t resp[16];
+    
+    //Erase stays off until the CSD is known
+    card->eraseBlocks = 0;
+    
+    //Read the CSD register
+    if (memCard_readCSD(&resp[0]) != CARD_NO_ERROR)
+    {
+        return false;
+    }
+    
+    card->writeTimeout = memCard_getWriteTimeout(&resp[0]);
+    card->eraseBlocks = memCard_getEraseBlocks(&resp[0]);
+    
+#ifdef MEM_CARD_DEBUG_ENABLE
+    printf("[DEBUG] Write time-out is %u ms\r\n", card->writeTimeout);
+    printf("[DEBUG] Erase unit is %u sectors\r\n", card->eraseBlocks);
+#endif
+    
+    return true;
+}
+
+//Calculates the checksum for a block of data
+uint16_t memCard_calculateCRC16(uint8_t* data, uint16_t dLen)
+{
+    uint16_t result = 0x00;
+    
+    //Setup CRC
+    CRCCON0bits.EN = 0;
+    CRCCON0bits.SETUP = 0b00;
+    
+    CRCOUT = 0x00;
+    
+    CRCCON0bits.EN = 1;
+    
+    CRC_StartCrc();
+
+    //Calculate
+    for (uint16_t i = 0; i < dLen; i++)
+    {
+        CRC_WriteData(data[i]);
+    }
+
+    result = CRC_GetCalculatedResult(false, 0x00) & 0xFFFF;
+    return result;
 }
 
 //Notifies the driver that a card is now attached
 //DOES NOT INITIALIZE THE CARD
 void memCard_attach(void)
 {
-    cardStatus = STATUS_CARD_NOT_INIT;
+    memCard_attachSlot(0);
 }
 
 //Notifies the driver that the card is not attached
+//Called from the card detect interrupt. Only stops the transfer in progress, memCard_tasks resets the driver
 void memCard_detach(void)
 {
-    cardStatus = STATUS_CARD_NONE;
+    memCard_detachSlot(0);
+}
+
+//Same as memCard_attach, for any slot
+void memCard_attachSlot(uint8_t slot)
+{
+    if (slot < MEM_CARD_SLOTS)
+    {
+        cards[slot].cardStatus = STATUS_CARD_NOT_INIT;
+    }
+}
+
+//Same as memCard_detach, for any slot. Safe to call from an interrupt
+void memCard_detachSlot(uint8_t slot)
+{
+    if (slot >= MEM_CARD_SLOTS)
+    {
+        return;
+    }
+    
+    MemCard* removed = &cards[slot];
+    removed->cardStatus = STATUS_CARD_NONE;
+    removed->removalPending = true;
+    
+    //Loops waiting on the card return CARD_REMOVED right away
+    //A card that is not selected has no transfer in progress, and another card may be using the SPI
+    if ((removed == card) && (removed->spi != NULL))
+    {
+        removed->isSPIAborted = true;
+        removed->spi->abort();
+    }
+}
+
+//Returns true if another slot uses the SPI of the selected slot
+static bool memCard_isSharedSPI(void)
+{
+    for (uint8_t i = 0; i < MEM_CARD_SLOTS; i++)
+    {
+        if ((&cards[i] != card) && (cards[i].spi == card->spi))
+        {
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+//Resets the selected slot if its card was removed
+static void memCard_slotTasks(bool isSelected)
+{
+    if (!card->removalPending)
+    {
+        //Notice the end of a write without waiting for the next command
+        //The busy time-out only runs for the selected card
+        if (isSelected)
+        {
+            memCard_isBusy();
+        }
+        return;
+    }
+    
+    card->removalPending = false;
+    
+    card->setCS(false);
+    
+    //The write in progress and a started read are lost
+    card->busyPending = false;
+    card->pendingBlocks = 0;
+    if (isSelected)
+    {
+        TU16A_Stop();
+    }
     
     //Invalidate the Cache
-    cacheBlockAddr = 0xFFFFFFFF;
+    card->cacheBlockAddr = 0xFFFFFFFF;
 
     //Invalidate write counter
-    writeSize = WRITE_SIZE_INVALID;
+    card->writeSize = WRITE_SIZE_INVALID;
+    
+    //Drop any borrowed sector
+    card->cachePinned = false;
+    
+#ifdef MEM_CARD_PREFETCH_ENABLE
+    //Drop any read-ahead (including one in flight)
+    memCard_resetPrefetch();
+#endif
+    
+#ifdef MEM_CARD_WRITE_QUEUE_ENABLE
+    //The queued writes are lost
+    card->writeQueueCount = 0;
+#endif
+    
+    //Only the abort set by this card is cleared
+    if (card->isSPIAborted)
+    {
+        card->isSPIAborted = false;
+        card->spi->clearAbort();
+    }
+    
+    //Restart the SPI at the base speed. A shared SPI keeps the speed of the selected card
+    if ((isSelected) || (!memCard_isSharedSPI()))
+    {
+        card->spi->setSpeed(SPI_CMD_BAUD);
+    }
+}
+
+//Resets the driver after a card was removed (all slots). Call from the main loop
+void memCard_tasks(void)
+{
+    MemCard* selected = card;
+    
+    for (uint8_t i = 0; i < MEM_CARD_SLOTS; i++)
+    {
+        if (cards[i].spi != NULL)
+        {
+            card = &cards[i];
+            memCard_slotTasks(card == selected);
+        }
+    }
+    
+    card = selected;
 }
 
 //Calls CMD8 to configure the operating voltages
 CommandError memCard_configureCard(void)
 {
     //Send an extra byte to help the controller between commands
-    SPI1_sendByte(0xFF);
+    card->spi->sendByte(0xFF);
     
     uint8_t memPoolTx[6];
     uint8_t memPoolRx[6];
@@ -330,31 +985,31 @@ CommandError memCard_configureCard(void)
     //Add the CRC7 Value
     memPoolTx[5] = memCard_runCRC7(&memPoolTx[0], 5);
     
-    CARD_CS_SetLow();
+    card->setCS(true);
     
     //Transmit header
-    SPI1_sendBytes(&memPoolTx[0], 6);
+    card->spi->sendBytes(&memPoolTx[0], 6);
     
     CommandStatus stat;
     
     if (!memCard_receiveResponse_R1(&stat.data))
     {
         //Response Timeout
-        CARD_CS_SetHigh();
-        return CARD_SPI_TIMEOUT;
+        card->setCS(false);
+        return memCard_timeoutError();
     }
     
     if (stat.illegal_cmd_error)
     {
         //Illegal Command
-        CARD_CS_SetHigh();
+        card->setCS(false);
         return CARD_ILLEGAL_CMD;
     }
     
     if (stat.crc_error)
     {
         //Bad CRC - Exit
-        CARD_CS_SetHigh();
+        card->setCS(false);
         return CARD_CRC_ERROR;
     }
     
@@ -366,8 +1021,8 @@ CommandError memCard_configureCard(void)
     memPoolTx[3] = 0xFF;
     
     //Get the last bytes of the header
-    SPI1_exchangeBytes(&memPoolTx[0], &memPoolRx[0], 4);
-    CARD_CS_SetHigh();
+    card->spi->exchangeBytes(&memPoolTx[0], &memPoolRx[0], 4);
+    card->setCS(false);
     
     //First verify the R1 header
     if (stat.data != HEADER_IDLE)
@@ -394,10 +1049,21 @@ CommandError memCard_configureCard(void)
 //Command must be in R1 Response Format
 uint8_t memCard_sendCMD_R1(uint8_t commandIndex, uint32_t data)
 {
+#ifdef MEM_CARD_PREFETCH_ENABLE
+    //The card must be free for the next command
+    memCard_completePrefetch();
+#endif
+    
+    //Finish the last write
+    if (memCard_waitReady() != CARD_NO_ERROR)
+    {
+        return HEADER_INVALID;
+    }
+    
     //Add clocks between CMDs to improve compatability
     for (uint8_t i = 0; i < MEMORY_CARD_IDLE_CLOCK_CYCLES; i++)
     {
-        SPI1_sendByte(0xFF);
+        card->spi->sendByte(0xFF);
     }
     
     uint8_t memPool[6];
@@ -407,7 +1073,10 @@ uint8_t memCard_sendCMD_R1(uint8_t commandIndex, uint32_t data)
     memPool[0] |= commandIndex;
     
 #ifdef MEM_CARD_DEBUG_ENABLE
-    printf(DEBUG_STRING, commandIndex);
+    if (logCommands)
+    {
+        printf(DEBUG_STRING, commandIndex);
+    }
 #endif
     
     //Load Data
@@ -419,16 +1088,16 @@ uint8_t memCard_sendCMD_R1(uint8_t commandIndex, uint32_t data)
     //Add the CRC7 Value
     memPool[5] = memCard_runCRC7(&memPool[0], 5);
     
-    CARD_CS_SetLow();
+    card->setCS(true);
     
     //First transmit the sequence
-    SPI1_sendBytes(&memPool[0], 6);
+    card->spi->sendBytes(&memPool[0], 6);
     
     uint8_t rVal = 0xFF;
     
     memCard_receiveResponse_R1(&rVal);
     
-    CARD_CS_SetHigh();
+    card->setCS(false);
     return rVal;
 }
 
@@ -473,7 +1142,7 @@ bool memCard_receiveResponse_R1(uint8_t* dst)
     
     while (!done)
     {
-        stat.data = SPI1_exchangeByte(0xFF);
+        stat.data = card->spi->exchangeByte(0xFF);
         count++;
         if (!stat.valid_header_n)
         {
@@ -494,13 +1163,25 @@ bool memCard_receiveResponse_R1(uint8_t* dst)
 //Reads the 4-byte OCR Register
 CommandError memCard_readOCR(uint8_t* data)
 {
-    if (cardStatus == STATUS_CARD_NONE)
+    if (card->cardStatus == STATUS_CARD_NONE)
         return CARD_NOT_INIT;
     
+#ifdef MEM_CARD_PREFETCH_ENABLE
+    //The card must be free for the next command
+    memCard_completePrefetch();
+#endif
+    
+    //Finish the last write
+    CommandError err = memCard_waitReady();
+    if (err != CARD_NO_ERROR)
+    {
+        return err;
+    }
+    
     //Add clocks between CMDs to improve compatability
     for (uint8_t i = 0; i < MEMORY_CARD_IDLE_CLOCK_CYCLES; i++)
     {
-        SPI1_sendByte(0xFF);
+        card->spi->sendByte(0xFF);
     }
     
     uint8_t memPoolTx[6];
@@ -522,25 +1203,25 @@ CommandError memCard_readOCR(uint8_t* data)
     //Compute the CRC7 Value
     memPoolTx[5] = memCard_runCRC7(&memPoolTx[0], 5);
     
-    CARD_CS_SetLow();
+    card->setCS(true);
     
     //Transmit header
-    SPI1_sendBytes(&memPoolTx[0], 6);
+    card->spi->sendBytes(&memPoolTx[0], 6);
     
     CommandStatus stat;
     
     if (!memCard_receiveResponse_R1(&stat.data))
     {
         //Response Timeout
-        CARD_CS_SetHigh();
-        return CARD_SPI_TIMEOUT;
+        card->setCS(false);
+        return memCard_timeoutError();
     }
     
     //Note - card can be idle or init, depending on the reason for reading values
     if ((stat.data & 0xF7) != HEADER_NO_ERROR)
     {
         //Something went wrong
-        CARD_CS_SetHigh();
+        card->setCS(false);
         return CARD_RESPONSE_ERROR;
     }
 
@@ -552,8 +1233,8 @@ CommandError memCard_readOCR(uint8_t* data)
     memPoolTx[3] = 0xFF;
     
     //Get the last bytes of the header
-    SPI1_exchangeBytes(&memPoolTx[0], &data[0], 4);
-    CARD_CS_SetHigh();
+    card->spi->exchangeBytes(&memPoolTx[0], &data[0], 4);
+    card->setCS(false);
 
 #ifdef MEM_CARD_DEBUG_ENABLE
     printf("[DEBUG] Printing OCR Register\r\n");
@@ -563,26 +1244,35 @@ CommandError memCard_readOCR(uint8_t* data)
     return CARD_NO_ERROR;
 }
 
-//Reads the 16-byte CSD Register
-CommandError memCard_readCSD(uint8_t* data)
+//Reads a register (CMD9 = CSD, CMD10 = CID, ACMD13 = SD Status)
+static CommandError memCard_readRegister(uint8_t commandIndex, uint8_t* data, uint8_t length)
 {
-    if (cardStatus != STATUS_CARD_READY)
+    if (card->cardStatus != STATUS_CARD_READY)
         return CARD_NOT_INIT;
     
+#ifdef MEM_CARD_PREFETCH_ENABLE
+    //The card must be free for the next command
+    memCard_completePrefetch();
+#endif
+    
+    //Finish the last write
+    CommandError err = memCard_waitReady();
+    if (err != CARD_NO_ERROR)
+    {
+        return err;
+    }
+    
     //Add clocks between CMDs to improve compatability
     for (uint8_t i = 0; i < MEMORY_CARD_IDLE_CLOCK_CYCLES; i++)
     {
-        SPI1_sendByte(0xFF);
+        card->spi->sendByte(0xFF);
     }
     
-    //Send CSD read command
-    //CMD9
-    
     uint8_t txData[6];
     uint8_t header;
     
     //Command Header
-    txData[0] = 0x40 | 9;
+    txData[0] = 0x40 | commandIndex;
     
     //No arguments
     txData[1] = 0x00;
@@ -593,26 +1283,41 @@ CommandError memCard_readCSD(uint8_t* data)
     //Calculate checksum
     txData[5] = memCard_runCRC7(&txData[0], 5);
     
-    CARD_CS_SetLow();
+    card->setCS(true);
     
     //Send Command
-    SPI1_sendBytes(&txData[0], 6);
+    card->spi->sendBytes(&txData[0], 6);
     
     if (!memCard_receiveResponse_R1(&header))
     {
-        CARD_CS_SetHigh();
-        return CARD_SPI_TIMEOUT;
+        card->setCS(false);
+        return memCard_timeoutError();
     }
     
     if (header != HEADER_NO_ERROR)
     {
         //Something went wrong
-        CARD_CS_SetHigh();
+        card->setCS(false);
         return CARD_RESPONSE_ERROR;
     }
     
-    CommandError cmdError = memCard_receiveBlockData(&data[0], 16);    
-    CARD_CS_SetHigh();
+    if (commandIndex == 13)
+    {
+        //ACMD13 has an R2 response. The second byte is the rest of the card status
+        card->spi->exchangeByte(0xFF);
+    }
+    
+    CommandError cmdError = memCard_receiveBlockData(&data[0], length);    
+    card->setCS(false);
+    
+    return cmdError;
+}
+
+//Reads the 16-byte CSD Register
+CommandError memCard_readCSD(uint8_t* data)
+{
+    //CMD9
+    CommandError cmdError = memCard_readRegister(9, data, 16);
     
 #ifdef MEM_CARD_DEBUG_ENABLE
     printf("[DEBUG] Printing CSD Register\r\n");
@@ -622,17 +1327,186 @@ CommandError memCard_readCSD(uint8_t* data)
     return cmdError;
 }
 
+//Reads the 16-byte CID Register
+CommandError memCard_readCID(uint8_t* data)
+{
+    //CMD10
+    CommandError cmdError = memCard_readRegister(10, data, 16);
+    
+#ifdef MEM_CARD_DEBUG_ENABLE
+    printf("[DEBUG] Printing CID Register\r\n");
+    memCard_printData(&data[0], 16);
+#endif
+    
+    return cmdError;
+}
+
+//Reads the 64-byte SD Status (ACMD13)
+CommandError memCard_readSDStatus(uint8_t* data)
+{
+    if (card->cardStatus != STATUS_CARD_READY)
+        return CARD_NOT_INIT;
+    
+#ifdef MEM_CARD_PREFETCH_ENABLE
+    //The card must be free for the next command
+    memCard_completePrefetch();
+#endif
+    
+    //CMD55 - the next command is an application command
+    uint8_t rVal = memCard_sendCMD_R1(55, CARD_NO_DATA);
+    if (rVal == HEADER_INVALID)
+    {
+        return memCard_timeoutError();
+    }
+    
+    if (rVal != HEADER_NO_ERROR)
+    {
+        return CARD_RESPONSE_ERROR;
+    }
+    
+    //ACMD13
+    CommandError cmdError = memCard_readRegister(13, data, 64);
+    
+#ifdef MEM_CARD_DEBUG_ENABLE
+    printf("[DEBUG] Printing SD Status\r\n");
+    memCard_printData(&data[0], 64);
+#endif
+    
+    return cmdError;
+}
+
+//Reads the allocation unit and erase timing from the SD status
+static bool memCard_loadSDStatus(void)
+{
+    //AU_SIZE in units of 16 kB (32 sectors)
+    static const uint16_t auSizes[16] = {0, 1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 768, 1024, 1536, 2048, 4096};
+    
+    //SPEED_CLASS codes 0 to 4
+    static const uint8_t speedClasses[5] = {0, 2, 4, 6, 10};
+    
+    uint8_t status[64];
+    
+    card->auBlocks = 0;
+    card->eraseSize = 0;
+    card->eraseTimeout = 0;
+    card->eraseOffset = 0;
+    card->speedClass = 0;
+    
+    if (memCard_readSDStatus(&status[0]) != CARD_NO_ERROR)
+    {
+        return false;
+    }
+    
+    card->speedClass = (status[8] <= 4) ? speedClasses[status[8]] : 0;
+    card->auBlocks = (uint32_t) auSizes[status[10] >> 4] << 5;
+    card->eraseSize = ((uint16_t) status[11] << 8) | status[12];
+    card->eraseTimeout = status[13] >> 2;
+    card->eraseOffset = status[13] & 0x03;
+    
+#ifdef MEM_CARD_DEBUG_ENABLE
+    printf("[DEBUG] Class %u, allocation unit is %lu sectors\r\n", card->speedClass, card->auBlocks);
+    printf("[DEBUG] Erasing %u AUs takes %u s (+%u s)\r\n", card->eraseSize, card->eraseTimeout, card->eraseOffset);
+#endif
+    
+    return true;
+}
+
+//Copies the details of the initialized card. Returns false if they are not known
+bool memCard_getCardInfo(MemCardInfo* info)
+{
+    if ((card->cardStatus != STATUS_CARD_READY) || (!card->cardIDValid))
+    {
+        return false;
+    }
+    
+    uint8_t* cid = &card->cardID[0];
+    
+    info->manufacturerID = cid[0];
+    info->oemID[0] = cid[1];
+    info->oemID[1] = cid[2];
+    info->oemID[2] = '\0';
+    
+    for (uint8_t i = 0; i < 5; i++)
+    {
+        info->productName[i] = cid[3 + i];
+    }
+    info->productName[5] = '\0';
+    
+    info->productRevision = cid[8];
+    info->serialNumber = ((uint32_t) cid[9] << 24) | ((uint32_t) cid[10] << 16) | ((uint16_t) cid[11] << 8) | cid[12];
+    
+    //MDT: year (from 2000) in bits 19:12, month in bits 11:8
+    info->manufactureYear = 2000 + (((cid[13] & 0x0F) << 4) | (cid[14] >> 4));
+    info->manufactureMonth = cid[14] & 0x0F;
+    
+    info->capacity = card->memCapacity;
+    info->eraseBlocks = card->eraseBlocks;
+    
+    info->speedClass = card->speedClass;
+    info->auBlocks = card->auBlocks;
+    info->eraseSize = card->eraseSize;
+    info->eraseTimeout = card->eraseTimeout;
+    info->eraseOffset = card->eraseOffset;
+    
+    return true;
+}
+
+//Returns the allocation unit of the card in a slot, in sectors (0 if not known)
+uint32_t memCard_getSlotAllocationUnit(uint8_t slot)
+{
+    return ((slot < MEM_CARD_SLOTS) && (cards[slot].cardStatus == STATUS_CARD_READY)) ? cards[slot].auBlocks : 0;
+}
+
+//Copies the CID of the initialized card. Returns false if it is not known
+bool memCard_getCardID(uint8_t* cid)
+{
+    if ((card->cardStatus != STATUS_CARD_READY) || (!card->cardIDValid))
+    {
+        return false;
+    }
+    
+    for (uint8_t i = 0; i < 16; i++)
+    {
+        cid[i] = card->cardID[i];
+    }
+    
+    return true;
+}
+
 //Loads data from the memory card into the specified buffer at a block address and byte offset
 bool memCard_readFromDisk(uint32_t sect, uint16_t offset, uint8_t* data, uint16_t nBytes)
 {
     //Card not initialized
-    if (cardStatus != STATUS_CARD_READY)
+    if (card->cardStatus != STATUS_CARD_READY)
         return false;
     
 #ifdef MEM_CARD_FILE_DEBUG_ENABLE
     printf("[DEBUG FILE I/O] Requesting Sector %lu at offset %u for %u bytes\r\n", sect, offset, nBytes);
 #endif
     
+    if ((offset == 0) && (nBytes != 0) && ((nBytes & (FAT_BLOCK_SIZE - 1)) == 0))
+    {
+#ifdef MEM_CARD_WRITE_QUEUE_ENABLE
+        //The data goes around the cache, so queued sectors in the range are programmed first
+        if ((memCard_isQueuedRange(sect, nBytes >> FAT_BLOCK_SHIFT)) && (memCard_flushWrites() != CARD_NO_ERROR))
+        {
+            return false;
+        }
+#endif
+        
+        //Whole sectors are received straight into the buffer, the cache is left alone
+        return (memCard_readBlocksDirect(sect, data, nBytes >> FAT_BLOCK_SHIFT) == CARD_NO_ERROR);
+    }
+    
+#ifdef MEM_CARD_CACHELESS
+    if ((offset + nBytes) > FAT_BLOCK_SIZE)
+    {
+        return false;
+    }
+    
+    //Stream the requested bytes straight into the buffer
+    return (memCard_retryStream(sect, offset, data, nBytes) == CARD_NO_ERROR);
+#else
 #ifdef MEM_CARD_DISABLE_CACHE
     if (true)
     {
@@ -642,7 +1516,7 @@ bool memCard_readFromDisk(uint32_t sect, uint16_t offset, uint8_t* data, uint16_
         }
     }
 #else
-    if (sect != cacheBlockAddr)
+    if (sect != card->cacheBlockAddr)
     {
         //Sector not loaded, need to read the value...
         if (memCard_readBlock(sect) != CARD_NO_ERROR)
@@ -672,9 +1546,9 @@ bool memCard_readFromDisk(uint32_t sect, uint16_t offset, uint8_t* data, uint16_
             cachePos = 0;
         }
 #ifdef MEM_CARD_MEMORY_DEBUG_ENABLE
-        printf("%x%x ", (cache[cachePos] & 0xF0) >> 4, cache[cachePos] & 0x0F);
+        printf("%x%x ", (card->cache[cachePos] & 0xF0) >> 4, card->cache[cachePos] & 0x0F);
 #endif
-        data[index] = cache[cachePos];
+        data[index] = card->cache[cachePos];
         cachePos++;
     }
     
@@ -683,31 +1557,309 @@ bool memCard_readFromDisk(uint32_t sect, uint16_t offset, uint8_t* data, uint16_
 #endif
     
     return true;
+#endif
 }
 
-//Prepare to write to a specified sector.
-//Configures write iterators
-bool memCard_prepareWrite(uint32_t sector)
+//Sets the function that receives forwarded bytes
+void memCard_setForwardSink(MemCardByteSink sink)
+{
+    forwardSink = sink;
+}
+
+//Passes the requested bytes of a streamed sector to the sink and runs the CRC
+static void memCard_forwardByte(uint8_t data)
 {
-    if (cardStatus != STATUS_CARD_READY)
+#ifdef CRC_VALIDATE_READ
+    if (isForwardVerified)
     {
-        return false;
+        while (CRC_IsCrcBusy());
+        CRC_WriteData(data);
     }
-    
-#ifdef MEM_CARD_FILE_DEBUG_ENABLE
-    printf("[DEBUG FILE I/O] Preparing for write on sector %lu\r\n", sector);
 #endif
     
-    //Set the target
-    cacheBlockAddr = sector;
-    
-    //Set the write value
-    writeSize = 0;
-    
-    for (uint16_t i = 0; i < FAT_BLOCK_SIZE; i++)
+    if ((forwardIndex >= forwardStart) && (forwardIndex < forwardEnd))
     {
-        cache[i] = 0x00;
+        if (forwardDst != NULL)
+        {
+            //Capture into memory
+            *forwardDst = data;
+            forwardDst++;
+        }
+        else
+        {
+            forwardSink(data);
+        }
+    }
+    
+    forwardIndex++;
+}
+
+//Sends nBytes of a sector at a byte offset to the forward sink
+bool memCard_forwardFromDisk(uint32_t sect, uint16_t offset, uint16_t nBytes)
+{
+    //Card not initialized
+    if (card->cardStatus != STATUS_CARD_READY)
+        return false;
+    
+    if ((forwardSink == NULL) || ((offset + nBytes) > FAT_BLOCK_SIZE))
+    {
+        return false;
+    }
+    
+#ifdef MEM_CARD_FILE_DEBUG_ENABLE
+    printf("[DEBUG FILE I/O] Forwarding Sector %lu at offset %u for %u bytes\r\n", sect, offset, nBytes);
+#endif
+    
+    if (card->writeSize != WRITE_SIZE_INVALID)
+    {
+        //The cache holds a sector that is being written
+#ifdef MEM_CARD_FILE_DEBUG_ENABLE
+    printf("[DEBUG FILE I/O] Forward failed due to write in progress\r\n");
+#endif
+        return false;
+    }
+    
+#if !defined(MEM_CARD_DISABLE_CACHE) && !defined(MEM_CARD_CACHELESS)
+    if (sect == card->cacheBlockAddr)
+    {
+        //Sector is already cached, no card access needed. A pinned cache holds the borrowed sector
+        for (uint16_t index = offset; index < (offset + nBytes); index++)
+        {
+            forwardSink(card->cache[index]);
+        }
+        return true;
+    }
+#endif
+    
+#ifdef MEM_CARD_WRITE_QUEUE_ENABLE
+    //The data is streamed from the card, so a queued copy is programmed first
+    if ((memCard_isQueuedRange(sect, 1)) && (memCard_flushWrites() != CARD_NO_ERROR))
+    {
+        return false;
+    }
+#endif
+    
+    //The sink already has the bytes of a failed stream, so it is not retried
+    forwardDst = NULL;
+    return (memCard_streamSector(sect, offset, nBytes) == CARD_NO_ERROR);
+}
+
+//Reads a sector with CMD17 and passes bytes offset to (offset + nBytes - 1) to memCard_forwardByte
+//The whole sector is clocked through the CRC, so no sector buffer is needed
+static CommandError memCard_streamSector(uint32_t sect, uint16_t offset, uint16_t nBytes)
+{
+#ifdef MEM_CARD_CACHELESS
+    if (card->writeSize != WRITE_SIZE_INVALID)
+    {
+        //A write is streaming to the card
+        return CARD_WRITE_IN_PROGRESS;
+    }
+#endif
+    
+#ifdef MEM_CARD_PREFETCH_ENABLE
+    //The card must be free for the next command
+    memCard_completePrefetch();
+#endif
+    
+    //Add clocks between CMDs to improve compatability
+    for (uint8_t i = 0; i < MEMORY_CARD_IDLE_CLOCK_CYCLES; i++)
+    {
+        card->spi->sendByte(0xFF);
+    }
+    
+    CommandError err = memCard_sendReadCommand(17, sect);
+    if (err != CARD_NO_ERROR)
+    {
+        return err;
+    }
+    
+    err = memCard_waitForDataToken();
+    if (err != CARD_NO_ERROR)
+    {
+        card->setCS(false);
+        return err;
+    }
+    
+#ifdef CRC_VALIDATE_READ
+    //Flush CRC Buffer before beginning
+    CRCCON0bits.SETUP = 0b00;
+    CRCOUT = 0x00000000;
+#endif
+    
+    isForwardVerified = (card->crcPolicy == CRC_POLICY_VERIFIED);
+    forwardIndex = 0;
+    forwardStart = offset;
+    forwardEnd = offset + nBytes;
+    
+    //Stream the block and the 2 CRC bytes. Bytes outside the request are only clocked through the CRC
+    card->spi->receiveBytesToHandler(&memCard_forwardByte, FAT_BLOCK_SIZE + 2);
+    
+    card->setCS(false);
+    card->spi->setSpeed(SPI_CMD_BAUD);
+    
+    if (card->removalPending)
+    {
+        //The transfer was cut short
+        return CARD_REMOVED;
+    }
+    
+#ifdef CRC_VALIDATE_READ
+    if (!isForwardVerified)
+    {
+        //Best effort, the CRC is not checked
+        return CARD_NO_ERROR;
+    }
+    
+    while (CRC_IsCrcBusy());
+    uint16_t crcOut = CRC_GetCalculatedResult(false, 0x00);
+    
+    memCard_trackLinkQuality(crcOut == 0x0000);
+    
+    //CRC Failed
+    if (crcOut != 0x0000)
+    {
+        //The data was already forwarded, only the error can be reported
+        //The sink may be the debug UART, so the message is only printed in debug builds
+#ifdef MEM_CARD_DEBUG_ENABLE
+        printf("[DEBUG] CRC failed during forward\r\n");
+#endif
+#ifdef ENFORCE_DATA_CRC 
+        return CARD_CRC_ERROR;
+#endif
+    }
+#endif
+    
+    return CARD_NO_ERROR;
+}
+
+//Prepare to write to a specified sector.
+//Configures write iterators
+bool memCard_prepareWrite(uint32_t sector)
+{
+    if ((card->cardStatus != STATUS_CARD_READY) || (card->cachePinned))
+    {
+        return false;
+    }
+    
+#ifdef MEM_CARD_FILE_DEBUG_ENABLE
+    printf("[DEBUG FILE I/O] Preparing for write on sector %lu\r\n", sector);
+#endif
+    
+#ifdef MEM_CARD_CACHELESS
+    if (card->writeSize != WRITE_SIZE_INVALID)
+    {
+        //Previous write was never finalized
+        memCard_abortWrite();
+    }
+    
+    //Start the block on the card now. Queued data is streamed straight to SPI
+    card->isWriteVerified = (card->crcPolicy == CRC_POLICY_VERIFIED);
+    if (memCard_sendWriteCommand(24, sector, card->isWriteVerified) != CARD_NO_ERROR)
+    {
+        memCard_abortWrite();
+        return false;
+    }
+    
+    if (card->isWriteVerified)
+    {
+        memCard_startCRC16();
+    }
+    
+    //Set the target
+    card->cacheBlockAddr = sector;
+    
+    //Set the write value
+    card->writeSize = 0;
+#else
+#ifdef MEM_CARD_PREFETCH_ENABLE
+    //A read-ahead copy of this sector goes stale
+    memCard_dropPrefetch(sector);
+#endif
+    
+    //Set the target
+    card->cacheBlockAddr = sector;
+    card->isWriteVerified = (card->crcPolicy == CRC_POLICY_VERIFIED);
+    
+    //Set the write value
+    card->writeSize = 0;
+    
+    for (uint16_t i = 0; i < FAT_BLOCK_SIZE; i++)
+    {
+        card->cache[i] = 0x00;
+    }
+#endif
+    
+    return true;
+}
+
+//Prepare to modify a specified sector in place.
+//Loads the sector into cache so bytes that are not written are preserved
+bool memCard_prepareUpdate(uint32_t sector)
+{
+    if ((card->cardStatus != STATUS_CARD_READY) || (card->cachePinned))
+    {
+        return false;
+    }
+    
+#ifdef MEM_CARD_FILE_DEBUG_ENABLE
+    printf("[DEBUG FILE I/O] Preparing for update on sector %lu\r\n", sector);
+#endif
+    
+#ifdef MEM_CARD_CACHELESS
+    //No sector buffer to merge the data into
+    return false;
+#else
+    
+    //Load the current contents (skipped if already cached)
+    if (memCard_readBlock(sector) != CARD_NO_ERROR)
+    {
+        return false;
+    }
+    
+#ifdef MEM_CARD_PREFETCH_ENABLE
+    //A read-ahead copy of this sector goes stale
+    memCard_dropPrefetch(sector);
+#endif
+    
+    //Set the write value
+    card->writeSize = 0;
+    card->isWriteVerified = (card->crcPolicy == CRC_POLICY_VERIFIED);
+    
+    return true;
+#endif
+}
+
+//Moves the write position inside the sector being written
+bool memCard_seekWrite(uint16_t offset)
+{
+    if (card->cardStatus != STATUS_CARD_READY)
+    {
+        return false;
+    }
+    
+    if ((card->writeSize == WRITE_SIZE_INVALID) || (offset > FAT_BLOCK_SIZE))
+    {
+        return false;
+    }
+    
+#ifdef MEM_CARD_CACHELESS
+    //Data already sent cannot be changed. Skipped bytes are sent as zeros
+    if (offset < card->writeSize)
+    {
+        return false;
+    }
+    
+    if (offset > card->writeSize)
+    {
+        card->spi->fillZeros(offset - card->writeSize);
+        for (uint16_t i = card->writeSize; (i < offset) && (card->isWriteVerified); i++)
+        {
+            memCard_addCRC16(0x00);
+        }
     }
+#endif
+    
+    card->writeSize = offset;
     
     return true;
 }
@@ -717,25 +1869,44 @@ bool memCard_prepareWrite(uint32_t sector)
 bool memCard_queueWrite(uint8_t* data, uint16_t dLen)
 {   
     //Card isn't ready
-    if (cardStatus != STATUS_CARD_READY)
+    if (card->cardStatus != STATUS_CARD_READY)
     {
         return false;
     }
 
     //Check write counter
-    if ((writeSize == WRITE_SIZE_INVALID) || (writeSize > FAT_BLOCK_SIZE))
+    if ((card->writeSize == WRITE_SIZE_INVALID) || (card->writeSize > FAT_BLOCK_SIZE))
     {
         return false;
     }
     
     uint16_t count = 0;
-    while ((writeSize < FAT_BLOCK_SIZE) && (count < dLen))
+#ifdef MEM_CARD_CACHELESS
+    count = FAT_BLOCK_SIZE - card->writeSize;
+    if (count > dLen)
+    {
+        count = dLen;
+    }
+    
+    if (count != 0)
+    {
+        //Stream to the card, the CRC is accumulated as the data goes out
+        card->spi->sendBytes(&data[0], count);
+        for (uint16_t i = 0; (i < count) && (card->isWriteVerified); i++)
+        {
+            memCard_addCRC16(data[i]);
+        }
+        card->writeSize += count;
+    }
+#else
+    while ((card->writeSize < FAT_BLOCK_SIZE) && (count < dLen))
     {
-        cache[writeSize] = data[count];
+        card->cache[card->writeSize] = data[count];
         
-        writeSize++;
+        card->writeSize++;
         count++;
     }
+#endif
     
 #ifdef MEM_CARD_FILE_DEBUG_ENABLE
     printf("[DEBUG FILE I/O] Queued %u bytes for write\r\n", count);
@@ -750,42 +1921,127 @@ bool memCard_queueWrite(uint8_t* data, uint16_t dLen)
     return true;
 }
 
-//Writes the current (modified) cache to the memory card
-CommandError memCard_writeBlock(void)
+//Loads a sector into cache and returns a pointer to it, or NULL on failure
+const uint8_t* memCard_borrowSector(uint32_t sector)
 {
-    if (cardStatus != STATUS_CARD_READY)
+#ifdef MEM_CARD_CACHELESS
+    //No cache to borrow
+    return NULL;
+#else
+    //Only one sector can be borrowed at a time
+    if (card->cachePinned)
     {
-        return CARD_NOT_INIT;
+        return NULL;
     }
     
-    if ((writeSize == WRITE_SIZE_INVALID) || (writeSize > FAT_BLOCK_SIZE))
+    if (memCard_readBlock(sector) != CARD_NO_ERROR)
     {
-        return CARD_WRITE_SIZE_ERROR;
+        return NULL;
     }
     
-    //Add clocks between CMDs to improve compatability
-    for (uint8_t i = 0; i < MEMORY_CARD_IDLE_CLOCK_CYCLES; i++)
+    card->cachePinned = true;
+    
+    //The cache is volatile because read-ahead swaps it with buffers that the SPI interrupt fills
+    //A pinned cache is never swapped or written, so the pointer is valid until memCard_releaseSector
+    return (const uint8_t*) &card->cache[0];
+#endif
+}
+
+//Releases the sector returned by memCard_borrowSector
+void memCard_releaseSector(void)
+{
+    card->cachePinned = false;
+}
+
+//Converts a block address to the address used in commands
+static uint32_t memCard_getCardAddress(uint32_t blockAddr)
+{
+    if (card->memCapacity != CCS_HIGH_CAPACITY)
     {
-        SPI1_sendByte(0xFF);
+        //Shift by 9 bits (512) to convert block to byte addressing
+        return (blockAddr << FAT_BLOCK_SHIFT);
     }
     
-#ifdef MEM_CARD_FILE_DEBUG_ENABLE
-    printf("[DEBUG FILE I/O] Writing %u bytes to sector %lu \r\n", writeSize, cacheBlockAddr);
+    return blockAddr;
+}
+
+//Turns CRC checking in the card on or off (CMD59), if it is not already set
+static CommandError memCard_setCardCRC(bool isOn)
+{
+    if (card->isCardCRCOn == isOn)
+    {
+        return CARD_NO_ERROR;
+    }
+    
+    uint8_t rVal = memCard_sendCMD_R1(59, (isOn) ? 0x01 : CARD_NO_DATA);
+    if (rVal == HEADER_INVALID)
+    {
+        return memCard_timeoutError();
+    }
+    
+    if (rVal != HEADER_NO_ERROR)
+    {
+        return CARD_RESPONSE_ERROR;
+    }
+    
+    card->isCardCRCOn = isOn;
+    
+#ifdef MEM_CARD_DEBUG_ENABLE
+    printf("[DEBUG] Card CRC checking is %s\r\n", (isOn) ? "on" : "off");
+#endif
+    
+    return CARD_NO_ERROR;
+}
+
+//Sets the CRC policy of new transfers on the selected card
+void memCard_setCRCPolicy(MemCardCRCPolicy policy)
+{
+    card->crcPolicy = policy;
+}
+
+//Returns the CRC policy of new transfers on the selected card
+MemCardCRCPolicy memCard_getCRCPolicy(void)
+{
+    return card->crcPolicy;
+}
+
+//Sends CMD24 (single block) or CMD25 (multiple blocks) and the start block token. On success, CS is left low for the data
+//Verified writes turn on CRC checking in the card first, other writes turn it off
+static CommandError memCard_sendWriteCommand(uint8_t commandIndex, uint32_t blockAddr, bool isVerified)
+{
+#ifdef MEM_CARD_PREFETCH_ENABLE
+    //The card must be free for the next command
+    memCard_completePrefetch();
 #endif
     
-    uint32_t compBlockAddr = cacheBlockAddr;
-    if (memCapacity != CCS_HIGH_CAPACITY)
+    //Finish the last write
+    CommandError err = memCard_waitReady();
+    if (err != CARD_NO_ERROR)
     {
-        //Shift by 9 bits (512) to convert block to byte addressing
-        compBlockAddr <<= FAT_BLOCK_SHIFT;
+        return err;
+    }
+    
+    //The card only checks the data CRC when CMD59 turned checking on
+    err = memCard_setCardCRC(isVerified);
+    if (err != CARD_NO_ERROR)
+    {
+        return err;
     }
     
-    //Send CMD24
+    //Add clocks between CMDs to improve compatability
+    for (uint8_t i = 0; i < MEMORY_CARD_IDLE_CLOCK_CYCLES; i++)
+    {
+        card->spi->sendByte(0xFF);
+    }
+    
+    uint32_t compBlockAddr = memCard_getCardAddress(blockAddr);
+    
+    //Send CMD24 / CMD25
     uint8_t cmdData[6];
-    cmdData[0] = 0x40 | 24;
+    cmdData[0] = 0x40 | commandIndex;
     
 #ifdef MEM_CARD_DEBUG_ENABLE
-    printf(DEBUG_STRING, 24);
+    printf(DEBUG_STRING, commandIndex);
 #endif
     
     //Pack the address
@@ -796,26 +2052,25 @@ CommandError memCard_writeBlock(void)
     
     cmdData[5] = memCard_runCRC7(&cmdData[0], 5);
     
-    CARD_CS_SetLow();
+    card->setCS(true);
     
     //Send CMD
-    SPI1_sendBytes(&cmdData[0], 6);
+    card->spi->sendBytes(&cmdData[0], 6);
     
     //Get the Response
     CommandStatus header;
     if (!memCard_receiveResponse_R1(&header.data))
     {
-        CARD_CS_SetHigh();
+        card->setCS(false);
 #ifdef MEM_CARD_DEBUG_ENABLE
     printf("[ERROR] No response returned\r\n");
 #endif
-
-        return CARD_SPI_TIMEOUT;
+        return memCard_timeoutError();
     }
     
     if (header.data != 0x00)
     {
-        CARD_CS_SetHigh();
+        card->setCS(false);
 #ifdef MEM_CARD_DEBUG_ENABLE
     printf("[ERROR] Command response error\r\n");
 #endif
@@ -824,9 +2079,9 @@ CommandError memCard_writeBlock(void)
     
     //Clock Speed Switching
 #ifndef DISABLE_SPEED_SWITCH
-    if (speedSwitchOK)
+    if (card->speedSwitchOK)
     {
-        SPI1_setSpeed(SPI_FAST_BAUD);
+        card->spi->setSpeed(card->fastBaud);
     }
 #endif
     
@@ -836,24 +2091,25 @@ CommandError memCard_writeBlock(void)
 
     //Send Data Packet
     
-    //Header Byte
-    SPI1_sendByte(0xFE);
-    
-    //Send Data!
-    SPI1_sendBytes(&cache[0], FAT_BLOCK_SIZE);
-      
-    uint16_t chkSum = memCard_calculateCRC16(&cache[0], FAT_BLOCK_SIZE);
+    //Header Byte (multiple block writes use their own token)
+    card->spi->sendByte((commandIndex == 25) ? 0xFC : 0xFE);
     
+    return CARD_NO_ERROR;
+}
+
+//Sends the CRC after the data and checks the data response. On success, CS is left low
+static CommandError memCard_checkDataResponse(uint16_t chkSum)
+{
     //CRC (Usually ignored...)
-    SPI1_sendByte(((chkSum >> 8) & 0xFF));
-    SPI1_sendByte(chkSum & 0xFF);
+    card->spi->sendByte(((chkSum >> 8) & 0xFF));
+    card->spi->sendByte(chkSum & 0xFF);
     
     //Receive Data Response
     RespToken eToken;
     bool good = false;
     
     //Return to 400 kHz base
-    SPI1_setSpeed(SPI_CMD_BAUD);
+    card->spi->setSpeed(SPI_CMD_BAUD);
     
     //Configure and Start Timeout Timer
     TU16A_PeriodValueSet(DEFAULT_WRITE_TIMEOUT);
@@ -864,7 +2120,7 @@ CommandError memCard_writeBlock(void)
     
     do 
     {
-        eToken.data = SPI1_exchangeByte(0xFF);
+        eToken.data = card->spi->exchangeByte(0xFF);
         
         //Valid header!
         if (eToken.data != 0xFF)
@@ -872,13 +2128,13 @@ CommandError memCard_writeBlock(void)
             good = true;
         }
         
-    } while ((TU16A_IsTimerRunning()) && (!good));
+    } while ((TU16A_IsTimerRunning()) && (!good) && (!card->removalPending));
     TU16A_Stop();
     
     if (!good)
     {
-        CARD_CS_SetHigh();
-        return CARD_SPI_TIMEOUT;
+        card->setCS(false);
+        return memCard_timeoutError();
     }
     
     //Type - Error Token
@@ -887,297 +2143,1824 @@ CommandError memCard_writeBlock(void)
         if (eToken.data != 0x00)
         {
             //Error returned!
-            CARD_CS_SetHigh();
+            card->setCS(false);
             return CARD_RESPONSE_ERROR;
         }
     }
     else
     {
         //Type - Data Token
+        if (eToken.DataToken.status == 0b101)
+        {
+            //The card checked the CRC and rejected the data
+            card->setCS(false);
+            return CARD_CRC_ERROR;
+        }
+        
         if (eToken.DataToken.status != 0b010)
         {
             //Error returned!
-            CARD_CS_SetHigh();
+            card->setCS(false);
             return CARD_RESPONSE_ERROR;
         }
     }
     
-#ifdef MEM_CARD_DEBUG_ENABLE
-    printf("[DEBUG] Waiting for busy to clear...\r\n");
-#endif
-    
-    //Wait for busy to clear...
-    //Active LOW
-    
-    uint8_t resp;
-    do 
-    {
-        resp = SPI1_exchangeByte(0xFF);
-    }while (resp == 0x00);
+    return CARD_NO_ERROR;
+}
+
+//Releases the card while it programs or erases. The next command waits in memCard_waitReady
+static void memCard_deferBusy(uint16_t timeout)
+{
+    card->setCS(false);
+    
+    card->busyPeriod = timeout;
+    TU16A_PeriodValueSet(card->busyPeriod);
+    TU16A_Start();
+    while (!TU16A_IsTimerRunning());
     
-    CARD_CS_SetHigh();
+    card->busyPending = true;
     
 #ifdef MEM_CARD_DEBUG_ENABLE
-    printf("[DEBUG] Busy bit has cleared - write done!\r\n");
+    printf("[DEBUG] Card is busy, write deferred\r\n");
 #endif
+}
+
+//Sends the CRC after the data and checks the data response. The card finishes programming in the background
+static CommandError memCard_finishWrite(uint16_t chkSum)
+{
+    CommandError err = memCard_checkDataResponse(chkSum);
+    if (err != CARD_NO_ERROR)
+    {
+        return err;
+    }
     
-    writeSize = WRITE_SIZE_INVALID;
-    cacheBlockAddr = 0xFFFFFFFF;
+    //The card is now programming
+    memCard_deferBusy(card->writeTimeout);
     
     return CARD_NO_ERROR;
 }
 
-//Reads a block of data, and loads it into cache
-CommandError memCard_readBlock(uint32_t blockAddr)
+//Returns the CRC of a sector to send, or 0xFFFF if the card does not check it
+static uint16_t memCard_getWriteCRC(uint8_t* data, bool isVerified)
+{
+    return (isVerified) ? memCard_calculateCRC16(data, FAT_BLOCK_SIZE) : 0xFFFF;
+}
+
+//Sends one sector with CMD24
+static CommandError memCard_programSector(uint32_t blockAddr, uint8_t* data, bool isVerified)
 {
-    if (cardStatus != STATUS_CARD_READY)
+    CommandError err = memCard_sendWriteCommand(24, blockAddr, isVerified);
+    if (err != CARD_NO_ERROR)
     {
-        return CARD_NOT_INIT;
+        return err;
     }
     
-    if (writeSize != WRITE_SIZE_INVALID)
+    //Send Data!
+    card->spi->sendBytes(data, FAT_BLOCK_SIZE);
+    
+    return memCard_finishWrite(memCard_getWriteCRC(data, isVerified));
+}
+
+#ifdef MEM_CARD_WRITE_QUEUE_ENABLE
+//Copies a sector between the cache and the write queue
+static void memCard_copySector(volatile uint8_t* dst, volatile uint8_t* src)
+{
+    for (uint16_t i = 0; i < FAT_BLOCK_SIZE; i++)
     {
-#ifdef MEM_CARD_FILE_DEBUG_ENABLE
-    printf("[DEBUG FILE I/O] Read failed due to write in progress\r\n");
-#endif
-        return CARD_WRITE_IN_PROGRESS;
+        dst[i] = src[i];
     }
-    
-#ifndef MEM_CARD_DISABLE_CACHE
-    if (blockAddr == cacheBlockAddr)
+}
+
+//Returns the queued write of a sector, or NULL if the sector is not queued
+static QueuedWrite* memCard_findQueuedWrite(uint32_t blockAddr)
+{
+    for (uint8_t i = 0; i < card->writeQueueCount; i++)
     {
-#ifdef MEM_CARD_FILE_DEBUG_ENABLE
-    printf("[DEBUG FILE I/O] Sector %lu fetch skipped due to cache\r\n", blockAddr);
-#endif
-        return CARD_NO_ERROR;
+        if (card->writeQueue[i].blockAddr == blockAddr)
+        {
+            return &card->writeQueue[i];
+        }
     }
-#endif
     
-    //Add clocks between CMDs to improve compatability
-    for (uint8_t i = 0; i < MEMORY_CARD_IDLE_CLOCK_CYCLES; i++)
+    return NULL;
+}
+
+//Returns true if any sector of a range is queued
+static bool memCard_isQueuedRange(uint32_t blockAddr, uint16_t nBlocks)
+{
+    for (uint8_t i = 0; i < card->writeQueueCount; i++)
     {
-        SPI1_sendByte(0xFF);
+        if ((card->writeQueue[i].blockAddr >= blockAddr) && ((card->writeQueue[i].blockAddr - blockAddr) < nBlocks))
+        {
+            return true;
+        }
     }
     
-#ifdef MEM_CARD_FILE_DEBUG_ENABLE
-    printf("[DEBUG FILE I/O] Fetching Sector %lu\r\n", blockAddr);
-#endif
+    return false;
+}
+
+//Waits with CS low for the card to program one block of a multiple block write
+static CommandError memCard_waitBlockProgrammed(void)
+{
+    uint8_t resp;
     
-    uint32_t compBlockAddr = blockAddr;
+    TU16A_PeriodValueSet(card->writeTimeout);
+    TU16A_Start();
+    while (!TU16A_IsTimerRunning());
     
-    if (memCapacity != CCS_HIGH_CAPACITY)
+    //DO is held low while the card is busy
+    do
     {
-        //Shift by 9 bits (512) to convert block to byte addressing
-        compBlockAddr <<= FAT_BLOCK_SHIFT;
-    }
+        resp = card->spi->exchangeByte(0xFF);
+    } while ((resp == 0x00) && (TU16A_IsTimerRunning()) && (!card->removalPending));
+    TU16A_Stop();
     
-    //Send CMD17
-    uint8_t cmdData[6];
-    cmdData[0] = 0x40 | 17;
+    return (resp == 0x00) ? memCard_timeoutError() : CARD_NO_ERROR;
+}
+
+//Sends a run of adjacent queued sectors as one CMD25 burst
+static CommandError memCard_programRun(QueuedWrite* run, uint8_t nBlocks)
+{
+    CommandError err = memCard_sendWriteCommand(25, run[0].blockAddr, run[0].isVerified);
+    if (err != CARD_NO_ERROR)
+    {
+        return err;
+    }
     
-#ifdef MEM_CARD_DEBUG_ENABLE
-    printf(DEBUG_STRING, 17);
+    for (uint8_t i = 0; (i < nBlocks) && (err == CARD_NO_ERROR); i++)
+    {
+        if (i != 0)
+        {
+            //CS is still low. Only the first token is sent by memCard_sendWriteCommand
+            err = memCard_waitBlockProgrammed();
+            
+#ifndef DISABLE_SPEED_SWITCH
+            if ((err == CARD_NO_ERROR) && (card->speedSwitchOK))
+            {
+                card->spi->setSpeed(card->fastBaud);
+            }
 #endif
+            if (err == CARD_NO_ERROR)
+            {
+                card->spi->sendByte(0xFC);
+            }
+        }
+        
+        if (err == CARD_NO_ERROR)
+        {
+            card->spi->sendBytes(run[i].buffer, FAT_BLOCK_SIZE);
+            err = memCard_checkDataResponse(memCard_getWriteCRC(run[i].buffer, run[i].isVerified));
+        }
+    }
     
-    //Pack the address
-    cmdData[1] = (compBlockAddr & 0xFF000000) >> 24;
-    cmdData[2] = (compBlockAddr & 0x00FF0000) >> 16;
-    cmdData[3] = (compBlockAddr & 0x0000FF00) >> 8;
-    cmdData[4] = (compBlockAddr & 0x000000FF);
-    
-    //Calculate CRC7
-    cmdData[5] = memCard_runCRC7(&cmdData[0], 5);
-    
-    CARD_CS_SetLow();
-    
-    //Send CMD
-    SPI1_sendBytes(&cmdData[0], 6);
-    
-    uint8_t header;
-    if (!memCard_receiveResponse_R1(&header))
+    if (card->removalPending)
     {
-        CARD_CS_SetHigh();
-#ifdef MEM_CARD_DEBUG_ENABLE
-    printf("[ERROR] No response returned\r\n");
-#endif
-
-        return CARD_SPI_TIMEOUT;
+        card->setCS(false);
+        return CARD_REMOVED;
     }
     
-    if (header != HEADER_NO_ERROR)
+    //Stop Tran token ends the burst, also after an error
+    //The card may still be busy with the last block, so wait for it on both paths. An earlier error is kept
+    card->setCS(true);
+    CommandError busyErr = memCard_waitBlockProgrammed();
+    if (err == CARD_NO_ERROR)
     {
-        //Something went wrong
-        CARD_CS_SetHigh();
-#ifdef MEM_CARD_DEBUG_ENABLE
-    printf("[ERROR] Command Error\r\n");
-#endif
-
-        
-        return CARD_RESPONSE_ERROR;
+        err = busyErr;
     }
+    card->spi->sendByte(0xFD);
+    card->spi->sendByte(0xFF);
     
-    //Receive data
-    CommandError err = memCard_receiveBlockData(&cache[0], FAT_BLOCK_SIZE);
-        
-    CARD_CS_SetHigh();
+    //The card programs the last block in the background
+    memCard_deferBusy(card->writeTimeout);
     
-    //Update Cache Address
-    cacheBlockAddr = blockAddr;
-        
     return err;
 }
 
-//Receives length bytes of data. Does not transmit the command
-CommandError memCard_receiveBlockData(uint8_t* data, uint16_t length)
-{    
-    //Data Header
-    RespToken eToken;
-    eToken.data = 0xFF;
-    bool good = false;
-
-    //Configure and Start Timeout Timer
-    TU16A_PeriodValueSet(DEFAULT_READ_TIMEOUT);
-    TU16A_Start();
-    
-    //Wait for Timer to Start
-    while (!TU16A_IsTimerRunning());
+//Holds the sector in the cache until the queue is flushed
+//A sector that is already queued is replaced, so repeated writes are programmed once
+static CommandError memCard_queueSector(void)
+{
+    QueuedWrite* queued = memCard_findQueuedWrite(card->cacheBlockAddr);
     
-    do 
+    if (queued == NULL)
     {
-        eToken.data = SPI1_exchangeByte(0xFF);
+        if (card->writeQueueCount == MEM_CARD_WRITE_QUEUE_DEPTH)
+        {
+            CommandError err = memCard_flushWrites();
+            if (err != CARD_NO_ERROR)
+            {
+                return err;
+            }
+        }
         
-        //Valid header!
-        if (eToken.data != 0xFF)
+        if (card->writeQueueCount == 0)
         {
-            good = true;
+            card->writeQueueAge = 0;
         }
         
-    } while ((TU16A_IsTimerRunning()) && (!good));
-    TU16A_Stop();
-    
-    if (!good)
+        queued = &card->writeQueue[card->writeQueueCount];
+        queued->blockAddr = card->cacheBlockAddr;
+        card->writeQueueCount++;
+    }
+#ifdef MEM_CARD_FILE_DEBUG_ENABLE
+    else
     {
-        return CARD_SPI_TIMEOUT;
+        printf("[DEBUG FILE I/O] Sector %lu write collapsed\r\n", card->cacheBlockAddr);
     }
+#endif
     
-    if (eToken.data != 0xFE)
+    memCard_copySector(queued->buffer, card->cache);
+    queued->isVerified = card->isWriteVerified;
+    
+    return CARD_NO_ERROR;
+}
+#endif
+
+//Programs the queued writes in LBA order. Runs of adjacent sectors are sent as one CMD25 burst
+//Sectors that fail stay queued
+CommandError memCard_flushWrites(void)
+{
+#ifdef MEM_CARD_WRITE_QUEUE_ENABLE
+    QueuedWrite* queue = &card->writeQueue[0];
+    uint8_t count = card->writeQueueCount;
+    
+    if (count == 0)
     {
-        //Error returned!
-        return CARD_RESPONSE_ERROR;
+        return CARD_NO_ERROR;
     }
     
-    //Clock Speed Switching
-#ifndef DISABLE_SPEED_SWITCH
-    if (speedSwitchOK)
+    if (card->cardStatus != STATUS_CARD_READY)
     {
-        SPI1_setSpeed(SPI_FAST_BAUD);
+        return CARD_NOT_INIT;
     }
-#endif
     
-    //Receive Data
-    SPI1_receiveBytesTransmitFF(&data[0], length);
+    //Sort by sector (the queue is short)
+    for (uint8_t i = 1; i < count; i++)
+    {
+        QueuedWrite entry = queue[i];
+        uint8_t j = i;
+        
+        while ((j > 0) && (queue[j - 1].blockAddr > entry.blockAddr))
+        {
+            queue[j] = queue[j - 1];
+            j--;
+        }
+        queue[j] = entry;
+    }
     
-    uint8_t crcResp[2];
+    uint8_t done = 0;
+    CommandError err = CARD_NO_ERROR;
     
-    //Finally, get 2 bytes for checksum
-    SPI1_receiveBytesTransmitFF(&crcResp[0], 2);
+    while ((done < count) && (err == CARD_NO_ERROR))
+    {
+        //A burst ends at an allocation unit boundary, so each burst stays inside one AU
+        //The CRC mode of the card cannot change during a burst
+        uint8_t run = 1;
+        while (((done + run) < count) && (queue[done + run].blockAddr == (queue[done + run - 1].blockAddr + 1))
+                && ((card->auBlocks == 0) || ((queue[done + run].blockAddr % card->auBlocks) != 0))
+                && (queue[done + run].isVerified == queue[done].isVerified))
+        {
+            run++;
+        }
+        
+#ifdef MEM_CARD_FILE_DEBUG_ENABLE
+        printf("[DEBUG FILE I/O] Flushing %u sectors from sector %lu\r\n", run, queue[done].blockAddr);
+#endif
+        
+        if (run == 1)
+        {
+            err = memCard_programSector(queue[done].blockAddr, queue[done].buffer, queue[done].isVerified);
+        }
+        else
+        {
+            err = memCard_programRun(&queue[done], run);
+        }
+        
+        if (err == CARD_NO_ERROR)
+        {
+#ifdef MEM_CARD_PREFETCH_ENABLE
+            //A read-ahead made while the sectors were queued is stale
+            for (uint8_t i = 0; i < run; i++)
+            {
+                memCard_dropPrefetch(queue[done + i].blockAddr);
+            }
+#endif
+            done += run;
+        }
+    }
     
-    CARD_CS_SetHigh();
-    SPI1_setSpeed(SPI_CMD_BAUD);
+    //Move the sectors that are left to the front. Swapping keeps every buffer in the queue
+    for (uint8_t i = 0; (i + done) < count; i++)
+    {
+        QueuedWrite entry = queue[i];
+        queue[i] = queue[i + done];
+        queue[i + done] = entry;
+    }
+    card->writeQueueCount = count - done;
     
-    //CRC16 CCIT Polynomial
-    //0x1021
+    return err;
+#else
+    return CARD_NO_ERROR;
+#endif
+}
+
+//Flushes the write queue of each slot once its oldest sector has waited WRITE_QUEUE_DEADLINE ms
+//Call periodically with the time since the last call. Returns false if a flush failed
+bool memCard_writeQueueTasks(uint16_t elapsedTime)
+{
+#ifdef MEM_CARD_WRITE_QUEUE_ENABLE
+    uint8_t selected = memCard_getSlot();
+    bool isOK = true;
     
-#ifdef CRC_VALIDATE_READ
+    for (uint8_t i = 0; i < MEM_CARD_SLOTS; i++)
+    {
+        if (cards[i].writeQueueCount != 0)
+        {
+            if ((WRITE_QUEUE_DEADLINE - cards[i].writeQueueAge) > elapsedTime)
+            {
+                cards[i].writeQueueAge += elapsedTime;
+            }
+            else if ((!memCard_selectSlot(i)) || (memCard_flushWrites() != CARD_NO_ERROR))
+            {
+                isOK = false;
+            }
+        }
+    }
     
-#ifdef MEM_CARD_MEMORY_DEBUG_ENABLE
-    printf("[DEBUG] Data CRC = ");
-    memCard_printData(&crcResp[0], 2);
+    memCard_selectSlot(selected);
+    return isOK;
+#else
+    return true;
 #endif
+}
+
+//Checks the busy signal once. Returns true while the card is still programming
+bool memCard_isBusy(void)
+{
+    if (!card->busyPending)
+    {
+        return false;
+    }
     
-    uint16_t crcOut;
-    
-    //Flush CRC Buffer before beginning
-    CRCCON0bits.SETUP = 0b00;
-    CRCOUT = 0x00000000;
+    //Busy (DO held low) is only driven while CS is low
+    card->setCS(true);
+    uint8_t resp = card->spi->exchangeByte(0xFF);
+    card->setCS(false);
     
-    for (uint16_t i = 0; i < length; ++i)
+    if (resp != 0x00)
     {
-        CRC_WriteData(data[i]);
-        while (CRC_IsCrcBusy());
+        card->busyPending = false;
+        TU16A_Stop();
+        
+#ifdef MEM_CARD_DEBUG_ENABLE
+        printf("[DEBUG] Busy bit has cleared - write done!\r\n");
+#endif
     }
     
-    //Now, load the CRC checksum in
-    CRC_WriteData(crcResp[0]);
-    while (CRC_IsCrcBusy());
-    CRC_WriteData(crcResp[1]);
-    while (CRC_IsCrcBusy());
+    return card->busyPending;
+}
 
-    crcOut = CRC_GetCalculatedResult(false, 0x00);
-            
-    //CRC Failed
-    if (crcOut != 0x0000)
+//Waits for the card to finish programming the last write
+//Returns CARD_SPI_TIMEOUT if the write time-out from the CSD runs out
+CommandError memCard_waitReady(void)
+{
+    while (memCard_isBusy())
     {
-        printf("CRC failed during read\r\nC");
-#ifdef ENFORCE_DATA_CRC 
-        cacheBlockAddr = 0xFFFFFFFF;
-        return CARD_CRC_ERROR;
-#endif
+        if (card->removalPending)
+        {
+            card->busyPending = false;
+            return CARD_REMOVED;
+        }
+        
+        if (!TU16A_IsTimerRunning())
+        {
+            //Card is stuck
+            card->busyPending = false;
+            printf("[ERROR] Card busy time-out\r\n");
+            return CARD_SPI_TIMEOUT;
+        }
+        
+        DELAY_microseconds(BUSY_POLL_INTERVAL);
     }
     
-#endif
     return CARD_NO_ERROR;
 }
 
-//Compute CRC7 for the memory card commands
-uint8_t memCard_runCRC7(uint8_t* dataIn, uint8_t len)
+//Writes the current (modified) cache to the memory card
+CommandError memCard_writeBlock(void)
 {
-    uint8_t output = 0x00;
-    uint8_t mask;
-    //Byte level
-    for (uint8_t by = 0; by < len; by++)
+    if (card->cardStatus != STATUS_CARD_READY)
+    {
+        return CARD_NOT_INIT;
+    }
+    
+    if ((card->writeSize == WRITE_SIZE_INVALID) || (card->writeSize > FAT_BLOCK_SIZE))
+    {
+        return CARD_WRITE_SIZE_ERROR;
+    }
+    
+#ifdef MEM_CARD_FILE_DEBUG_ENABLE
+    printf("[DEBUG FILE I/O] Writing %u bytes to sector %lu \r\n", card->writeSize, card->cacheBlockAddr);
+#endif
+    
+    CommandError err;
+    
+#ifdef MEM_CARD_CACHELESS
+    //CMD24 and the data were already sent. Pad the rest of the sector with zeros
+    uint16_t padding = FAT_BLOCK_SIZE - card->writeSize;
+    if (padding != 0)
+    {
+        card->spi->fillZeros(padding);
+        for (uint16_t i = 0; (i < padding) && (card->isWriteVerified); i++)
+        {
+            memCard_addCRC16(0x00);
+        }
+    }
+    
+    uint16_t chkSum = (card->isWriteVerified) ? (CRC_GetCalculatedResult(false, 0x00) & 0xFFFF) : 0xFFFF;
+    
+    err = memCard_finishWrite(chkSum);
+#elif defined(MEM_CARD_WRITE_QUEUE_ENABLE)
+    //Programmed with its neighbors when the queue is flushed
+    err = memCard_queueSector();
+#else
+    err = memCard_programSector(card->cacheBlockAddr, (uint8_t*) &card->cache[0], card->isWriteVerified);
+#endif
+    
+    if (err != CARD_NO_ERROR)
+    {
+        memCard_abortWrite();
+        return err;
+    }
+    
+    //Cache now matches the sector on the card, keep it valid
+    card->writeSize = WRITE_SIZE_INVALID;
+    
+    return CARD_NO_ERROR;
+}
+
+//Shrinks an erase range to whole erase units. The card would erase the rest of a unit too
+static void memCard_alignErase(uint32_t* firstBlock, uint32_t* endBlock)
+{
+    if (card->eraseBlocks > 1)
+    {
+        *firstBlock += card->eraseBlocks - 1;
+        *firstBlock -= *firstBlock % card->eraseBlocks;
+        *endBlock -= *endBlock % card->eraseBlocks;
+    }
+}
+
+//Drops every copy of the erased sectors (cache, read-ahead and queued writes)
+//No read-ahead may be in flight
+static void memCard_dropErasedRange(uint32_t firstBlock, uint32_t nBlocks)
+{
+    if ((card->cacheBlockAddr >= firstBlock) && ((card->cacheBlockAddr - firstBlock) < nBlocks))
+    {
+        card->cacheBlockAddr = 0xFFFFFFFF;
+    }
+    
+#ifdef MEM_CARD_PREFETCH_ENABLE
+    for (uint8_t i = 0; i < MEM_CARD_PREFETCH_SLOTS; i++)
+    {
+        if ((card->prefetchSlots[i].blockAddr >= firstBlock) && ((card->prefetchSlots[i].blockAddr - firstBlock) < nBlocks))
+        {
+            card->prefetchSlots[i].state = PREFETCH_EMPTY;
+        }
+    }
+#endif
+    
+#ifdef MEM_CARD_WRITE_QUEUE_ENABLE
+    //A queued sector was written before the erase, so it does not need to be programmed
+    uint8_t i = 0;
+    while (i < card->writeQueueCount)
+    {
+        QueuedWrite* queued = &card->writeQueue[i];
+        
+        if ((queued->blockAddr >= firstBlock) && ((queued->blockAddr - firstBlock) < nBlocks))
+        {
+            //Swap with the last entry, so every buffer stays in the queue
+            QueuedWrite entry = *queued;
+            card->writeQueueCount--;
+            *queued = card->writeQueue[card->writeQueueCount];
+            card->writeQueue[card->writeQueueCount] = entry;
+        }
+        else
+        {
+            i++;
+        }
+    }
+#endif
+}
+
+//Busy time-out (ms) of an erase
+static uint16_t memCard_getEraseTimeout(uint32_t nBlocks)
+{
+    uint32_t timeout;
+    
+    if ((card->auBlocks != 0) && (card->eraseSize != 0) && (card->eraseTimeout != 0))
+    {
+        //SD status: ERASE_TIMEOUT (s) for ERASE_SIZE AUs, plus ERASE_OFFSET (s)
+        uint32_t nUnits = (nBlocks + card->auBlocks - 1) / card->auBlocks;
+        timeout = ((nUnits * card->eraseTimeout * 1000) / card->eraseSize) + (card->eraseOffset * 1000UL);
+        
+        if (timeout < DEFAULT_ERASE_TIMEOUT)
+        {
+            timeout = DEFAULT_ERASE_TIMEOUT;
+        }
+    }
+    else
+    {
+        timeout = ((nBlocks + ERASE_TIMEOUT_BLOCKS - 1) / ERASE_TIMEOUT_BLOCKS) * DEFAULT_ERASE_TIMEOUT;
+    }
+    
+    return (timeout > 0xFFFF) ? 0xFFFF : (uint16_t) timeout;
+}
+
+//Sends CMD32 / CMD33 / CMD38 for whole erase units. The card erases in the background
+static CommandError memCard_sendErase(uint32_t firstBlock, uint32_t nBlocks)
+{
+#ifdef MEM_CARD_FILE_DEBUG_ENABLE
+    printf("[DEBUG FILE I/O] Erasing %lu sectors from sector %lu\r\n", nBlocks, firstBlock);
+#endif
+    
+#ifdef MEM_CARD_PREFETCH_ENABLE
+    //The card must be free for the next command
+    memCard_completePrefetch();
+#endif
+    
+    //Erase start, erase end (inclusive), then erase
+    uint8_t rVal = memCard_sendCMD_R1(32, memCard_getCardAddress(firstBlock));
+    
+    if (rVal == HEADER_NO_ERROR)
+    {
+        rVal = memCard_sendCMD_R1(33, memCard_getCardAddress(firstBlock + nBlocks - 1));
+    }
+    
+    if (rVal == HEADER_NO_ERROR)
+    {
+        rVal = memCard_sendCMD_R1(38, CARD_NO_DATA);
+    }
+    
+    if (rVal == HEADER_INVALID)
+    {
+        return memCard_timeoutError();
+    }
+    
+    if (rVal != HEADER_NO_ERROR)
+    {
+#ifdef MEM_CARD_DEBUG_ENABLE
+        printf("[ERROR] Erase rejected (0x%x)\r\n", rVal);
+#endif
+        return CARD_RESPONSE_ERROR;
+    }
+    
+    //The erase was accepted, so the copies of the sectors are older than the erase
+    //A rejected erase keeps them, because the card still holds the old sectors
+    memCard_dropErasedRange(firstBlock, nBlocks);
+    
+    //CMD38 has a busy response. The card is released while it erases
+    memCard_deferBusy(memCard_getEraseTimeout(nBlocks));
+    
+    return CARD_NO_ERROR;
+}
+
+//Checks that the card can take an erase
+static CommandError memCard_canErase(void)
+{
+    if (card->cardStatus != STATUS_CARD_READY)
+    {
+        return CARD_NOT_INIT;
+    }
+    
+    if (card->eraseBlocks == 0)
+    {
+        return CARD_NOT_SUPPORTED;
+    }
+    
+    if (card->writeSize != WRITE_SIZE_INVALID)
+    {
+        return CARD_WRITE_IN_PROGRESS;
+    }
+    
+    if (card->cachePinned)
+    {
+        return CARD_CACHE_PINNED;
+    }
+    
+    return CARD_NO_ERROR;
+}
+
+//Starts erasing up to ERASE_MAX_BLOCKS sectors and returns while the card erases
+CommandError memCard_startErase(uint32_t startBlock, uint32_t nBlocks)
+{
+    CommandError err = memCard_canErase();
+    if (err != CARD_NO_ERROR)
+    {
+        return err;
+    }
+    
+    uint32_t endBlock = startBlock + nBlocks;
+    memCard_alignErase(&startBlock, &endBlock);
+    
+    if (endBlock <= startBlock)
+    {
+        //No whole erase unit in the range
+        return CARD_NO_ERROR;
+    }
+    
+    if ((endBlock - startBlock) > ERASE_MAX_BLOCKS)
+    {
+        return CARD_WRITE_SIZE_ERROR;
+    }
+    
+    return memCard_sendErase(startBlock, endBlock - startBlock);
+}
+
+//Erases a range of sectors and waits for the card to finish
+CommandError memCard_erase(uint32_t startBlock, uint32_t nBlocks)
+{
+    CommandError err = memCard_canErase();
+    if (err != CARD_NO_ERROR)
+    {
+        return err;
+    }
+    
+    uint32_t endBlock = startBlock + nBlocks;
+    memCard_alignErase(&startBlock, &endBlock);
+    
+    //Each command is limited, so its busy time-out stays short. The limit is kept to whole erase units
+    uint32_t chunk = ERASE_MAX_BLOCKS - (ERASE_MAX_BLOCKS % card->eraseBlocks);
+    
+    while (startBlock < endBlock)
+    {
+        uint32_t n = endBlock - startBlock;
+        if (n > chunk)
+        {
+            n = chunk;
+        }
+        
+        err = memCard_sendErase(startBlock, n);
+        if (err == CARD_NO_ERROR)
+        {
+            err = memCard_waitReady();
+        }
+        
+        if (err != CARD_NO_ERROR)
+        {
+            return err;
+        }
+        
+        startBlock += n;
+    }
+    
+    return CARD_NO_ERROR;
+}
+
+//Sends CMD17 (single block) or CMD18 (multiple blocks) for a block. On success, CS is left low for the data transfer
+static CommandError memCard_sendReadCommand(uint8_t commandIndex, uint32_t blockAddr)
+{
+    //Finish the last write
+    CommandError err = memCard_waitReady();
+    if (err != CARD_NO_ERROR)
+    {
+        return err;
+    }
+    
+    uint32_t compBlockAddr = memCard_getCardAddress(blockAddr);
+    
+    //Send CMD17 / CMD18
+    uint8_t cmdData[6];
+    cmdData[0] = 0x40 | commandIndex;
+    
+#ifdef MEM_CARD_DEBUG_ENABLE
+    printf(DEBUG_STRING, commandIndex);
+#endif
+    
+    //Pack the address
+    cmdData[1] = (compBlockAddr & 0xFF000000) >> 24;
+    cmdData[2] = (compBlockAddr & 0x00FF0000) >> 16;
+    cmdData[3] = (compBlockAddr & 0x0000FF00) >> 8;
+    cmdData[4] = (compBlockAddr & 0x000000FF);
+    
+    //Calculate CRC7
+    cmdData[5] = memCard_runCRC7(&cmdData[0], 5);
+    
+    card->setCS(true);
+    
+    //Send CMD
+    card->spi->sendBytes(&cmdData[0], 6);
+    
+    uint8_t header;
+    if (!memCard_receiveResponse_R1(&header))
+    {
+        card->setCS(false);
+#ifdef MEM_CARD_DEBUG_ENABLE
+    printf("[ERROR] No response returned\r\n");
+#endif
+
+        return memCard_timeoutError();
+    }
+    
+    if (header != HEADER_NO_ERROR)
+    {
+        //Something went wrong
+        card->setCS(false);
+#ifdef MEM_CARD_DEBUG_ENABLE
+    printf("[ERROR] Command Error\r\n");
+#endif
+
+        
+        return CARD_RESPONSE_ERROR;
+    }
+    
+    return CARD_NO_ERROR;
+}
+
+//Reads a block of data, and loads it into cache
+CommandError memCard_readBlock(uint32_t blockAddr)
+{
+    if (card->cardStatus != STATUS_CARD_READY)
+    {
+        return CARD_NOT_INIT;
+    }
+    
+#ifdef MEM_CARD_CACHELESS
+    //No cache to load the block into
+    return CARD_NOT_SUPPORTED;
+#else
+    
+    if (card->writeSize != WRITE_SIZE_INVALID)
+    {
+#ifdef MEM_CARD_FILE_DEBUG_ENABLE
+    printf("[DEBUG FILE I/O] Read failed due to write in progress\r\n");
+#endif
+        return CARD_WRITE_IN_PROGRESS;
+    }
+    
+    if (card->cachePinned)
+    {
+        //Cache is borrowed, only the borrowed sector can be read
+        return (blockAddr == card->cacheBlockAddr) ? CARD_NO_ERROR : CARD_CACHE_PINNED;
+    }
+    
+#ifndef MEM_CARD_DISABLE_CACHE
+    if (blockAddr == card->cacheBlockAddr)
+    {
+#ifdef MEM_CARD_FILE_DEBUG_ENABLE
+    printf("[DEBUG FILE I/O] Sector %lu fetch skipped due to cache\r\n", blockAddr);
+#endif
+        return CARD_NO_ERROR;
+    }
+#endif
+    
+#ifdef MEM_CARD_WRITE_QUEUE_ENABLE
+    //A queued write is newer than the sector on the card
+    QueuedWrite* queued = memCard_findQueuedWrite(blockAddr);
+    if (queued != NULL)
+    {
+        memCard_copySector(card->cache, queued->buffer);
+        card->cacheBlockAddr = blockAddr;
+        return CARD_NO_ERROR;
+    }
+#endif
+    
+#ifdef MEM_CARD_PREFETCH_ENABLE
+    //Finish the read-ahead in flight. This is at most one sector read
+    memCard_completePrefetch();
+    
+    if (memCard_takePrefetch(blockAddr))
+    {
+#ifdef MEM_CARD_FILE_DEBUG_ENABLE
+    printf("[DEBUG FILE I/O] Sector %lu fetch skipped due to prefetch\r\n", blockAddr);
+#endif
+        card->cacheBlockAddr = blockAddr;
+        memCard_schedulePrefetch(blockAddr);
+        return CARD_NO_ERROR;
+    }
+#endif
+    
+#ifdef MEM_CARD_FILE_DEBUG_ENABLE
+    printf("[DEBUG FILE I/O] Fetching Sector %lu\r\n", blockAddr);
+#endif
+    
+    //Receive data
+    CommandError err = memCard_retryRead(blockAddr, (uint8_t*) &card->cache[0], 1);
+    
+    //Update Cache Address. A failed transfer leaves the cache with unknown contents
+    card->cacheBlockAddr = (err == CARD_NO_ERROR) ? blockAddr : 0xFFFFFFFF;
+    
+#ifdef MEM_CARD_PREFETCH_ENABLE
+    if (err == CARD_NO_ERROR)
+    {
+        memCard_schedulePrefetch(blockAddr);
+    }
+#endif
+        
+    return err;
+#endif
+}
+
+//Waits for the start block token of a data transfer
+//On success, the SPI speed is switched for the data
+static CommandError memCard_waitForDataToken(void)
+{
+    //Data Header
+    RespToken eToken;
+    eToken.data = 0xFF;
+    bool good = false;
+    uint16_t polls = 0;
+
+    //Configure and Start Timeout Timer
+    TU16A_PeriodValueSet(DEFAULT_READ_TIMEOUT);
+    TU16A_Start();
+    
+    //Wait for Timer to Start
+    while (!TU16A_IsTimerRunning());
+    
+    do 
+    {
+        eToken.data = card->spi->exchangeByte(0xFF);
+        
+        //Valid header!
+        if (eToken.data != 0xFF)
+        {
+            good = true;
+        }
+        else if (polls < READ_LATENCY_MAX_POLLS)
+        {
+            polls++;
+        }
+        
+    } while ((TU16A_IsTimerRunning()) && (!good) && (!card->removalPending));
+    TU16A_Stop();
+    
+    //Running average of the access time (polls are made at the command rate)
+    card->readLatency = card->readLatency - (card->readLatency >> 3) + polls;
+    
+    if (!good)
+    {
+        return memCard_timeoutError();
+    }
+    
+    if (eToken.data != 0xFE)
+    {
+        //Error returned!
+        return CARD_RESPONSE_ERROR;
+    }
+    
+    //Clock Speed Switching
+#ifndef DISABLE_SPEED_SWITCH
+    if (card->speedSwitchOK)
+    {
+        card->spi->setSpeed(card->fastBaud);
+    }
+#endif
+    
+    return CARD_NO_ERROR;
+}
+
+#ifdef CRC_VALIDATE_READ
+//Runs a received block and its 2 CRC bytes through the CRC. Returns true if the CRC matches
+static bool memCard_checkBlockCRC(volatile uint8_t* data, uint16_t length, uint8_t* crcResp)
+{
+    //CRC16 CCIT Polynomial
+    //0x1021
+    
+    //Flush CRC Buffer before beginning
+    CRCCON0bits.SETUP = 0b00;
+    CRCOUT = 0x00000000;
+    
+    for (uint16_t i = 0; i < length; ++i)
+    {
+        CRC_WriteData(data[i]);
+        while (CRC_IsCrcBusy());
+    }
+    
+    //Now, load the CRC checksum in
+    CRC_WriteData(crcResp[0]);
+    while (CRC_IsCrcBusy());
+    CRC_WriteData(crcResp[1]);
+    while (CRC_IsCrcBusy());
+
+    return (CRC_GetCalculatedResult(false, 0x00) == 0x0000);
+}
+
+//Counts CRC errors at the fast rate. Too many in a window slows the SPI by one step
+static void memCard_trackLinkQuality(bool isGood)
+{
+    if (!card->speedSwitchOK)
+    {
+        return;
+    }
+    
+    card->crcReads++;
+    if (!isGood)
+    {
+        card->crcErrors++;
+    }
+    
+    if (card->crcErrors >= CRC_DERATE_ERRORS)
+    {
+        if (card->fastBaud < SPI_CMD_BAUD)
+        {
+            card->fastBaud++;
+            printf("[WARN] SPI derated to BAUD = %u due to CRC errors\r\n", card->fastBaud);
+        }
+        
+        card->crcReads = 0;
+        card->crcErrors = 0;
+    }
+    else if (card->crcReads >= CRC_DERATE_WINDOW)
+    {
+        //Start a new window
+        card->crcReads = 0;
+        card->crcErrors = 0;
+    }
+}
+#endif
+
+#if defined(CRC_VALIDATE_READ) && !defined(DISABLE_SPEED_SWITCH)
+//Runs a received byte through the CRC
+static void memCard_crcByte(uint8_t data)
+{
+    while (CRC_IsCrcBusy());
+    CRC_WriteData(data);
+}
+
+//Reads a sector at the current fast rate and only checks the CRC. No buffer is needed
+static CommandError memCard_probeSector(uint32_t sector)
+{
+    //Add clocks between CMDs to improve compatability
+    for (uint8_t i = 0; i < MEMORY_CARD_IDLE_CLOCK_CYCLES; i++)
+    {
+        card->spi->sendByte(0xFF);
+    }
+    
+    CommandError err = memCard_sendReadCommand(17, sector);
+    if (err != CARD_NO_ERROR)
+    {
+        return err;
+    }
+    
+    err = memCard_waitForDataToken();
+    if (err != CARD_NO_ERROR)
+    {
+        card->setCS(false);
+        return err;
+    }
+    
+    //Flush CRC Buffer before beginning
+    CRCCON0bits.SETUP = 0b00;
+    CRCOUT = 0x00000000;
+    
+    //Block and CRC bytes
+    card->spi->receiveBytesToHandler(&memCard_crcByte, FAT_BLOCK_SIZE + 2);
+    
+    card->setCS(false);
+    card->spi->setSpeed(SPI_CMD_BAUD);
+    
+    if (card->removalPending)
+    {
+        return CARD_REMOVED;
+    }
+    
+    while (CRC_IsCrcBusy());
+    return (CRC_GetCalculatedResult(false, 0x00) == 0x0000) ? CARD_NO_ERROR : CARD_CRC_ERROR;
+}
+#endif
+
+//Finds the fastest SPI rate that reads a sector with no CRC errors, then slows down by SPI_CALIBRATE_MARGIN
+bool memCard_calibrateSpeed(uint32_t sector)
+{
+#if defined(CRC_VALIDATE_READ) && !defined(DISABLE_SPEED_SWITCH)
+    if ((card->cardStatus != STATUS_CARD_READY) || (card->writeSize != WRITE_SIZE_INVALID))
+    {
+        return false;
+    }
+    
+#ifdef MEM_CARD_PREFETCH_ENABLE
+    //The card must be free for the next command
+    memCard_completePrefetch();
+#endif
+    
+    card->speedSwitchOK = true;
+    
+    for (uint8_t baud = SPI_CALIBRATE_FASTEST_BAUD; (baud < SPI_CMD_BAUD) && (!card->removalPending); baud++)
+    {
+        card->fastBaud = baud;
+        
+        bool isGood = true;
+        for (uint8_t i = 0; (i < SPI_CALIBRATE_READS) && (isGood); i++)
+        {
+            isGood = (memCard_probeSector(sector) == CARD_NO_ERROR);
+        }
+        
+        if (isGood)
+        {
+            baud += SPI_CALIBRATE_MARGIN;
+            card->fastBaud = (baud < SPI_CMD_BAUD) ? baud : SPI_CMD_BAUD;
+            card->crcReads = 0;
+            card->crcErrors = 0;
+            
+            printf("SPI calibrated to BAUD = %u\r\n", card->fastBaud);
+            return true;
+        }
+    }
+    
+    //No rate worked, stay at 400 kHz
+    card->speedSwitchOK = false;
+    card->fastBaud = SPI_FAST_BAUD;
+    printf("[WARN] SPI calibration failed\r\n");
+#else
+    (void) sector;
+#endif
+    return false;
+}
+
+//Returns the SPI BAUD value used for data transfers
+uint8_t memCard_getFastBaud(void)
+{
+    return (card->speedSwitchOK) ? card->fastBaud : SPI_CMD_BAUD;
+}
+
+//Receives one data packet (token, data and CRC). CS is left low
+static CommandError memCard_receiveDataPacket(uint8_t* data, uint16_t length)
+{
+    CommandError err = memCard_waitForDataToken();
+    if (err != CARD_NO_ERROR)
+    {
+        return err;
+    }
+    
+    //Receive Data
+    card->spi->receiveBytesTransmitFF(&data[0], length);
+    
+    uint8_t crcResp[2];
+    
+    //Finally, get 2 bytes for checksum
+    card->spi->receiveBytesTransmitFF(&crcResp[0], 2);
+    
+    if (card->removalPending)
+    {
+        //The transfer was cut short
+        return CARD_REMOVED;
+    }
+    
+#ifdef CRC_VALIDATE_READ
+    if (card->crcPolicy != CRC_POLICY_VERIFIED)
+    {
+        //Best effort, the CRC is not checked
+        return CARD_NO_ERROR;
+    }
+    
+#ifdef MEM_CARD_MEMORY_DEBUG_ENABLE
+    printf("[DEBUG] Data CRC = ");
+    memCard_printData(&crcResp[0], 2);
+#endif
+    
+    bool isGood = memCard_checkBlockCRC(&data[0], length, &crcResp[0]);
+    memCard_trackLinkQuality(isGood);
+    
+    //CRC Failed
+    if (!isGood)
+    {
+        printf("CRC failed during read\r\nC");
+#ifdef ENFORCE_DATA_CRC 
+        return CARD_CRC_ERROR;
+#endif
+    }
+    
+#endif
+    return CARD_NO_ERROR;
+}
+
+//Receives length bytes of data. Does not transmit the command
+CommandError memCard_receiveBlockData(uint8_t* data, uint16_t length)
+{    
+    CommandError err = memCard_receiveDataPacket(data, length);
+    
+    card->setCS(false);
+    card->spi->setSpeed(SPI_CMD_BAUD);
+    
+    return err;
+}
+
+//Compute CRC7 for the memory card commands
+uint8_t memCard_runCRC7(uint8_t* dataIn, uint8_t len)
+{
+    uint8_t output = 0x00;
+    uint8_t mask;
+    //Byte level
+    for (uint8_t by = 0; by < len; by++)
     {
         //Bit level
         mask = 0x80;
         while (mask != 0x00)
         {
-            //If 1 in the MSB...
-            bool input = ((dataIn[by] & mask) != 0x00) ? true : false;
+            //If 1 in the MSB...
+            bool input = ((dataIn[by] & mask) != 0x00) ? true : false;
+            
+            //XOR with the LSB of the 7-bit output
+            input ^= (output & 0x01);
+            
+            //Right-Shift
+            output >>= 1;
+            
+            //Load into shifter
+            //Output[7] is not used
+            output |= (input << 6);
+            
+            //Bit 3 = XOR of Prev. and Input
+            uint8_t t = output & 0x08;
+            uint8_t t2 = (t >> 3) ^ input;
+            output = (output & 0xF7) | (t2 << 3);
+            
+            //Shift mask over by 1
+            mask >>= 1;
+        }
+    }
+    
+    //Flip the output ordering
+    //Note: Bit 7 is not used, and is ignored
+    uint8_t tOut;
+    tOut = ((output & 0x40) >> 5);
+    tOut |= ((output & 0x20) >> 3);
+    tOut |= ((output & 0x10) >> 1);
+    tOut |= ((output & 0x08) << 1);
+    tOut |= ((output & 0x04) << 3);
+    tOut |= ((output & 0x02) << 5);
+    tOut |= ((output & 0x01) << 7);
+    output = tOut;
+    
+    //Pad with 1
+    output |= 0b1;
+    
+    return output;
+}
+
+//Sends CMD12 to end a multiple block read, and waits for the card to finish
+static CommandError memCard_stopTransmission(void)
+{
+    uint8_t cmdData[6];
+    cmdData[0] = 0x40 | 12;
+    cmdData[1] = 0x00;
+    cmdData[2] = 0x00;
+    cmdData[3] = 0x00;
+    cmdData[4] = 0x00;
+    cmdData[5] = memCard_runCRC7(&cmdData[0], 5);
+    
+#ifdef MEM_CARD_DEBUG_ENABLE
+    printf(DEBUG_STRING, 12);
+#endif
+    
+    card->spi->sendBytes(&cmdData[0], 6);
+    
+    //Discard the stuff byte
+    card->spi->exchangeByte(0xFF);
+    
+    uint8_t header;
+    if (!memCard_receiveResponse_R1(&header))
+    {
+        return memCard_timeoutError();
+    }
+    
+    //Wait for the card to release busy
+    TU16A_PeriodValueSet(DEFAULT_READ_TIMEOUT);
+    TU16A_Start();
+    while (!TU16A_IsTimerRunning());
+    
+    bool busy = true;
+    do
+    {
+        busy = (card->spi->exchangeByte(0xFF) != 0xFF);
+    } while ((TU16A_IsTimerRunning()) && (busy) && (!card->removalPending));
+    TU16A_Stop();
+    
+    if (busy)
+    {
+        return memCard_timeoutError();
+    }
+    
+    return (header == HEADER_NO_ERROR) ? CARD_NO_ERROR : CARD_RESPONSE_ERROR;
+}
+
+//Reads whole blocks into data without going through the cache
+static CommandError memCard_readBlocksDirect(uint32_t sect, uint8_t* data, uint16_t nBlocks)
+{
+    if (card->writeSize != WRITE_SIZE_INVALID)
+    {
+        //The sector being written is not on the card yet
+        return CARD_WRITE_IN_PROGRESS;
+    }
+    
+#ifdef MEM_CARD_PREFETCH_ENABLE
+    //The card must be free for the next command
+    memCard_completePrefetch();
+#endif
+    
+#ifdef MEM_CARD_FILE_DEBUG_ENABLE
+    printf("[DEBUG FILE I/O] Fetching %u Sectors from %lu directly\r\n", nBlocks, sect);
+#endif
+    
+    return memCard_retryRead(sect, data, nBlocks);
+}
+
+//Sends the read command for whole sectors and returns while the card looks up the data
+bool memCard_startRead(uint32_t sect, uint16_t nBlocks)
+{
+    if ((card->cardStatus != STATUS_CARD_READY) || (nBlocks == 0) || (card->pendingBlocks != 0))
+    {
+        return false;
+    }
+    
+    //CS stays low until memCard_finishRead, so no other slot may use the SPI in between
+    if ((card->writeSize != WRITE_SIZE_INVALID) || (memCard_isSharedSPI()))
+    {
+        return false;
+    }
+    
+#ifdef MEM_CARD_WRITE_QUEUE_ENABLE
+    //The data goes around the cache, so queued sectors in the range are programmed first
+    if ((memCard_isQueuedRange(sect, nBlocks)) && (memCard_flushWrites() != CARD_NO_ERROR))
+    {
+        return false;
+    }
+#endif
+    
+#ifdef MEM_CARD_PREFETCH_ENABLE
+    //The card must be free for the next command
+    memCard_completePrefetch();
+#endif
+    
+    //A failed command is retried by memCard_finishRead
+    card->pendingSect = sect;
+    card->pendingBlocks = nBlocks;
+    card->pendingErr = memCard_requestBlocks(sect, nBlocks);
+    
+    return true;
+}
+
+//Receives the sectors of memCard_startRead into data. A failed transfer is retried like any other read
+bool memCard_finishRead(uint8_t* data)
+{
+    uint16_t nBlocks = card->pendingBlocks;
+    if (nBlocks == 0)
+    {
+        //Nothing started, or the card was removed
+        return false;
+    }
+    
+    card->pendingBlocks = 0;
+    
+    CommandError err = card->pendingErr;
+    if (err == CARD_NO_ERROR)
+    {
+        err = memCard_receiveBlocks(data, nBlocks);
+    }
+    
+    return (memCard_recoverRead(err, card->pendingSect, data, nBlocks) == CARD_NO_ERROR);
+}
+
+//Re-initializes the card from CMD0 after a read kept failing
+static bool memCard_reinitCard(void)
+{
+    isReinitializing = true;
+    card->cardStatus = STATUS_CARD_NOT_INIT;
+    
+    bool isGood = memCard_initCard();
+    
+    isReinitializing = false;
+    return isGood;
+}
+
+//Applies the retry policy to a failed read. Returns true if the read should be tried again
+//Errors are re-read up to READ_RETRIES times. If a timeout or card error is still returned,
+//the card is re-initialized once and the read is tried again. CRC errors do not re-initialize the card
+static bool memCard_canRetryRead(CommandError err, uint8_t* retries, bool* isReinit)
+{
+    switch (err)
+    {
+        case CARD_CRC_ERROR:
+            card->readStats.crcErrors++;
+            break;
+        case CARD_SPI_TIMEOUT:
+            card->readStats.timeouts++;
+            break;
+        case CARD_RESPONSE_ERROR:
+            card->readStats.responseErrors++;
+            break;
+        default:
+            //Not a transfer error (ex: card removed), retrying will not help
+            card->readStats.failures++;
+            return false;
+    }
+    
+    if (*retries < READ_RETRIES)
+    {
+        (*retries)++;
+        card->readStats.retries++;
+        return true;
+    }
+    
+    if ((!*isReinit) && (!isReinitializing) && (err != CARD_CRC_ERROR))
+    {
+        //The card may have lost its state
+        *isReinit = true;
+        card->readStats.reinits++;
+        
+        if (memCard_reinitCard())
+        {
+            return true;
+        }
+    }
+    
+    card->readStats.failures++;
+    return false;
+}
+
+//Runs a read with the retry policy
+static CommandError memCard_retryRead(uint32_t sect, uint8_t* data, uint16_t nBlocks)
+{
+    return memCard_recoverRead(memCard_transferBlocks(sect, data, nBlocks), sect, data, nBlocks);
+}
+
+//Applies the retry policy to the result of a read that has already run once
+static CommandError memCard_recoverRead(CommandError err, uint32_t sect, uint8_t* data, uint16_t nBlocks)
+{
+    uint8_t retries = 0;
+    bool isReinit = false;
+    
+    while (err != CARD_NO_ERROR)
+    {
+        if (!memCard_canRetryRead(err, &retries, &isReinit))
+        {
+            return err;
+        }
+        
+        err = memCard_transferBlocks(sect, data, nBlocks);
+    }
+    
+    if ((retries != 0) || (isReinit))
+    {
+        card->readStats.recovered++;
+    }
+    
+    return CARD_NO_ERROR;
+}
+
+#ifdef MEM_CARD_CACHELESS
+//Streams part of a sector into data with the retry policy
+//A retry streams the sector again from the start of the buffer
+static CommandError memCard_retryStream(uint32_t sect, uint16_t offset, uint8_t* data, uint16_t nBytes)
+{
+    uint8_t retries = 0;
+    bool isReinit = false;
+    
+    forwardDst = data;
+    CommandError err = memCard_streamSector(sect, offset, nBytes);
+    
+    while (err != CARD_NO_ERROR)
+    {
+        if (!memCard_canRetryRead(err, &retries, &isReinit))
+        {
+            return err;
+        }
+        
+        forwardDst = data;
+        err = memCard_streamSector(sect, offset, nBytes);
+    }
+    
+    if ((retries != 0) || (isReinit))
+    {
+        card->readStats.recovered++;
+    }
+    
+    return CARD_NO_ERROR;
+}
+#endif
+
+//Copies the read error counters
+void memCard_getReadStats(MemCardReadStats* stats)
+{
+    *stats = card->readStats;
+}
+
+//Clears the read error counters
+void memCard_clearReadStats(void)
+{
+    card->readStats.crcErrors = 0;
+    card->readStats.timeouts = 0;
+    card->readStats.responseErrors = 0;
+    card->readStats.retries = 0;
+    card->readStats.reinits = 0;
+    card->readStats.recovered = 0;
+    card->readStats.failures = 0;
+}
+
+//Reads whole blocks into data. One block uses CMD17, more use CMD18 + CMD12
+static CommandError memCard_transferBlocks(uint32_t sect, uint8_t* data, uint16_t nBlocks)
+{
+    CommandError err = memCard_requestBlocks(sect, nBlocks);
+    if (err != CARD_NO_ERROR)
+    {
+        return err;
+    }
+    
+    return memCard_receiveBlocks(data, nBlocks);
+}
+
+//Sends CMD17 / CMD18 for whole blocks. On success CS is left low for memCard_receiveBlocks
+static CommandError memCard_requestBlocks(uint32_t sect, uint16_t nBlocks)
+{
+    //Add clocks between CMDs to improve compatability
+    for (uint8_t i = 0; i < MEMORY_CARD_IDLE_CLOCK_CYCLES; i++)
+    {
+        card->spi->sendByte(0xFF);
+    }
+    
+    return memCard_sendReadCommand((nBlocks == 1) ? 17 : 18, sect);
+}
+
+//Receives the blocks of memCard_requestBlocks, then releases CS
+static CommandError memCard_receiveBlocks(uint8_t* data, uint16_t nBlocks)
+{
+    CommandError err;
+    
+    if (nBlocks == 1)
+    {
+        err = memCard_receiveBlockData(data, FAT_BLOCK_SIZE);
+        card->setCS(false);
+        return err;
+    }
+    
+    err = CARD_NO_ERROR;
+    for (uint16_t block = 0; (block < nBlocks) && (err == CARD_NO_ERROR); block++)
+    {
+        err = memCard_receiveDataPacket(data, FAT_BLOCK_SIZE);
+        data += FAT_BLOCK_SIZE;
+    }
+    
+    //The card keeps sending blocks until stopped, even after an error
+    CommandError stopErr = memCard_stopTransmission();
+    card->setCS(false);
+    card->spi->setSpeed(SPI_CMD_BAUD);
+    
+    return (err != CARD_NO_ERROR) ? err : stopErr;
+}
+
+//Sets how many sectors are read ahead once sequential reads are detected (0 = off)
+void memCard_setPrefetchDepth(uint8_t depth)
+{
+#ifdef MEM_CARD_PREFETCH_ENABLE
+    if (depth > MEM_CARD_PREFETCH_SLOTS)
+    {
+        depth = MEM_CARD_PREFETCH_SLOTS;
+    }
+    
+    card->prefetchDepth = depth;
+    
+    if (depth == 0)
+    {
+        //Let a read in flight finish, then drop everything
+        memCard_completePrefetch();
+        memCard_resetPrefetch();
+    }
+#endif
+}
+
+#ifdef MEM_CARD_PREFETCH_ENABLE
+//Ends the read-ahead transfer in flight
+static void memCard_endPrefetch(PrefetchSlot* slot, PrefetchState state)
+{
+    card->setCS(false);
+    card->spi->setSpeed(SPI_CMD_BAUD);
+    slot->state = state;
+}
+
+//Queues the data and CRC of a read-ahead. CS is released when the CRC is in
+static void memCard_queuePrefetchData(PrefetchSlot* slot)
+{
+    SPI1_Transaction* data = &slot->transfer[0];
+    data->txData = NULL;
+    data->rxData = (uint8_t*) slot->buffer;
+    data->length = FAT_BLOCK_SIZE;
+    data->fillByte = 0xFF;
+    data->csControl = 0;
+    data->callback = NULL;
+    
+    SPI1_Transaction* crc = &slot->transfer[1];
+    crc->txData = NULL;
+    crc->rxData = &slot->crc[0];
+    crc->length = 2;
+    crc->fillByte = 0xFF;
+    crc->csControl = SPI1_CS_RELEASE;
+    crc->callback = NULL;
+    
+    if (card->spi->queueTransaction == NULL)
+    {
+        //No transfer queue on this SPI. Receive the sector now
+        card->spi->receiveBytesTransmitFF(data->rxData, FAT_BLOCK_SIZE);
+        card->spi->receiveBytesTransmitFF(crc->rxData, 2);
+        card->setCS(false);
+        crc->state = SPI1_TRANSACTION_DONE;
+        return;
+    }
+    
+    card->spi->setCSHandler(card->setCS);
+    
+    if ((!card->spi->queueTransaction(data)) || (!card->spi->queueTransaction(crc)))
+    {
+        //Queue is aborted (card removed) or full. Let the data finish before CS is raised
+        while (!card->spi->isQueueIdle());
+        crc->state = SPI1_TRANSACTION_ABORTED;
+    }
+}
+
+//Advances a read-ahead by up to budget bytes of SPI traffic
+static void memCard_runPrefetch(PrefetchSlot* slot, uint16_t budget)
+{
+    if (card->removalPending)
+    {
+        //memCard_tasks raises CS
+        slot->state = PREFETCH_EMPTY;
+        return;
+    }
+    
+    switch (slot->state)
+    {
+        case PREFETCH_QUEUED:
+        {
+            //Add clocks between CMDs to improve compatability
+            for (uint8_t i = 0; i < MEMORY_CARD_IDLE_CLOCK_CYCLES; i++)
+            {
+                card->spi->sendByte(0xFF);
+            }
             
-            //XOR with the LSB of the 7-bit output
-            input ^= (output & 0x01);
+            if (memCard_sendReadCommand(17, slot->blockAddr) != CARD_NO_ERROR)
+            {
+                //CS is already high
+                slot->state = PREFETCH_EMPTY;
+                return;
+            }
             
-            //Right-Shift
-            output >>= 1;
+            slot->index = 0;
+            slot->state = PREFETCH_TOKEN_WAIT;
+            break;
+        }
+        case PREFETCH_TOKEN_WAIT:
+        {
+            //Poll for the start token without blocking on the card's access time
+            while (budget > 0)
+            {
+                uint8_t token = card->spi->exchangeByte(0xFF);
+                budget--;
+                
+                if (token == 0xFE)
+                {
+#ifndef DISABLE_SPEED_SWITCH
+                    if (card->speedSwitchOK)
+                    {
+                        card->spi->setSpeed(card->fastBaud);
+                    }
+#endif
+                    slot->state = PREFETCH_RECEIVING;
+                    memCard_queuePrefetchData(slot);
+                    break;
+                }
+                else if (token != 0xFF)
+                {
+                    //Error token
+                    memCard_endPrefetch(slot, PREFETCH_EMPTY);
+                    return;
+                }
+                
+                slot->index++;
+                if (slot->index >= PREFETCH_TOKEN_POLLS)
+                {
+                    memCard_endPrefetch(slot, PREFETCH_EMPTY);
+                    return;
+                }
+            }
+            break;
+        }
+        case PREFETCH_RECEIVING:
+        {
+            //The data moves in the SPI1 interrupt
+            if ((slot->transfer[1].state == SPI1_TRANSACTION_QUEUED) || (slot->transfer[1].state == SPI1_TRANSACTION_ACTIVE))
+            {
+                return;
+            }
             
-            //Load into shifter
-            //Output[7] is not used
-            output |= (input << 6);
+            if (slot->transfer[1].state != SPI1_TRANSACTION_DONE)
+            {
+                memCard_endPrefetch(slot, PREFETCH_EMPTY);
+                return;
+            }
             
-            //Bit 3 = XOR of Prev. and Input
-            uint8_t t = output & 0x08;
-            uint8_t t2 = (t >> 3) ^ input;
-            output = (output & 0xF7) | (t2 << 3);
+            memCard_endPrefetch(slot, PREFETCH_READY);
             
-            //Shift mask over by 1
-            mask >>= 1;
+#ifdef CRC_VALIDATE_READ
+            if (!slot->isVerified)
+            {
+                //Best effort, the CRC is not checked
+                break;
+            }
+            
+            bool isGood = memCard_checkBlockCRC(slot->buffer, FAT_BLOCK_SIZE, &slot->crc[0]);
+            memCard_trackLinkQuality(isGood);
+            
+#ifdef ENFORCE_DATA_CRC
+            if (!isGood)
+            {
+                //Let the foreground read fetch it again
+                slot->state = PREFETCH_EMPTY;
+            }
+#endif
+#endif
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+//Returns the slot with a transfer in flight, or NULL
+static PrefetchSlot* memCard_getActivePrefetch(void)
+{
+    for (uint8_t i = 0; i < MEM_CARD_PREFETCH_SLOTS; i++)
+    {
+        if ((card->prefetchSlots[i].state == PREFETCH_TOKEN_WAIT) || (card->prefetchSlots[i].state == PREFETCH_RECEIVING))
+        {
+            return &card->prefetchSlots[i];
         }
     }
     
-    //Flip the output ordering
-    //Note: Bit 7 is not used, and is ignored
-    uint8_t tOut;
-    tOut = ((output & 0x40) >> 5);
-    tOut |= ((output & 0x20) >> 3);
-    tOut |= ((output & 0x10) >> 1);
-    tOut |= ((output & 0x08) << 1);
-    tOut |= ((output & 0x04) << 3);
-    tOut |= ((output & 0x02) << 5);
-    tOut |= ((output & 0x01) << 7);
-    output = tOut;
+    return NULL;
+}
+
+//Runs the read-ahead in flight to completion, so the card can take a new command
+//This takes at most one sector read. It fills the buffer of the slot and never touches the cache
+static void memCard_completePrefetch(void)
+{
+    PrefetchSlot* slot = memCard_getActivePrefetch();
     
-    //Pad with 1
-    output |= 0b1;
+    while ((slot != NULL) && (slot->state != PREFETCH_READY) && (slot->state != PREFETCH_EMPTY))
+    {
+        memCard_runPrefetch(slot, FAT_BLOCK_SIZE);
+    }
+}
+
+//If the sector was read ahead, swaps its buffer with the cache
+static bool memCard_takePrefetch(uint32_t blockAddr)
+{
+    //A borrowed sector must stay where its pointer is
+    if (card->cachePinned)
+    {
+        return false;
+    }
     
-    return output;
-}
\ No newline at end of file
+    for (uint8_t i = 0; i < MEM_CARD_PREFETCH_SLOTS; i++)
+    {
+        PrefetchSlot* slot = &card->prefetchSlots[i];
+        
+        //A best effort copy is not used by a verified read
+        if ((slot->state == PREFETCH_READY) && (slot->blockAddr == blockAddr) &&
+            ((slot->isVerified) || (card->crcPolicy != CRC_POLICY_VERIFIED)))
+        {
+            volatile uint8_t* temp = card->cache;
+            card->cache = slot->buffer;
+            slot->buffer = temp;
+            slot->state = PREFETCH_EMPTY;
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+//Queues the sectors after blockAddr if the reads are sequential
+static void memCard_schedulePrefetch(uint32_t blockAddr)
+{
+    bool isSequential = (blockAddr == (card->lastBlockAddr + 1));
+    card->lastBlockAddr = blockAddr;
+    
+    if ((!isSequential) || (card->prefetchDepth == 0))
+    {
+        return;
+    }
+    
+    //Drop queued or finished sectors outside of the new window
+    for (uint8_t i = 0; i < MEM_CARD_PREFETCH_SLOTS; i++)
+    {
+        PrefetchSlot* slot = &card->prefetchSlots[i];
+        
+        if (((slot->state == PREFETCH_QUEUED) || (slot->state == PREFETCH_READY))
+                && ((slot->blockAddr <= blockAddr) || (slot->blockAddr > (blockAddr + card->prefetchDepth))))
+        {
+            slot->state = PREFETCH_EMPTY;
+        }
+    }
+    
+    for (uint8_t depth = 1; depth <= card->prefetchDepth; depth++)
+    {
+        uint32_t nextAddr = blockAddr + depth;
+        PrefetchSlot* freeSlot = NULL;
+        bool isQueued = false;
+        
+        for (uint8_t i = 0; i < MEM_CARD_PREFETCH_SLOTS; i++)
+        {
+            if (card->prefetchSlots[i].state == PREFETCH_EMPTY)
+            {
+                if (freeSlot == NULL)
+                {
+                    freeSlot = &card->prefetchSlots[i];
+                }
+            }
+            else if (card->prefetchSlots[i].blockAddr == nextAddr)
+            {
+                isQueued = true;
+            }
+        }
+        
+        if (isQueued)
+        {
+            continue;
+        }
+        
+        if (freeSlot == NULL)
+        {
+            //All slots busy
+            return;
+        }
+        
+        //The read-ahead keeps the CRC policy of this read, whenever it completes
+        freeSlot->blockAddr = nextAddr;
+        freeSlot->isVerified = (card->crcPolicy == CRC_POLICY_VERIFIED);
+        freeSlot->state = PREFETCH_QUEUED;
+    }
+}
+
+//Drops the read-ahead copy of a sector that is about to be written
+static void memCard_dropPrefetch(uint32_t blockAddr)
+{
+    memCard_completePrefetch();
+    
+    for (uint8_t i = 0; i < MEM_CARD_PREFETCH_SLOTS; i++)
+    {
+        if (card->prefetchSlots[i].blockAddr == blockAddr)
+        {
+            card->prefetchSlots[i].state = PREFETCH_EMPTY;
+        }
+    }
+}
+
+//Drops all read-ahead state
+static void memCard_resetPrefetch(void)
+{
+    if (memCard_getActivePrefetch() != NULL)
+    {
+        //Abandon the transfer in flight
+        card->setCS(false);
+    }
+    
+    for (uint8_t i = 0; i < MEM_CARD_PREFETCH_SLOTS; i++)
+    {
+        card->prefetchSlots[i].state = PREFETCH_EMPTY;
+    }
+    
+    card->lastBlockAddr = 0xFFFFFFFF;
+}
+#endif
+
+//Runs one bounded slice of a queued prefetch. Call from the main loop when idle
+void memCard_prefetchTasks(void)
+{
+#ifdef MEM_CARD_PREFETCH_ENABLE
+    if (card->cardStatus != STATUS_CARD_READY)
+    {
+        return;
+    }
+    
+    //Do not start a read while a write is programming
+    if (memCard_isBusy())
+    {
+        return;
+    }
+    
+    //Continue the transfer in flight, otherwise start the first queued sector
+    PrefetchSlot* slot = memCard_getActivePrefetch();
+    
+    for (uint8_t i = 0; (slot == NULL) && (i < MEM_CARD_PREFETCH_SLOTS); i++)
+    {
+        if (card->prefetchSlots[i].state == PREFETCH_QUEUED)
+        {
+            slot = &card->prefetchSlots[i];
+        }
+    }
+    
+    if (slot != NULL)
+    {
+        memCard_runPrefetch(slot, PREFETCH_SLICE_BYTES);
+    }
+#endif
+}
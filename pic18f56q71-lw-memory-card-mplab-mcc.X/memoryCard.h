@@ -10,6 +10,7 @@ extern "C" {
 
 #include "mcc_generated_files/system/pins.h"
 #include "mcc_generated_files/clc/clc2.h"
+#include "spi1_host.h"
 
 //If defined, all memory card commands are printed to terminal
 #define MEM_CARD_DEBUG_ENABLE
@@ -24,6 +25,37 @@ extern "C" {
 //Extremely slow. Used for debugging only
 //#define MEM_CARD_DISABLE_CACHE
     
+//If defined, the driver has no 512 byte sector cache (low RAM mode)
+//Reads stream the requested bytes from the card, writes stream straight to the card
+//In-place sector updates (disk_updatep) and memCard_borrowSector are not available
+//#define MEM_CARD_CACHELESS
+    
+//Number of card slots. Each slot has its own state and cache (see memCard_initSlot)
+//Slot 0 uses SPI1, CARD_CS and the card detect on CLC2
+#define MEM_CARD_SLOTS 1
+    
+//Number of extra sector buffers for read-ahead (0 = no prefetch). Each one costs 512 bytes of RAM
+//Not used with MEM_CARD_CACHELESS or MEM_CARD_DISABLE_CACHE
+#define MEM_CARD_PREFETCH_SLOTS 0
+    
+//Set when read-ahead is built. The SPI1 transfer queue is only built for it
+#if (MEM_CARD_PREFETCH_SLOTS > 0) && !defined(MEM_CARD_CACHELESS) && !defined(MEM_CARD_DISABLE_CACHE)
+#define MEM_CARD_PREFETCH_ENABLE
+#endif
+    
+//Number of finished sectors held for sorting and merging before they are programmed (0 = write at once)
+//Each one costs 512 bytes of RAM. Not used with MEM_CARD_CACHELESS or MEM_CARD_DISABLE_CACHE
+#define MEM_CARD_WRITE_QUEUE_DEPTH 0
+    
+//Longest time (ms) a queued write waits before memCard_writeQueueTasks programs it
+#define WRITE_QUEUE_DEADLINE 100
+    
+//Start token polls made by each call of memCard_prefetchTasks
+#define PREFETCH_SLICE_BYTES 64
+    
+//Bytes polled for the start token before a prefetch is dropped
+#define PREFETCH_TOKEN_POLLS 4096
+    
 //How many clock sequences to run between each command
 #define MEMORY_CARD_IDLE_CLOCK_CYCLES 10
     
@@ -39,8 +71,27 @@ extern "C" {
 //Worst case Write Time Delay (ms)
 #define DEFAULT_WRITE_TIMEOUT 500
     
-//How many times will the driver attempt to init the Card (ACMD41 / CMD1)
-#define INIT_RETRIES 100
+//Shortest busy time-out (ms) derived from a CSD 1.0 card
+#define WRITE_TIMEOUT_MIN 10
+    
+//Erase busy time-out (ms) for each ERASE_TIMEOUT_BLOCKS sectors of an erase
+#define DEFAULT_ERASE_TIMEOUT 250
+#define ERASE_TIMEOUT_BLOCKS 64
+    
+//Most sectors erased by one erase command. memCard_erase splits longer ranges
+#define ERASE_MAX_BLOCKS 4096
+    
+//Delay (us) between busy checks while waiting for a write to finish. CS is released between checks
+#define BUSY_POLL_INTERVAL 50
+    
+//Time budget (ms) for the card to become ready, across all init attempts
+#define INIT_TIMEOUT 1000
+    
+//Longest delay (ms) between ACMD41 / CMD1 polls. The delay doubles from 0 up to this value
+#define INIT_POLL_DELAY_MAX 16
+    
+//ACMD41 argument (HCS set, high capacity cards supported)
+#define INIT_ACMD41_ARG 0x40000000
     
 //If any stage of init fails, the driver will retry this many times before giving up
 #define FULL_RETRIES 5
@@ -53,11 +104,21 @@ extern "C" {
     
 //If set, read operations will attempt to validate the CRC
 //This does not invalidate a read, unless ENFORCE_DATA_CRC is also set
+//Only reads made with CRC_POLICY_VERIFIED are checked
 #define CRC_VALIDATE_READ
     
+//CRC policy of each card after start up (see memCard_setCRCPolicy)
+#define CRC_DEFAULT_POLICY CRC_POLICY_VERIFIED
+    
 //If set, a read can fail due to bad CRC
 #define ENFORCE_DATA_CRC
     
+//Number of times a failed sector read is repeated before the card is re-initialized
+#define READ_RETRIES 2
+    
+//Start token polls counted per read for the access time average (see memCard_getSlotLatency)
+#define READ_LATENCY_MAX_POLLS 4095
+    
 //Set VDD for 2.7V to 3.6V Operation
 #define VHS_3V3 0b0001
     
@@ -78,6 +139,22 @@ extern "C" {
 //400 kHz
 #define SPI_CMD_BAUD 79
     
+//Fastest rate tried by memCard_calibrateSpeed (16 MHz)
+#define SPI_CALIBRATE_FASTEST_BAUD 1
+    
+//Reads per rate during calibration. All of them must pass the CRC
+#define SPI_CALIBRATE_READS 4
+    
+//Steps slower than the fastest passing rate
+#define SPI_CALIBRATE_MARGIN 1
+    
+//Sector read during calibration
+#define SPI_CALIBRATE_SECTOR 0
+    
+//The SPI is slowed by one step if CRC_DERATE_ERRORS reads in CRC_DERATE_WINDOW reads fail the CRC
+#define CRC_DERATE_ERRORS 2
+#define CRC_DERATE_WINDOW 64
+    
 //Bad OCR return value
 #define CARD_BAD_OCR 0xFFFFFFFF
 #define CARD_NO_DATA 0x00000000
@@ -154,42 +231,154 @@ extern "C" {
     typedef enum {
         CARD_NO_ERROR = 0, CARD_SPI_TIMEOUT, CARD_CRC_ERROR, CARD_RESPONSE_ERROR,
         CARD_ILLEGAL_CMD, CARD_VOLTAGE_NOT_SUPPORTED, CARD_PATTERN_ERROR, 
-        CARD_WRITE_IN_PROGRESS, CARD_WRITE_SIZE_ERROR, CARD_NOT_INIT
+        CARD_WRITE_IN_PROGRESS, CARD_WRITE_SIZE_ERROR, CARD_NOT_INIT, CARD_CACHE_PINNED,
+        CARD_NOT_SUPPORTED, CARD_REMOVED
     } CommandError;
     
     typedef enum {
         CCS_INVALID = -1, CCS_LOW_CAPACITY, CCS_HIGH_CAPACITY
     } CardCapacityType;
     
+    typedef enum {
+        CRC_POLICY_OFF = 0,     //Best effort. No CRC is generated or checked, and the card does not check written data
+        CRC_POLICY_VERIFIED     //The card rejects written data with a bad CRC (CMD59), reads are checked (CRC_VALIDATE_READ)
+    } MemCardCRCPolicy;
+    
     typedef enum {
         STATUS_CARD_NONE = 0, STATUS_CARD_NOT_INIT, STATUS_CARD_ERROR, STATUS_CARD_READY
     } MemoryCardDriverStatus;
     
+    //Read error counters (see memCard_getReadStats)
+    typedef struct {
+        uint16_t crcErrors;         //Reads that failed the CRC
+        uint16_t timeouts;          //Reads with no response or data token
+        uint16_t responseErrors;    //Reads rejected by the card (R1 or error token)
+        uint16_t retries;           //Repeated reads
+        uint16_t reinits;           //Card re-initializations
+        uint16_t recovered;         //Reads that passed after a retry
+        uint16_t failures;          //Reads that failed after all retries
+    } MemCardReadStats;
+    
+    //Card details (see memCard_getCardInfo)
+    typedef struct {
+        //From the CID
+        uint8_t manufacturerID;
+        char oemID[3];              //2 characters
+        char productName[6];        //5 characters
+        uint8_t productRevision;    //BCD (n.m)
+        uint32_t serialNumber;
+        uint16_t manufactureYear;
+        uint8_t manufactureMonth;
+        
+        CardCapacityType capacity;
+        uint16_t eraseBlocks;       //Smallest erase unit in sectors, from the CSD (0 = no erase)
+        
+        //From the SD status (ACMD13). 0 if the card did not report it
+        uint8_t speedClass;         //Class 2, 4, 6 or 10 (MB/s)
+        uint32_t auBlocks;          //Allocation unit in sectors
+        uint16_t eraseSize;         //Number of AUs erased in eraseTimeout
+        uint8_t eraseTimeout;       //Erase time-out (s) for eraseSize AUs
+        uint8_t eraseOffset;        //Time (s) added to every erase
+    } MemCardInfo;
+    
+    //Receives bytes forwarded from the card (ex: UART2_Write)
+    typedef void (*MemCardByteSink)(uint8_t data);
+    
+    //SPI functions used by a card slot (see memCard_spi1Ops)
+    typedef struct {
+        void (*setSpeed)(uint8_t baud);
+        void (*abort)(void);
+        void (*clearAbort)(void);
+        uint8_t (*exchangeByte)(uint8_t data);
+        void (*sendByte)(uint8_t data);
+        void (*exchangeBytes)(uint8_t* txData, uint8_t* rxData, uint8_t len);
+        void (*sendBytes)(uint8_t* txData, uint16_t len);
+        void (*fillZeros)(uint16_t len);
+        void (*receiveBytesTransmitFF)(uint8_t* rxData, uint16_t len);
+        void (*receiveBytesToHandler)(void (*handler)(uint8_t), uint16_t len);
+        void (*sendResetSequence)(void);
+        
+        //Optional transfer queue (NULL: read-ahead data is received in the foreground)
+        bool (*queueTransaction)(SPI1_Transaction* transaction);
+        bool (*isQueueIdle)(void);
+        void (*setCSHandler)(void (*handler)(bool select));
+    } MemCardSPIOps;
+    
+    //SPI functions of SPI1
+    extern const MemCardSPIOps memCard_spi1Ops;
+    
     //Init the Memory Card Driver
     void memCard_initDriver(void);
     
+    //Sets up a card slot. Slot 0 is set up by memCard_initDriver
+    //setCS selects the card (true = CS low). isAttached can be NULL if the slot has no card detect
+    bool memCard_initSlot(uint8_t slot, const MemCardSPIOps* spi, void (*setCS)(bool select), bool (*isAttached)(void));
+    
+    //Selects the card used by all other memCard_ functions
+    //Returns false if the slot does not exist, or the current card has a cacheless write open
+    bool memCard_selectSlot(uint8_t slot);
+    
+    //Returns the selected slot
+    uint8_t memCard_getSlot(void);
+    
     //Init an inserted Memory Card
     bool memCard_initCard(void);
     
+    //Returns the time the last card took to become ready (ms)
+    uint16_t memCard_getInitTime(void);
+    
     //Returns the status of the memory card
     MemoryCardDriverStatus memCard_getCardStatus(void);
     
+    //Returns the status of the card in any slot, without selecting it
+    MemoryCardDriverStatus memCard_getSlotStatus(uint8_t slot);
+    
+    //Returns true if the card in a slot may still be programming a write. Does not poll the card
+    bool memCard_isSlotBusy(uint8_t slot);
+    
+    //Returns the average access time of reads from the card in a slot, in start token polls (x8)
+    uint16_t memCard_getSlotLatency(uint8_t slot);
+    
     //Returns true if the card is ready
     bool memCard_isCardReady(void);
     
     //Requests max clock speed info from card, and sets SPI frequency
     bool memCard_setupTimings(void);
     
+    //Finds the fastest SPI rate that reads a sector with no CRC errors, then slows down by SPI_CALIBRATE_MARGIN
+    //Requires CRC_VALIDATE_READ. Returns false if no rate passed (the card stays at 400 kHz)
+    bool memCard_calibrateSpeed(uint32_t sector);
+    
+    //Returns the SPI BAUD value used for data transfers
+    uint8_t memCard_getFastBaud(void);
+    
+    //Sets the CRC policy of new transfers on the selected card
+    //A write uses the policy set when the sector write was prepared. CMD59 is sent when the card needs to change mode
+    void memCard_setCRCPolicy(MemCardCRCPolicy policy);
+    
+    //Returns the CRC policy of new transfers on the selected card
+    MemCardCRCPolicy memCard_getCRCPolicy(void);
+    
     //Calculates the checksum for a block of data
     uint16_t memCard_calculateCRC16(uint8_t* data, uint16_t dLen);
     
-    //Notifies the driver that a card is now attached
+    //Notifies the driver that a card is now attached to slot 0
     //DOES NOT INITIALIZE THE CARD
     void memCard_attach(void);
     
-    //Notifies the driver that the card is not attached
+    //Notifies the driver that the card in slot 0 is not attached
+    //Safe to call from an interrupt. Transfers in progress stop with CARD_REMOVED
     void memCard_detach(void);
     
+    //Same as memCard_attach, for any slot
+    void memCard_attachSlot(uint8_t slot);
+    
+    //Same as memCard_detach, for any slot. Safe to call from an interrupt
+    void memCard_detachSlot(uint8_t slot);
+    
+    //Resets the driver after a card was removed (all slots). Call from the main loop
+    void memCard_tasks(void);
+    
     //Calls CMD8 to configure the operating voltages
     CommandError memCard_configureCard(void);
     
@@ -211,20 +400,102 @@ extern "C" {
     //Reads the 16-byte CSD Register
     CommandError memCard_readCSD(uint8_t* data);
     
+    //Reads the 16-byte CID Register
+    CommandError memCard_readCID(uint8_t* data);
+    
+    //Reads the 64-byte SD Status (ACMD13)
+    CommandError memCard_readSDStatus(uint8_t* data);
+    
+    //Copies the 16-byte CID of the initialized card. Returns false if it is not known
+    bool memCard_getCardID(uint8_t* cid);
+    
+    //Copies the decoded CID, erase unit and SD status of the initialized card. Returns false if they are not known
+    bool memCard_getCardInfo(MemCardInfo* info);
+    
+    //Returns the allocation unit of the card in a slot, in sectors (0 if not known)
+    //Multiple block writes inside one AU run at the speed class of the card
+    uint32_t memCard_getSlotAllocationUnit(uint8_t slot);
+    
     //Loads data from the memory card into the specified buffer at a block address and byte offset
     bool memCard_readFromDisk(uint32_t sect, uint16_t offset, uint8_t* data, uint16_t nBytes);
     
+    //Sends the read command for nBlocks whole sectors and returns while the card looks up the data
+    //Another slot may be selected and used before memCard_finishRead, as long as it is on another SPI
+    //Returns false if the read cannot be started (ex: the SPI is shared), use memCard_readFromDisk instead
+    bool memCard_startRead(uint32_t sect, uint16_t nBlocks);
+    
+    //Receives the sectors of memCard_startRead into data. Select the slot of the read first
+    bool memCard_finishRead(uint8_t* data);
+    
+    //Copies the read error counters
+    void memCard_getReadStats(MemCardReadStats* stats);
+    
+    //Clears the read error counters
+    void memCard_clearReadStats(void);
+    
+    //Sets the function that receives forwarded bytes
+    void memCard_setForwardSink(MemCardByteSink sink);
+    
+    //Sends nBytes of a sector at a byte offset to the forward sink
+    //The data is streamed from SPI and does not pass through the cache
+    bool memCard_forwardFromDisk(uint32_t sect, uint16_t offset, uint16_t nBytes);
+    
+    //Sets how many sectors are read ahead once sequential reads are detected (0 = off)
+    //Limited to MEM_CARD_PREFETCH_SLOTS
+    void memCard_setPrefetchDepth(uint8_t depth);
+    
+    //Runs one bounded slice of a queued prefetch. Call from the main loop when idle
+    void memCard_prefetchTasks(void);
+    
     //Prepare to write to a specified sector.
     //Clears cache to 0, updates write iterators
     bool memCard_prepareWrite(uint32_t sector);
     
+    //Prepare to modify a specified sector in place.
+    //Loads the sector into cache so bytes that are not written are preserved
+    bool memCard_prepareUpdate(uint32_t sector);
+    
+    //Moves the write position inside the sector being written
+    bool memCard_seekWrite(uint16_t offset);
+    
     //Queues dLen bytes of data to write, sets bw to the number of bytes queued
     //Returns true if successful, false if failed
     bool memCard_queueWrite(uint8_t* data, uint16_t dLen);
     
+    //Loads a sector into cache and returns a pointer to it, or NULL on failure
+    //The sector stays in cache (other reads and writes fail) until memCard_releaseSector is called
+    //The pointer must not be used after the release. Read-ahead may then swap the buffer
+    const uint8_t* memCard_borrowSector(uint32_t sector);
+    
+    //Releases the sector returned by memCard_borrowSector
+    void memCard_releaseSector(void);
+    
     //Writes the current (modified) cache to the memory card
+    //With MEM_CARD_WRITE_QUEUE_DEPTH > 0, the sector is queued until memCard_flushWrites
     CommandError memCard_writeBlock(void);
     
+    //Programs the queued writes in LBA order. Adjacent sectors are sent as one multiple block write
+    //Sectors that fail stay queued
+    CommandError memCard_flushWrites(void);
+    
+    //Flushes the write queue of each slot once its oldest sector has waited WRITE_QUEUE_DEADLINE ms
+    //Call periodically with the time since the last call. Returns false if a flush failed
+    bool memCard_writeQueueTasks(uint16_t elapsedTime);
+    
+    //Erases a range of sectors (CMD32 / CMD33 / CMD38) and waits for the card to finish
+    //Cards that only erase groups of sectors (CSD 1.0) erase the whole groups inside the range
+    CommandError memCard_erase(uint32_t startBlock, uint32_t nBlocks);
+    
+    //Same as memCard_erase for up to ERASE_MAX_BLOCKS sectors, but returns while the card erases
+    //The next command waits for the erase to finish
+    CommandError memCard_startErase(uint32_t startBlock, uint32_t nBlocks);
+    
+    //Checks once if the card is still programming the last write. Does not block
+    bool memCard_isBusy(void);
+    
+    //Waits for the last write to finish programming
+    CommandError memCard_waitReady(void);
+    
     //Reads a sector of data
     CommandError memCard_readBlock(uint32_t sector);
     
@@ -0,0 +1,124 @@
+#include "recordWriter.h"
+#include "memoryCard.h"
+#include "mcc_generated_files/system/system.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//The record writer appends to growing files
+#if PF_USE_APPEND
+
+//Copies the RAM buffer to the open sector. The sector is programmed by Petit FatFs when it fills
+static bool recordWriter_push(RecordWriter* writer)
+{
+    UINT bw;
+
+    if (writer->bufferLen == 0)
+    {
+        return true;
+    }
+
+    if ((pf_fwrite(&writer->file, &writer->buffer[0], writer->bufferLen, &bw) != FR_OK) || (bw != writer->bufferLen))
+    {
+#ifdef MEM_CARD_FILE_DEBUG_ENABLE
+        printf("[RECORD WRITER] Failed to write %u bytes\r\n", writer->bufferLen);
+#endif
+        return false;
+    }
+
+    writer->bufferLen = 0;
+    return true;
+}
+
+//Opens (or creates) a file and moves to the end to append records
+bool recordWriter_open(RecordWriter* writer, const char* filename)
+{
+    writer->bufferLen = 0;
+    writer->pendingTime = 0;
+    writer->isDirty = false;
+
+#if PF_USE_PREALLOC
+    if (pf_fcreate(&writer->file, filename) != FR_OK)
+#else
+    if (pf_fopen(&writer->file, filename) != FR_OK)
+#endif
+    {
+        return false;
+    }
+
+    return (pf_fappend(&writer->file) == FR_OK);
+}
+
+//Adds a record. The card is only programmed when a sector fills
+bool recordWriter_write(RecordWriter* writer, const uint8_t* data, uint16_t len)
+{
+    UINT bw;
+    uint16_t index;
+
+    if (!writer->isDirty)
+    {
+        //Start the flush timeout with the oldest record
+        writer->isDirty = true;
+        writer->pendingTime = 0;
+    }
+
+    if ((writer->bufferLen + len) > RECORD_WRITER_BUFFER_SIZE)
+    {
+        //Make room in the RAM buffer
+        if (!recordWriter_push(writer))
+        {
+            return false;
+        }
+
+        if (len > RECORD_WRITER_BUFFER_SIZE)
+        {
+            //Record does not fit in the buffer, send it straight to the open sector
+            return ((pf_fwrite(&writer->file, data, len, &bw) == FR_OK) && (bw == len));
+        }
+    }
+
+    for (index = 0; index < len; index++)
+    {
+        writer->buffer[writer->bufferLen++] = data[index];
+    }
+
+    return true;
+}
+
+//Programs all buffered records and updates the file size on the card
+bool recordWriter_flush(RecordWriter* writer)
+{
+    if (!recordWriter_push(writer))
+    {
+        return false;
+    }
+
+    //Programs the partial sector, FAT and directory entry
+    //The next write reloads the partial sector, so no data is lost
+    if (pf_fsync(&writer->file) != FR_OK)
+    {
+        return false;
+    }
+
+    writer->isDirty = false;
+    return true;
+}
+
+//Call periodically with the time (ms) since the last call. Flushes on timeout
+bool recordWriter_tasks(RecordWriter* writer, uint16_t elapsedTime)
+{
+    if (!writer->isDirty)
+    {
+        return true;
+    }
+
+    if ((RECORD_WRITER_FLUSH_TIMEOUT - writer->pendingTime) > elapsedTime)
+    {
+        writer->pendingTime += elapsedTime;
+        return true;
+    }
+
+    return recordWriter_flush(writer);
+}
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef RECORDWRITER_H
+#define	RECORDWRITER_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "Petite-FatFs/pff.h"
+
+//Size of the RAM buffer for records. Records are copied to the open sector when it fills
+#define RECORD_WRITER_BUFFER_SIZE 64
+
+//Time (ms) unflushed records may wait before they are programmed to the card
+#define RECORD_WRITER_FLUSH_TIMEOUT 1000
+
+    typedef struct {
+        FIL file;
+        uint8_t buffer[RECORD_WRITER_BUFFER_SIZE];
+        uint16_t bufferLen;     //Bytes in the RAM buffer
+        uint16_t pendingTime;   //Time (ms) since the oldest unflushed record was written
+        bool isDirty;           //Records have not been programmed to the card yet
+    } RecordWriter;
+
+    //Opens (or creates) a file and moves to the end to append records
+    //The file system must be mounted
+    bool recordWriter_open(RecordWriter* writer, const char* filename);
+
+    //Adds a record. The card is only programmed when a sector fills
+    bool recordWriter_write(RecordWriter* writer, const uint8_t* data, uint16_t len);
+
+    //Programs all buffered records and updates the file size on the card
+    bool recordWriter_flush(RecordWriter* writer);
+
+    //Call periodically with the time (ms) since the last call. Flushes on timeout
+    bool recordWriter_tasks(RecordWriter* writer, uint16_t elapsedTime);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* RECORDWRITER_H */
+
@@ -0,0 +1,256 @@
+#include "ringLog.h"
+#include "memoryCard.h"
+#include "mcc_generated_files/system/system.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//Decodes the header of a record. Returns 0 if the record is not valid
+static uint32_t ringLog_decodeHeader(uint8_t* header)
+{
+    uint32_t seq;
+
+    if ((header[0] | ((uint16_t) header[1] << 8)) != RING_LOG_MAGIC)
+    {
+        return 0;
+    }
+
+    seq = header[5];
+    seq = (seq << 8) | header[4];
+    seq = (seq << 8) | header[3];
+    seq = (seq << 8) | header[2];
+
+    return seq;
+}
+
+//Reads the sequence number of the record at index. Invalid records return 0
+static bool ringLog_readSequence(RingLog* log, uint32_t index, uint32_t* seq)
+{
+    uint8_t header[RING_LOG_HEADER_SIZE];
+    UINT br;
+
+    if (pf_flseek(&log->file, index * RING_LOG_RECORD_SIZE) != FR_OK)
+    {
+        return false;
+    }
+
+    if ((pf_fread(&log->file, &header[0], RING_LOG_HEADER_SIZE, &br) != FR_OK) || (br != RING_LOG_HEADER_SIZE))
+    {
+        return false;
+    }
+
+    *seq = ringLog_decodeHeader(&header[0]);
+    return true;
+}
+
+//Returns the sequence number of a record, or 0 if the header is not valid
+uint32_t ringLog_getSequence(RingLogRecord* record)
+{
+    return ringLog_decodeHeader(&record->header[0]);
+}
+
+//Opens a pre-sized log file and finds the head with a binary search over the record headers
+bool ringLog_open(RingLog* log, const char* filename)
+{
+    uint32_t seqFirst, seq, low, high, mid;
+
+    log->nRecords = 0;
+    log->erasedTo = 0;
+    log->eraseLimit = 0;
+
+    if (pf_fopen(&log->file, filename) != FR_OK)
+    {
+        return false;
+    }
+
+    log->nRecords = log->file.fsize / RING_LOG_RECORD_SIZE;
+    if (log->nRecords == 0)
+    {
+#ifdef MEM_CARD_FILE_DEBUG_ENABLE
+        printf("[RING LOG] File is smaller than one record\r\n");
+#endif
+        return false;
+    }
+
+#if PF_USE_PREALLOC
+    //If the file is contiguous, seeks do not need to read the FAT and records can be erased ahead
+    //A fragmented file still works, this only fails with FR_DENIED
+    if (pf_fprealloc(&log->file, 0) == FR_OK)
+    {
+        //Keep most of the log as history. The last record stays valid after a wrap, so the head is found again
+        log->eraseLimit = log->nRecords / RING_LOG_ERASE_FRACTION;
+        if (log->eraseLimit > RING_LOG_ERASE_RECORDS)
+        {
+            log->eraseLimit = RING_LOG_ERASE_RECORDS;
+        }
+    }
+#endif
+
+    if (!ringLog_readSequence(log, 0, &seqFirst))
+    {
+        return false;
+    }
+
+    if (seqFirst == 0)
+    {
+        //Empty log, or the first records were erased ahead of the head after a wrap
+        //Erasing stops at the end of the file, so then the last record is the newest
+        if (!ringLog_readSequence(log, log->nRecords - 1, &seq))
+        {
+            return false;
+        }
+        
+        log->head = 0;
+        log->erasedTo = 0;
+        log->nextSeq = seq + 1;
+        return true;
+    }
+
+    //Records before the head were written in the current pass (seq >= seqFirst)
+    //Records at or after the head are older or were never written
+    //Find the first record where seq < seqFirst
+    low = 1;
+    high = log->nRecords;
+    while (low < high)
+    {
+        mid = low + ((high - low) >> 1);
+
+        if (!ringLog_readSequence(log, mid, &seq))
+        {
+            return false;
+        }
+
+        if (seq >= seqFirst)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    //Sequence of the newest record
+    if (!ringLog_readSequence(log, low - 1, &seq))
+    {
+        return false;
+    }
+
+    log->head = (low == log->nRecords) ? 0 : low;
+    log->erasedTo = log->head;
+    log->nextSeq = seq + 1;
+
+#ifdef MEM_CARD_FILE_DEBUG_ENABLE
+    printf("[RING LOG] %lu records, head = %lu, next sequence = %lu\r\n", log->nRecords, log->head, log->nextSeq);
+#endif
+
+    return true;
+}
+
+//Writes a record at the head, overwriting the oldest record once the file is full
+bool ringLog_write(RingLog* log, RingLogRecord* record)
+{
+    UINT bw;
+    uint32_t seq = log->nextSeq;
+
+    if (log->nRecords == 0)
+    {
+        return false;
+    }
+
+    record->header[0] = RING_LOG_MAGIC & 0xFF;
+    record->header[1] = RING_LOG_MAGIC >> 8;
+    record->header[2] = seq & 0xFF;
+    record->header[3] = (seq >> 8) & 0xFF;
+    record->header[4] = (seq >> 16) & 0xFF;
+    record->header[5] = (seq >> 24) & 0xFF;
+
+    if (pf_flseek(&log->file, log->head * RING_LOG_RECORD_SIZE) != FR_OK)
+    {
+        return false;
+    }
+
+    //The record is exactly one sector, so this is one card write
+    if ((pf_fwrite(&log->file, (uint8_t*) record, RING_LOG_RECORD_SIZE, &bw) != FR_OK) || (bw != RING_LOG_RECORD_SIZE))
+    {
+        return false;
+    }
+
+    log->head++;
+    if (log->head >= log->nRecords)
+    {
+        //Wrap to the start of the file
+        log->head = 0;
+        log->erasedTo = 0;
+    }
+    else if (log->erasedTo < log->head)
+    {
+        log->erasedTo = log->head;
+    }
+    log->nextSeq++;
+
+    return true;
+}
+
+//Reads a record back. Age 0 is the newest record
+bool ringLog_read(RingLog* log, uint32_t age, RingLogRecord* record)
+{
+    uint32_t index;
+    UINT br;
+
+    if (age >= log->nRecords)
+    {
+        return false;
+    }
+
+    //Walk back from the head
+    index = (log->head >= (age + 1)) ? (log->head - age - 1) : (log->nRecords + log->head - age - 1);
+
+    if (pf_flseek(&log->file, index * RING_LOG_RECORD_SIZE) != FR_OK)
+    {
+        return false;
+    }
+
+    if ((pf_fread(&log->file, (uint8_t*) record, RING_LOG_RECORD_SIZE, &br) != FR_OK) || (br != RING_LOG_RECORD_SIZE))
+    {
+        return false;
+    }
+
+    return (ringLog_getSequence(record) != 0);
+}
+
+//Erases the records after the head, so the next writes go to erased sectors
+bool ringLog_eraseTasks(RingLog* log)
+{
+#if PF_USE_PREALLOC
+    uint32_t nRecords;
+    
+    //A fragmented or very small log is not erased ahead
+    //Erasing does not wrap. The records at the start of the file are erased once the head is there
+    //The window is refilled up to eraseLimit once half of it was written
+    if ((log->eraseLimit == 0) || (log->erasedTo >= log->nRecords) || ((log->erasedTo - log->head) > (log->eraseLimit >> 1)))
+    {
+        return true;
+    }
+    
+    nRecords = log->head + log->eraseLimit - log->erasedTo;
+    if (nRecords > (log->nRecords - log->erasedTo))
+    {
+        nRecords = log->nRecords - log->erasedTo;
+    }
+    
+    if (pf_ferase(&log->file, log->erasedTo * RING_LOG_RECORD_SIZE, nRecords * RING_LOG_RECORD_SIZE) != FR_OK)
+    {
+        return false;
+    }
+    
+#ifdef MEM_CARD_FILE_DEBUG_ENABLE
+    printf("[RING LOG] Erased records %lu to %lu\r\n", log->erasedTo, log->erasedTo + nRecords - 1);
+#endif
+    
+    log->erasedTo += nRecords;
+    return true;
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,71 @@
+#ifndef RINGLOG_H
+#define	RINGLOG_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "Petite-FatFs/pff.h"
+
+//Size of each record. One record is written per sector
+#define RING_LOG_RECORD_SIZE 512
+
+//Marks a sector as a valid record ("RL")
+#define RING_LOG_MAGIC 0x4C52
+
+//Record header: magic (2 bytes) + sequence number (4 bytes), little endian
+#define RING_LOG_HEADER_SIZE 6
+
+//Application bytes per record
+#define RING_LOG_PAYLOAD_SIZE (RING_LOG_RECORD_SIZE - RING_LOG_HEADER_SIZE)
+
+//Most records kept erased ahead of the head. The window is refilled once half of it was written
+#define RING_LOG_ERASE_RECORDS 32
+
+//At most 1/RING_LOG_ERASE_FRACTION of the log is erased ahead of the head
+//Logs with fewer records than this are not erased ahead
+#define RING_LOG_ERASE_FRACTION 4
+
+    typedef struct {
+        uint8_t header[RING_LOG_HEADER_SIZE]; //Set by ringLog_write
+        uint8_t data[RING_LOG_PAYLOAD_SIZE];
+    } RingLogRecord;
+
+    typedef struct {
+        FIL file;
+        uint32_t nRecords;  //Number of records (sectors) in the file
+        uint32_t head;      //Index of the next record to write
+        uint32_t nextSeq;   //Sequence number of the next record
+        uint32_t erasedTo;  //Records from the head up to this index are erased
+        uint32_t eraseLimit; //Most records erased ahead of the head. 0 if the file cannot be erased
+    } RingLog;
+
+    //Opens a pre-sized log file and finds the head with a binary search over the record headers
+    //The file system must be mounted
+    bool ringLog_open(RingLog* log, const char* filename);
+
+    //Writes a record at the head, overwriting the oldest record once the file is full
+    //The header of the record is filled in by this function
+    bool ringLog_write(RingLog* log, RingLogRecord* record);
+
+    //Reads a record back. Age 0 is the newest record
+    //Returns false if the record was never written
+    bool ringLog_read(RingLog* log, uint32_t age, RingLogRecord* record);
+
+    //Erases the records after the head, so the next writes go to erased sectors
+    //Call from the main loop when idle. The card erases in the background
+    //Only a contiguous file (see pf_fprealloc) is erased, others are skipped. Returns false if the erase failed
+    bool ringLog_eraseTasks(RingLog* log);
+
+    //Returns the sequence number of a record, or 0 if the header is not valid
+    uint32_t ringLog_getSequence(RingLogRecord* record);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* RINGLOG_H */
+
@@ -1,8 +1,46 @@
 #include "spi1_host.h"
+#include "memoryCard.h"
 
 #include <xc.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+
+//Set by SPI1_abort to end the transfer in progress
+static volatile bool transferAbort = false;
+
+#ifdef MEM_CARD_PREFETCH_ENABLE
+//DMA channels of the transfer queue (DMASELECT values). DMA1 moves received bytes, DMA2 feeds the transmitter
+#define SPI1_RX_DMA 0
+#define SPI1_TX_DMA 1
+
+//DMA start triggers (interrupt vector numbers of SPI1RX and SPI1TX)
+#define SPI1_RX_IRQ 0x18
+#define SPI1_TX_IRQ 0x19
+
+//Transaction queue (ring buffer). queue[queueHead] is the active transaction
+static SPI1_Transaction* volatile queue[SPI1_QUEUE_SIZE];
+static volatile uint8_t queueHead = 0;
+static volatile uint8_t queueCount = 0;
+
+//Received bytes of a transaction without an RX buffer
+static uint8_t rxDiscard;
+
+//Drives CS for queued transactions
+static void (*csHandler)(bool select) = NULL;
+
+//Stops both DMA channels of the queue
+static void SPI1_stopDMA(void)
+{
+    PIE2bits.DMA1DCNTIE = 0;
+    
+    DMASELECT = SPI1_RX_DMA;
+    DMAnCON0bits.EN = 0;
+    
+    DMASELECT = SPI1_TX_DMA;
+    DMAnCON0bits.EN = 0;
+}
+#endif
 
 //Initializes a SPI Host
 //I/O must be initialized separately
@@ -29,6 +67,24 @@ void SPI1_initHost(void)
     //Set Width to 8-bits (n = 0)
     SPI1TWIDTH = 0;
     
+#ifdef MEM_CARD_PREFETCH_ENABLE
+    //DMA moves the bytes of queued transactions ahead of the CPU
+    //The arbiter priorities must be locked before a DMA channel can run. The unlock sequence must not be interrupted
+    DMA1PR = 0;
+    DMA2PR = 1;
+    
+    bool isGIE = INTCON0bits.GIE;
+    INTCON0bits.GIE = 0;
+    PRLOCK = 0x55;
+    PRLOCK = 0xAA;
+    PRLOCKbits.PRLOCKED = 1;
+    INTCON0bits.GIE = isGIE;
+    
+    //The end of a transaction is handled at the card detect priority, so it cannot interrupt SPI1_abort
+    PIE2bits.DMA1DCNTIE = 0;
+    IPR2bits.DMA1DCNTIP = 1;
+#endif
+    
     //Enable SPI
     SPI1CON0bits.EN = 1;
 }
@@ -69,9 +125,51 @@ void SPI1_setSpeed(uint8_t baud)
 {
     SPI1CON0bits.EN = 0;
     SPI1BAUD = baud;
+    
+    if (!transferAbort)
+    {
+        SPI1CON0bits.EN = 1;
+    }
+}
+
+//Stops the transfer in progress. Transfers return immediately until SPI1_clearAbort is called
+//Safe to call from an interrupt
+void SPI1_abort(void)
+{
+    transferAbort = true;
+    SPI1CON0bits.EN = 0;
+    
+#ifdef MEM_CARD_PREFETCH_ENABLE
+    //Drop the queue
+    SPI1_stopDMA();
+    while (queueCount > 0)
+    {
+        SPI1_Transaction* transaction = queue[queueHead];
+        queueHead = (queueHead + 1) % SPI1_QUEUE_SIZE;
+        queueCount--;
+        
+        transaction->state = SPI1_TRANSACTION_ABORTED;
+        if (transaction->callback != NULL)
+        {
+            transaction->callback(transaction);
+        }
+    }
+#endif
+}
+
+//Allows transfers again after SPI1_abort
+void SPI1_clearAbort(void)
+{
+    transferAbort = false;
     SPI1CON0bits.EN = 1;
 }
 
+//Returns true if transfers are aborted
+bool SPI1_isAborted(void)
+{
+    return transferAbort;
+}
+
 //Sends and receives a single byte
 uint8_t SPI1_exchangeByte(uint8_t data)
 {
@@ -117,7 +215,7 @@ void SPI1_exchangeBytes(uint8_t* txData, uint8_t* rxData, uint8_t len)
     uint8_t wIndex = 1, rIndex = 0;
     
     //While counter is not zero
-    while (!SPI1INTFbits.TCZIF)
+    while ((!SPI1INTFbits.TCZIF) && (!transferAbort))
     {
         if ((PIR3bits.SPI1TXIF) && (wIndex < len))
         {
@@ -167,7 +265,7 @@ void SPI1_sendBytes(uint8_t* txData, uint16_t len)
     uint16_t wIndex = 1;
     
     //While counter is not zero
-    while (!SPI1INTFbits.TCZIF)
+    while ((!SPI1INTFbits.TCZIF) && (!transferAbort))
     {
         if ((PIR3bits.SPI1TXIF) && (wIndex < len))
         {
@@ -202,7 +300,7 @@ void SPI1_fillZeros(uint16_t len)
     uint16_t wIndex = 1;
     
     //While counter is not zero
-    while (!SPI1INTFbits.TCZIF)
+    while ((!SPI1INTFbits.TCZIF) && (!transferAbort))
     {
         if ((PIR3bits.SPI1TXIF) && (wIndex < len))
         {
@@ -233,7 +331,7 @@ void SPI1_receiveBytes(uint8_t* rxData, uint8_t len)
     uint8_t rIndex = 0;
     
     //While counter is not zero
-    while (!SPI1INTFbits.TCZIF)
+    while ((!SPI1INTFbits.TCZIF) && (!transferAbort))
     {
         //Protects against a possible edge case where a byte is received as the module stops
         if (PIR3bits.SPI1RXIF)
@@ -277,7 +375,7 @@ void SPI1_receiveBytesTransmitFF(uint8_t* rxData, uint16_t len)
     uint16_t wCount = 1;
     
     //While counter is not zero
-    while (!SPI1INTFbits.TCZIF)
+    while ((!SPI1INTFbits.TCZIF) && (!transferAbort))
     {
         if ((PIR3bits.SPI1TXIF) && (wCount < len))
         {
@@ -304,6 +402,53 @@ void SPI1_receiveBytesTransmitFF(uint8_t* rxData, uint16_t len)
     }
 }
 
+void SPI1_receiveBytesToHandler(void (*handler)(uint8_t), uint16_t len)
+{
+    //Clear data buffers
+    SPI1STATUSbits.CLRBF = 1;
+    
+    //Enable RX and TX
+    SPI1CON2bits.TXR = 1;
+    SPI1CON2bits.RXR = 1;
+    
+    //Clear status bit
+    SPI1INTFbits.TCZIF = 0;
+    
+    //Set data length
+    SPI1TCNTH = (len >> 8) & 0xFF;
+    SPI1TCNTL = len & 0xFF;
+    
+    SPI1TXB = 0xFF;
+    
+    //Write Index
+    uint16_t wCount = 1;
+    
+    //While counter is not zero
+    //If the handler is slow, the host stalls when the RX buffer is full
+    while ((!SPI1INTFbits.TCZIF) && (!transferAbort))
+    {
+        if ((PIR3bits.SPI1TXIF) && (wCount < len))
+        {
+            //TX Buffer has space, load next byte
+            SPI1TXB = 0xFF;
+            wCount++;
+        }
+        
+        if (PIR3bits.SPI1RXIF)
+        {
+            //RX Buffer Ready
+            handler(SPI1RXB);
+        }
+    }
+    
+    //Protects against a possible edge case where a byte is received as the module stops
+    if (PIR3bits.SPI1RXIF)
+    {
+        //RX Buffer Ready
+        handler(SPI1RXB);
+    }
+}
+
 //Sends 10 bytes (80 bits) worth of clock cycles for the memory card to boot
 void SPI1_sendResetSequence(void)
 {
@@ -327,7 +472,7 @@ void SPI1_sendResetSequence(void)
     uint8_t wIndex = 1;
     
     //While counter is not zero
-    while (!SPI1INTFbits.TCZIF)
+    while ((!SPI1INTFbits.TCZIF) && (!transferAbort))
     {
         if ((PIR3bits.SPI1TXIF) && (wIndex < 10))
         {
@@ -337,4 +482,160 @@ void SPI1_sendResetSequence(void)
         }
     }
 
-}
\ No newline at end of file
+}
+
+#ifdef MEM_CARD_PREFETCH_ENABLE
+//Sets the function that drives CS for queued transactions (true = select)
+void SPI1_setCSHandler(void (*handler)(bool select))
+{
+    csHandler = handler;
+}
+
+//Loads the transaction at the head of the queue into the module and the DMA channels
+static void SPI1_startTransaction(void)
+{
+    SPI1_Transaction* transaction = queue[queueHead];
+    transaction->state = SPI1_TRANSACTION_ACTIVE;
+    
+    if ((transaction->csControl & SPI1_CS_ASSERT) && (csHandler != NULL))
+    {
+        csHandler(true);
+    }
+    
+    //Clear data buffers
+    SPI1STATUSbits.CLRBF = 1;
+    
+    //Enable TX and RX. RX stalls the clock until DMA1 has read the last byte
+    SPI1CON2bits.TXR = 1;
+    SPI1CON2bits.RXR = 1;
+    
+    //Set data length
+    SPI1TCNTH = (transaction->length >> 8) & 0xFF;
+    SPI1TCNTL = transaction->length & 0xFF;
+    
+    //DMA1 - SPI1RXB to the RX buffer, stops after length bytes
+    DMASELECT = SPI1_RX_DMA;
+    DMAnCON0 = 0x00;
+    DMAnSSA = (uint24_t) &SPI1RXB;
+    DMAnSSZ = 1;
+    if (transaction->rxData != NULL)
+    {
+        //Destination increments, stop at the destination count
+        DMAnDSA = (uint16_t) transaction->rxData;
+        DMAnCON1 = 0x60;
+    }
+    else
+    {
+        //Destination fixed, stop at the destination count
+        DMAnDSA = (uint16_t) &rxDiscard;
+        DMAnCON1 = 0x20;
+    }
+    DMAnDSZ = transaction->length;
+    DMAnSIRQ = SPI1_RX_IRQ;
+    DMAnAIRQ = 0x00;
+    DMAnCON0 = 0xC0;
+    
+    //DMA2 - TX buffer (or the fill byte) to SPI1TXB, stops after length bytes
+    DMASELECT = SPI1_TX_DMA;
+    DMAnCON0 = 0x00;
+    if (transaction->txData != NULL)
+    {
+        //Source increments, stop at the source count
+        DMAnSSA = (uint24_t) transaction->txData;
+        DMAnCON1 = 0x03;
+    }
+    else
+    {
+        //Source fixed, stop at the source count
+        DMAnSSA = (uint24_t) &transaction->fillByte;
+        DMAnCON1 = 0x01;
+    }
+    DMAnSSZ = transaction->length;
+    DMAnDSA = (uint16_t) &SPI1TXB;
+    DMAnDSZ = 1;
+    DMAnSIRQ = SPI1_TX_IRQ;
+    DMAnAIRQ = 0x00;
+    
+    //Interrupt once the last byte is received
+    PIR2bits.DMA1DCNTIF = 0;
+    PIE2bits.DMA1DCNTIE = 1;
+    
+    //The first byte starts the transfer
+    DMAnCON0 = 0xC0;
+}
+
+//Adds a transaction to the queue. Returns false if the queue is full or aborted
+bool SPI1_queueTransaction(SPI1_Transaction* transaction)
+{
+    if ((transaction->length == 0) || (transferAbort))
+    {
+        return false;
+    }
+    
+    //Hold off all interrupts while the queue is changed, so the active transaction cannot finish in between
+    bool isGIE = INTCON0bits.GIE;
+    INTCON0bits.GIE = 0;
+    
+    if (queueCount >= SPI1_QUEUE_SIZE)
+    {
+        INTCON0bits.GIE = isGIE;
+        return false;
+    }
+    
+    //An empty queue has no transaction in flight. Otherwise, the interrupt starts this one in turn
+    bool isIdle = (queueCount == 0);
+    
+    transaction->state = SPI1_TRANSACTION_QUEUED;
+    queue[(queueHead + queueCount) % SPI1_QUEUE_SIZE] = transaction;
+    queueCount++;
+    
+    if (isIdle)
+    {
+        SPI1_startTransaction();
+    }
+    
+    INTCON0bits.GIE = isGIE;
+    return true;
+}
+
+//Returns true if no queued transactions remain
+bool SPI1_isQueueIdle(void)
+{
+    return (queueCount == 0);
+}
+
+//Ends the active transaction once DMA1 has received its last byte, then starts the next one
+//The bytes are moved by DMA, so this runs once per transaction and the main loop keeps running during the transfer
+void __interrupt(irq(DMA1DCNT),base(8)) SPI1_DMA_ISR(void)
+{
+    PIR2bits.DMA1DCNTIF = 0;
+    PIE2bits.DMA1DCNTIE = 0;
+    
+    if (queueCount == 0)
+    {
+        return;
+    }
+    
+    SPI1_Transaction* transaction = queue[queueHead];
+    
+    if ((transaction->csControl & SPI1_CS_RELEASE) && (csHandler != NULL))
+    {
+        csHandler(false);
+    }
+    
+    queueHead = (queueHead + 1) % SPI1_QUEUE_SIZE;
+    queueCount--;
+    
+    transaction->state = SPI1_TRANSACTION_DONE;
+    if (transaction->callback != NULL)
+    {
+        transaction->callback(transaction);
+    }
+    
+    //Start the next transaction, unless the callback queued (and started) one
+    if ((queueCount > 0) && (queue[queueHead]->state == SPI1_TRANSACTION_QUEUED))
+    {
+        SPI1_startTransaction();
+    }
+}
+#endif
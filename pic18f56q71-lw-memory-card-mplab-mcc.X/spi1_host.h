@@ -26,6 +26,37 @@ extern "C" {
 #endif
     
 #include <stdint.h>
+#include <stdbool.h>
+    
+//Number of transactions that can wait in the SPI1 queue
+//The queue uses DMA1 and DMA2, and is only built with read-ahead (MEM_CARD_PREFETCH_ENABLE)
+#define SPI1_QUEUE_SIZE 4
+    
+//CS control flags for a queued transaction
+#define SPI1_CS_ASSERT 0x01     //Select the device before the transfer
+#define SPI1_CS_RELEASE 0x02    //Release the device after the transfer
+    
+    typedef enum {
+        SPI1_TRANSACTION_IDLE = 0, SPI1_TRANSACTION_QUEUED, SPI1_TRANSACTION_ACTIVE, 
+        SPI1_TRANSACTION_DONE, SPI1_TRANSACTION_ABORTED
+    } SPI1_TransactionState;
+    
+    typedef struct SPI1_Transaction SPI1_Transaction;
+    
+    //Called from the DMA interrupt when a transaction finishes, or from SPI1_abort
+    typedef void (*SPI1_TransactionCallback)(SPI1_Transaction* transaction);
+    
+    //Transaction descriptor. Must stay in memory until the transaction is done
+    struct SPI1_Transaction {
+        uint8_t* txData;                        //Bytes to send (NULL: send fillByte)
+        uint8_t* rxData;                        //Received bytes (NULL: discard)
+        uint16_t length;                        //Number of bytes (1 or more)
+        uint8_t fillByte;                       //Sent when txData is NULL
+        uint8_t csControl;                      //SPI1_CS_ASSERT / SPI1_CS_RELEASE
+        SPI1_TransactionCallback callback;      //May be NULL
+        void* context;                          //For the callback
+        volatile SPI1_TransactionState state;
+    };
     
     //Initializes a SPI Host at 400 kHz
     //I/O must be initialized separately
@@ -38,6 +69,16 @@ extern "C" {
     //F_SPI = Fclk / (2 * (BAUD + 1))
     void SPI1_setSpeed(uint8_t baud);
     
+    //Stops the transfer in progress. Transfers return immediately until SPI1_clearAbort is called
+    //Safe to call from an interrupt
+    void SPI1_abort(void);
+    
+    //Allows transfers again after SPI1_abort
+    void SPI1_clearAbort(void);
+    
+    //Returns true if transfers are aborted
+    bool SPI1_isAborted(void);
+    
     //Sends and receives a single byte
     uint8_t SPI1_exchangeByte(uint8_t data);
     
@@ -62,6 +103,10 @@ extern "C" {
     //Receives LEN bytes, and transmits 0xFF
     void SPI1_receiveBytesTransmitFF(uint8_t* rxData, uint16_t len);
     
+    //Receives LEN bytes, and transmits 0xFF
+    //Each received byte is passed to handler instead of being stored
+    void SPI1_receiveBytesToHandler(void (*handler)(uint8_t), uint16_t len);
+    
     //Transmits a 6 byte header, then returns the next byte after
     uint8_t SPI1_sendCommand_R1(uint8_t* data);
     
@@ -71,6 +116,16 @@ extern "C" {
     //Sends 10 bytes (80 bits) worth of clock cycles for the memory card to boot
     void SPI1_sendResetSequence(void);
     
+    //Sets the function that drives CS for queued transactions (true = select)
+    void SPI1_setCSHandler(void (*handler)(bool select));
+    
+    //Adds a transaction to the queue. Returns false if the queue is full or aborted
+    //DMA moves the bytes and the DMA1 interrupt starts the next transaction. Blocking transfers must not be used until it is empty
+    bool SPI1_queueTransaction(SPI1_Transaction* transaction);
+    
+    //Returns true if no queued transactions remain
+    bool SPI1_isQueueIdle(void);
+    
 #ifdef	__cplusplus
 }
 #endif
@@ -0,0 +1,337 @@
+#include "spi2_host.h"
+
+#include <xc.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+//Second SPI host for a card slot on SPI2
+//Same transfers as spi1_host.c. The buffer status bits are polled, so no interrupt flags are used
+
+//Set by SPI2_abort to end the transfer in progress
+static volatile bool transferAbort = false;
+
+//Initializes a SPI Host
+//I/O must be initialized separately
+void SPI2_initHost(void)
+{
+    //Host Mode, Bit Mode
+    SPI2CON0 = 0x00;
+    SPI2CON0bits.MST = 1;
+    
+    //Data shifted on falling edge, SS is Active Low
+    SPI2CON1 = 0x00;
+    SPI2CON1bits.CKE = 1;
+    SPI2CON1bits.SSP = 1;
+    
+    //Clear RXR, TXR, SS is active only when CNT > 0
+    SPI2CON2 = 0x00;
+    
+    //Select HFINTOSC as Clock Source
+    SPI2CLK = 0b00001;
+    
+    //From a 64MHz clock, 400 kHz SCK
+    SPI2BAUD = 79;
+    
+    //Set Width to 8-bits (n = 0)
+    SPI2TWIDTH = 0;
+    
+    //Enable SPI
+    SPI2CON0bits.EN = 1;
+}
+
+//Initializes the I/O for the SPI Host
+void SPI2_initPins(void)
+{
+    //RD0 - SCK
+    //RD1 - SDI
+    //RD2 - SDO
+    //RD3 - CS (GPIO, see cardArray.h)
+    
+    //SCK Config
+    TRISD0 = 0;
+    ANSELD0 = 0;
+    RD0PPS = 0x20;
+    SLRCONDbits.SLRD0 = 0;
+    
+    //SDI Config
+    TRISD1 = 1;
+    ANSELD1 = 0;
+    SPI2SDIPPS = 0b011001;
+    SLRCONDbits.SLRD1 = 0;
+    
+    //SDO Config
+    TRISD2 = 0;
+    ANSELD2 = 0;
+    RD2PPS = 0x21;
+    SLRCONDbits.SLRD2 = 0;
+    
+    //CS Config (idle high)
+    LATD3 = 1;
+    TRISD3 = 0;
+    ANSELD3 = 0;
+}
+
+//Sets the clock speed of SPI2
+void SPI2_setSpeed(uint8_t baud)
+{
+    SPI2CON0bits.EN = 0;
+    SPI2BAUD = baud;
+    
+    if (!transferAbort)
+    {
+        SPI2CON0bits.EN = 1;
+    }
+}
+
+//Stops the transfer in progress. Transfers return immediately until SPI2_clearAbort is called
+//Safe to call from an interrupt
+void SPI2_abort(void)
+{
+    transferAbort = true;
+    SPI2CON0bits.EN = 0;
+}
+
+//Allows transfers again after SPI2_abort
+void SPI2_clearAbort(void)
+{
+    transferAbort = false;
+    SPI2CON0bits.EN = 1;
+}
+
+//Sends and receives a single byte
+uint8_t SPI2_exchangeByte(uint8_t data)
+{
+    uint8_t output = data;
+    SPI2_exchangeBytes(&output, &output, 1);
+    return output;
+}
+
+//Sends a single byte. Received data is discarded.
+void SPI2_sendByte(uint8_t data)
+{
+    SPI2_sendBytes(&data, 1);
+}
+
+//Send and receives LEN bytes.
+void SPI2_exchangeBytes(uint8_t* txData, uint8_t* rxData, uint8_t len)
+{
+    //Clear data buffers
+    SPI2STATUSbits.CLRBF = 1;
+    
+    //Enable TX and RX
+    SPI2CON2bits.TXR = 1;
+    SPI2CON2bits.RXR = 1;
+    
+    //Clear status bit
+    SPI2INTFbits.TCZIF = 0;
+    
+    //Load Byte 0
+    SPI2TXB = txData[0];
+    
+    //Set data length
+    SPI2TCNTL = len;
+    
+    //Write / Read Index
+    uint8_t wIndex = 1, rIndex = 0;
+    
+    //While counter is not zero
+    while ((!SPI2INTFbits.TCZIF) && (!transferAbort))
+    {
+        if ((SPI2STATUSbits.TXBE) && (wIndex < len))
+        {
+            //TX Buffer has space, load next byte (until we hit the LEN)
+            SPI2TXB = txData[wIndex];
+            wIndex++;
+        }
+        
+        if (SPI2STATUSbits.RXBF)
+        {
+            //RX Buffer Ready
+            rxData[rIndex] = SPI2RXB;
+            rIndex++;
+        }
+    }
+    
+    //Protects against a possible edge case where a byte is received as the module stops
+    if (SPI2STATUSbits.RXBF)
+    {
+        //RX Buffer Ready
+        rxData[rIndex] = SPI2RXB;
+        rIndex++;
+    }
+}
+
+//Sends LEN bytes. Received data is discarded.
+void SPI2_sendBytes(uint8_t* txData, uint16_t len)
+{
+    //Clear data buffers
+    SPI2STATUSbits.CLRBF = 1;
+    
+    //Enable TX and Disable RX
+    SPI2CON2bits.TXR = 1;
+    SPI2CON2bits.RXR = 0;
+    
+    //Clear status bit
+    SPI2INTFbits.TCZIF = 0;
+    
+    //Load Byte 0
+    SPI2TXB = txData[0];
+    
+    //Set data length
+    SPI2TCNTH = (len >> 8) & 0xFF;
+    SPI2TCNTL = len & 0xFF;
+    
+    //Write Index
+    uint16_t wIndex = 1;
+    
+    //While counter is not zero
+    while ((!SPI2INTFbits.TCZIF) && (!transferAbort))
+    {
+        if ((SPI2STATUSbits.TXBE) && (wIndex < len))
+        {
+            //TX Buffer has space, load next byte (until we hit the LEN)
+            SPI2TXB = txData[wIndex];
+            wIndex++;
+        }
+    }
+}
+
+//Transmit LEN zeros
+void SPI2_fillZeros(uint16_t len)
+{
+    //Clear data buffers
+    SPI2STATUSbits.CLRBF = 1;
+    
+    //Enable TX and Disable RX
+    SPI2CON2bits.TXR = 1;
+    SPI2CON2bits.RXR = 0;
+    
+    //Clear status bit
+    SPI2INTFbits.TCZIF = 0;
+    
+    //Load Byte 0
+    SPI2TXB = 0x00;
+    
+    //Set data length
+    SPI2TCNTH = (len >> 8) & 0xFF;
+    SPI2TCNTL = len & 0xFF;
+    
+    //Write Index
+    uint16_t wIndex = 1;
+    
+    //While counter is not zero
+    while ((!SPI2INTFbits.TCZIF) && (!transferAbort))
+    {
+        if ((SPI2STATUSbits.TXBE) && (wIndex < len))
+        {
+            //TX Buffer has space, load next byte (until we hit the LEN)
+            SPI2TXB = 0x00;
+            wIndex++;
+        }
+    }
+}
+
+//Receives LEN bytes, and transmits 0xFF
+void SPI2_receiveBytesTransmitFF(uint8_t* rxData, uint16_t len)
+{
+    //Clear data buffers
+    SPI2STATUSbits.CLRBF = 1;
+    
+    //Enable RX and TX
+    SPI2CON2bits.TXR = 1;
+    SPI2CON2bits.RXR = 1;
+    
+    //Clear status bit
+    SPI2INTFbits.TCZIF = 0;
+    
+    //Set data length
+    SPI2TCNTH = (len >> 8) & 0xFF;
+    SPI2TCNTL = len & 0xFF;
+    
+    SPI2TXB = 0xFF;
+    
+    //Write / Read Index
+    uint16_t rIndex = 0;
+    uint16_t wCount = 1;
+    
+    //While counter is not zero
+    while ((!SPI2INTFbits.TCZIF) && (!transferAbort))
+    {
+        if ((SPI2STATUSbits.TXBE) && (wCount < len))
+        {
+            //TX Buffer has space, load next byte
+            SPI2TXB = 0xFF;
+            wCount++;
+        }
+        
+        if (SPI2STATUSbits.RXBF)
+        {
+            //RX Buffer Ready
+            rxData[rIndex] = SPI2RXB;
+            rIndex++;
+        }
+    }
+    
+    //Protects against a possible edge case where a byte is received as the module stops
+    if (SPI2STATUSbits.RXBF)
+    {
+        //RX Buffer Ready
+        rxData[rIndex] = SPI2RXB;
+        rIndex++;
+    }
+}
+
+//Receives LEN bytes, and transmits 0xFF. Each byte is passed to handler
+void SPI2_receiveBytesToHandler(void (*handler)(uint8_t), uint16_t len)
+{
+    //Clear data buffers
+    SPI2STATUSbits.CLRBF = 1;
+    
+    //Enable RX and TX
+    SPI2CON2bits.TXR = 1;
+    SPI2CON2bits.RXR = 1;
+    
+    //Clear status bit
+    SPI2INTFbits.TCZIF = 0;
+    
+    //Set data length
+    SPI2TCNTH = (len >> 8) & 0xFF;
+    SPI2TCNTL = len & 0xFF;
+    
+    SPI2TXB = 0xFF;
+    
+    //Write Index
+    uint16_t wCount = 1;
+    
+    //While counter is not zero
+    //If the handler is slow, the host stalls when the RX buffer is full
+    while ((!SPI2INTFbits.TCZIF) && (!transferAbort))
+    {
+        if ((SPI2STATUSbits.TXBE) && (wCount < len))
+        {
+            //TX Buffer has space, load next byte
+            SPI2TXB = 0xFF;
+            wCount++;
+        }
+        
+        if (SPI2STATUSbits.RXBF)
+        {
+            //RX Buffer Ready
+            handler(SPI2RXB);
+        }
+    }
+    
+    //Protects against a possible edge case where a byte is received as the module stops
+    if (SPI2STATUSbits.RXBF)
+    {
+        //RX Buffer Ready
+        handler(SPI2RXB);
+    }
+}
+
+//Sends 10 bytes (80 bits) worth of clock cycles for the memory card to boot
+void SPI2_sendResetSequence(void)
+{
+    uint8_t clocks[10] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    SPI2_sendBytes(&clocks[0], 10);
+}
@@ -0,0 +1,78 @@
+/*
+ [2022] Microchip Technology Inc. and its subsidiaries.
+    Subject to your compliance with these terms, you may use Microchip 
+    software and any derivatives exclusively with Microchip products. 
+    You are responsible for complying with 3rd party license terms  
+    applicable to your use of 3rd party software (including open source  
+    software) that may accompany Microchip software. SOFTWARE IS ?AS IS.? 
+    NO WARRANTIES, WHETHER EXPRESS, IMPLIED OR STATUTORY, APPLY TO THIS 
+    SOFTWARE, INCLUDING ANY IMPLIED WARRANTIES OF NON-INFRINGEMENT,  
+    MERCHANTABILITY, OR FITNESS FOR A PARTICULAR PURPOSE. IN NO EVENT 
+    WILL MICROCHIP BE LIABLE FOR ANY INDIRECT, SPECIAL, PUNITIVE, 
+    INCIDENTAL OR CONSEQUENTIAL LOSS, DAMAGE, COST OR EXPENSE OF ANY 
+    KIND WHATSOEVER RELATED TO THE SOFTWARE, HOWEVER CAUSED, EVEN IF 
+    MICROCHIP HAS BEEN ADVISED OF THE POSSIBILITY OR THE DAMAGES ARE 
+    FORESEEABLE. TO THE FULLEST EXTENT ALLOWED BY LAW, MICROCHIP?S 
+    TOTAL LIABILITY ON ALL CLAIMS RELATED TO THE SOFTWARE WILL NOT 
+    EXCEED AMOUNT OF FEES, IF ANY, YOU PAID DIRECTLY TO MICROCHIP FOR 
+    THIS SOFTWARE.
+*/
+
+#ifndef SPI2_HOST_H
+#define	SPI2_HOST_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+    
+#include <stdint.h>
+#include <stdbool.h>
+    
+    //Initializes a SPI Host at 400 kHz
+    //I/O must be initialized separately
+    void SPI2_initHost(void);
+    
+    //Initializes the I/O for the SPI Host
+    void SPI2_initPins(void);
+    
+    //Sets the clock speed of SPI2
+    //F_SPI = Fclk / (2 * (BAUD + 1))
+    void SPI2_setSpeed(uint8_t baud);
+    
+    //Stops the transfer in progress. Transfers return immediately until SPI2_clearAbort is called
+    //Safe to call from an interrupt
+    void SPI2_abort(void);
+    
+    //Allows transfers again after SPI2_abort
+    void SPI2_clearAbort(void);
+    
+    //Sends and receives a single byte
+    uint8_t SPI2_exchangeByte(uint8_t data);
+    
+    //Sends a single byte. Received data is discarded
+    void SPI2_sendByte(uint8_t data);
+    
+    //Send and receives LEN bytes
+    void SPI2_exchangeBytes(uint8_t* txData, uint8_t* rxData, uint8_t len);
+    
+    //Sends LEN bytes. Received data is discarded
+    void SPI2_sendBytes(uint8_t* txData, uint16_t len);
+    
+    //Transmit LEN zeros
+    void SPI2_fillZeros(uint16_t len);
+    
+    //Receives LEN bytes, and transmits 0xFF
+    void SPI2_receiveBytesTransmitFF(uint8_t* rxData, uint16_t len);
+    
+    //Receives LEN bytes, and transmits 0xFF
+    //Each received byte is passed to handler instead of being stored
+    void SPI2_receiveBytesToHandler(void (*handler)(uint8_t), uint16_t len);
+    
+    //Sends 10 bytes (80 bits) worth of clock cycles for the memory card to boot
+    void SPI2_sendResetSequence(void);
+    
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* SPI2_HOST_H */
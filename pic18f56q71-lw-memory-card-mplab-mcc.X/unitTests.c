@@ -1,5 +1,6 @@
 #include "unitTests.h"
 #include "memoryCard.h"
+#include "cardArray.h"
 #include "mcc_generated_files/system/system.h"
 
 #include <stdint.h>
@@ -14,6 +15,12 @@ void unitTest_runSequence(void)
     {
         printf("-- CRC7 Tests Passed --\r\n");
     }
+    
+    printf("Stripe Map...\r\n");
+    if (unitTest_stripeMap_test())
+    {
+        printf("-- Stripe Map Tests Passed --\r\n");
+    }
 }
 
 //Tests the CRC7 Math
@@ -62,6 +69,40 @@ bool unitTest_CRC7_test(void)
     }
 
     
+    //All tests pass
+    return true;
+}
+
+//Tests the sector map of the striped card array
+bool unitTest_stripeMap_test(void)
+{
+    uint32_t cardSector;
+    uint8_t slot;
+    
+    //Every sector must map to a card and back to the same sector
+    for (uint32_t sector = 0; sector < 1024; sector++)
+    {
+        slot = cardArray_mapSector(sector, &cardSector);
+        
+        uint32_t stripe = ((cardSector / CARD_ARRAY_STRIPE_SECTORS) * CARD_ARRAY_CARDS) + slot;
+        if ((slot >= CARD_ARRAY_CARDS) || 
+            (((stripe * CARD_ARRAY_STRIPE_SECTORS) + (cardSector % CARD_ARRAY_STRIPE_SECTORS)) != sector))
+        {
+            printf("> Sector %lu Mismatch: card %u, sector %lu\r\n", sector, slot, cardSector);
+            return false;
+        }
+    }
+    printf("Round Trip OK\r\n");
+    
+    //Consecutive stripes go to the next card
+    slot = cardArray_mapSector(CARD_ARRAY_STRIPE_SECTORS, &cardSector);
+    if ((slot != (1 % CARD_ARRAY_CARDS)) || (cardSector != ((CARD_ARRAY_CARDS == 1) ? CARD_ARRAY_STRIPE_SECTORS : 0)))
+    {
+        printf("> Stripe 1 Mismatch: card %u, sector %lu\r\n", slot, cardSector);
+        return false;
+    }
+    printf("Stripe Order OK\r\n");
+    
     //All tests pass
     return true;
 }
@@ -12,6 +12,9 @@ extern "C" {
     
     //Tests the CRC7 Math
     bool unitTest_CRC7_test(void);
+    
+    //Tests the sector map of the striped card array
+    bool unitTest_stripeMap_test(void);
 
 #ifdef	__cplusplus
 }